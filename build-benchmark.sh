@@ -0,0 +1,3 @@
+SRC="src/OggIndexBench.cpp src/Decoder.cpp src/Options.cpp src/SkeletonEncoder.cpp src/Utils.cpp src/AsyncReader.cpp src/IoRing.cpp src/PageScanner.cpp src/PageChecksum.cpp src/RiceCode.cpp src/VectorUtils.cpp src/IndexCodec.cpp src/IndexReader.cpp src/SeekTable.cpp src/SeekQuery.cpp"
+
+g++ -O2 -g -Wall -D_FILE_OFFSET_BITS=64 $SRC -l ogg -l theoradec -l vorbis -l pthread -o OggIndexBench
@@ -0,0 +1,8 @@
+SRC="src/SeekQuery.cpp src/IndexReader.cpp src/SeekTable.cpp src/IndexCodec.cpp src/RiceCode.cpp src/VectorUtils.cpp src/Utils.cpp src/IoRing.cpp"
+
+mkdir -p seeklib-obj
+for f in $SRC
+do
+  g++ -O2 -g -Wall -D_FILE_OFFSET_BITS=64 -c $f -o seeklib-obj/`basename $f .cpp`.o || exit 1
+done
+ar rcs libOggSeek.a seeklib-obj/*.o
@@ -1,4 +1,4 @@
-SRC="src/Decoder.cpp src/OggIndexValid.cpp src/Options.cpp src/SkeletonEncoder.cpp src/Utils.cpp src/Validate.cpp"
+SRC="src/Decoder.cpp src/OggIndexValid.cpp src/Options.cpp src/SkeletonEncoder.cpp src/Utils.cpp src/AsyncReader.cpp src/IoRing.cpp src/PageScanner.cpp src/PageChecksum.cpp src/RiceCode.cpp src/VectorUtils.cpp src/IndexCodec.cpp src/IndexReader.cpp src/SeekTable.cpp src/Validate.cpp"
 
 if test -x `which pkg-config`
 then
@@ -6,4 +6,4 @@ then
   if test $? -eq 0; then EXTRA_FLAGS="`pkg-config --cflags --libs oggkate` -DHAVE_KATE"; else echo "libkate not found"; fi
 fi
 
-g++ $EXTRA_FLAGS -O0 -g $SRC -Wall -l ogg -l theoradec -l vorbis -o OggIndexValid
+g++ $EXTRA_FLAGS -O0 -g -D_FILE_OFFSET_BITS=64 $SRC -Wall -l ogg -l theoradec -l vorbis -l pthread -o OggIndexValid
@@ -0,0 +1,437 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+/*
+ * AsyncReader.cpp - Reads ahead on a background thread.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <iostream>
+
+#if !defined WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include "AsyncReader.hpp"
+
+AsyncReader::AsyncReader()
+  : mHead(0)
+  , mCount(0)
+  , mHolding(false)
+  , mEnd(false)
+  , mError(false)
+  , mWaits(0)
+#if defined HAVE_READER_THREAD
+#if defined HAVE_IO_URING
+  , mUseRing(false)
+  , mNextOffset(0)
+#endif
+  , mFd(-1)
+  , mStop(false)
+  , mThreadStarted(false)
+#else
+  , mFile(0)
+#endif
+  , mOwnsFile(false)
+{
+  for (int i=0; i<ASYNC_READER_BUFFERS; i++) {
+    mBuffers[i] = 0;
+    mLengths[i] = 0;
+  }
+#if defined HAVE_READER_THREAD
+  pthread_mutex_init(&mMutex, 0);
+  pthread_cond_init(&mFilled, 0);
+  pthread_cond_init(&mReleased, 0);
+#endif
+}
+
+AsyncReader::~AsyncReader()
+{
+  Close();
+#if defined HAVE_READER_THREAD
+  pthread_cond_destroy(&mReleased);
+  pthread_cond_destroy(&mFilled);
+  pthread_mutex_destroy(&mMutex);
+#endif
+}
+
+#if defined HAVE_READER_THREAD
+
+bool
+AsyncReader::Open(const char* filename, bool useIoRing)
+{
+  assert(mFd == -1);
+  if (strcmp(filename, STDIO_FILENAME) == 0) {
+    mFd = STDIN_FILENO;
+  } else {
+    mFd = open(filename, O_RDONLY);
+    if (mFd == -1) {
+      return false;
+    }
+    mOwnsFile = true;
+  }
+#if defined POSIX_FADV_SEQUENTIAL
+  // Ask for aggressive read ahead. This fails harmlessly on pipes.
+  posix_fadvise(mFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  for (int i=0; i<ASYNC_READER_BUFFERS; i++) {
+    mBuffers[i] = new char[ASYNC_READER_BUFFER_SIZE];
+  }
+#if defined HAVE_IO_URING
+  if (useIoRing && StartRing()) {
+    return true;
+  }
+#endif
+  if (pthread_create(&mThread, 0, ThreadMain, this) != 0) {
+    Close();
+    return false;
+  }
+  mThreadStarted = true;
+  return true;
+}
+
+void*
+AsyncReader::ThreadMain(void* reader)
+{
+  static_cast<AsyncReader*>(reader)->Run();
+  return 0;
+}
+
+void
+AsyncReader::Run()
+{
+  pthread_mutex_lock(&mMutex);
+  while (true) {
+    while (mCount == ASYNC_READER_BUFFERS && !mStop) {
+      pthread_cond_wait(&mReleased, &mMutex);
+    }
+    if (mStop) {
+      break;
+    }
+    // The consumer never touches the buffers after the filled ones, so we
+    // can read into the next one without holding the lock.
+    int slot = (mHead + mCount) % ASYNC_READER_BUFFERS;
+    pthread_mutex_unlock(&mMutex);
+    long bytes = Read(mBuffers[slot], ASYNC_READER_BUFFER_SIZE);
+    pthread_mutex_lock(&mMutex);
+    if (bytes <= 0) {
+      mEnd = true;
+      mError = bytes < 0;
+      pthread_cond_signal(&mFilled);
+      break;
+    }
+    mLengths[slot] = bytes;
+    mCount++;
+    pthread_cond_signal(&mFilled);
+  }
+  pthread_mutex_unlock(&mMutex);
+}
+
+long
+AsyncReader::Read(char* buffer, long length)
+{
+  while (true) {
+    ssize_t bytes = read(mFd, buffer, length);
+    if (bytes >= 0 || errno != EINTR) {
+      return (long)bytes;
+    }
+  }
+}
+
+const char*
+AsyncReader::Method() const
+{
+#if defined HAVE_IO_URING
+  if (mUseRing) {
+    return "io_uring";
+  }
+#endif
+  return "reader thread";
+}
+
+#if defined HAVE_IO_URING
+
+bool
+AsyncReader::StartRing()
+{
+  struct stat st;
+  if (fstat(mFd, &st) != 0 ||
+      !S_ISREG(st.st_mode) ||
+      !mRing.Init(ASYNC_READER_BUFFERS))
+  {
+    return false;
+  }
+  // Reads still work if the buffers can't be registered, they just aren't
+  // fixed.
+  mRing.RegisterBuffers(mBuffers, ASYNC_READER_BUFFERS,
+                        ASYNC_READER_BUFFER_SIZE);
+  mUseRing = true;
+  for (int i=0; i<ASYNC_READER_BUFFERS; i++) {
+    QueueRingRead(i);
+  }
+  return true;
+}
+
+void
+AsyncReader::QueueRingRead(int slot)
+{
+  mOffsets[slot] = mNextOffset;
+  mLengths[slot] = 0;
+  mPending[slot] = true;
+  mNextOffset += ASYNC_READER_BUFFER_SIZE;
+  bool queued = mRing.QueueRead(mFd, mBuffers[slot], slot,
+                                ASYNC_READER_BUFFER_SIZE,
+                                mOffsets[slot], slot);
+  assert(queued);
+}
+
+const char*
+AsyncReader::NextRingChunk(long* length)
+{
+  if (mHolding) {
+    // Reuse the chunk we returned last time for the next read.
+    mHolding = false;
+    if (!mEnd) {
+      QueueRingRead(mHead);
+    }
+    mHead = (mHead + 1) % ASYNC_READER_BUFFERS;
+  }
+  if (mEnd) {
+    return 0;
+  }
+  // Reads finish in any order, but the chunks must be returned in order.
+  if (mPending[mHead]) {
+    mWaits++;
+  }
+  while (mPending[mHead]) {
+    ogg_uint64_t tag;
+    int result;
+    if (!mRing.Wait(&tag, &result) || result < 0) {
+      mEnd = mError = true;
+      return 0;
+    }
+    int slot = (int)tag;
+    mLengths[slot] += result;
+    if (result == 0 || mLengths[slot] == ASYNC_READER_BUFFER_SIZE) {
+      mPending[slot] = false;
+    } else {
+      // A short read before the end of the file; read the rest.
+      bool queued = mRing.QueueRead(mFd, mBuffers[slot] + mLengths[slot],
+                                    slot,
+                                    ASYNC_READER_BUFFER_SIZE - mLengths[slot],
+                                    mOffsets[slot] + mLengths[slot], slot);
+      assert(queued);
+    }
+  }
+  if (mLengths[mHead] == 0) {
+    mEnd = true;
+    return 0;
+  }
+  mHolding = true;
+  *length = mLengths[mHead];
+  return mBuffers[mHead];
+}
+
+#endif
+
+const char*
+AsyncReader::NextChunk(long* length)
+{
+#if defined HAVE_IO_URING
+  if (mUseRing) {
+    return NextRingChunk(length);
+  }
+#endif
+  pthread_mutex_lock(&mMutex);
+  if (mHolding) {
+    // Hand the chunk we returned last time back to the reader thread.
+    mHead = (mHead + 1) % ASYNC_READER_BUFFERS;
+    mCount--;
+    mHolding = false;
+    pthread_cond_signal(&mReleased);
+  }
+  if (mCount == 0 && !mEnd) {
+    mWaits++;
+  }
+  while (mCount == 0 && !mEnd) {
+    pthread_cond_wait(&mFilled, &mMutex);
+  }
+  const char* chunk = 0;
+  if (mCount > 0) {
+    mHolding = true;
+    chunk = mBuffers[mHead];
+    *length = mLengths[mHead];
+  }
+  pthread_mutex_unlock(&mMutex);
+  return chunk;
+}
+
+bool
+AsyncReader::Failed()
+{
+  pthread_mutex_lock(&mMutex);
+  bool failed = mError;
+  pthread_mutex_unlock(&mMutex);
+  return failed;
+}
+
+void
+AsyncReader::Close()
+{
+  if (mThreadStarted) {
+    pthread_mutex_lock(&mMutex);
+    mStop = true;
+    pthread_cond_signal(&mReleased);
+    pthread_mutex_unlock(&mMutex);
+    pthread_join(mThread, 0);
+    mThreadStarted = false;
+  }
+#if defined HAVE_IO_URING
+  if (mUseRing) {
+    // Waits for the reads in flight, before we free their buffers.
+    mRing.Close();
+    mUseRing = false;
+  }
+#endif
+  if (mOwnsFile) {
+    close(mFd);
+    mOwnsFile = false;
+  }
+  mFd = -1;
+  for (int i=0; i<ASYNC_READER_BUFFERS; i++) {
+    delete[] mBuffers[i];
+    mBuffers[i] = 0;
+  }
+}
+
+#else
+
+bool
+AsyncReader::Open(const char* filename, bool useIoRing)
+{
+  assert(!mFile);
+  if (strcmp(filename, STDIO_FILENAME) == 0) {
+    mFile = stdin;
+  } else {
+    mFile = fopen(filename, "rb");
+    if (!mFile) {
+      return false;
+    }
+    mOwnsFile = true;
+  }
+  mBuffers[0] = new char[ASYNC_READER_BUFFER_SIZE];
+  return true;
+}
+
+const char*
+AsyncReader::Method() const
+{
+  return "synchronous";
+}
+
+long
+AsyncReader::Read(char* buffer, long length)
+{
+  size_t bytes = fread(buffer, 1, length, mFile);
+  if (bytes == 0 && ferror(mFile)) {
+    return -1;
+  }
+  return (long)bytes;
+}
+
+const char*
+AsyncReader::NextChunk(long* length)
+{
+  if (mEnd) {
+    return 0;
+  }
+  long bytes = Read(mBuffers[0], ASYNC_READER_BUFFER_SIZE);
+  if (bytes <= 0) {
+    mEnd = true;
+    mError = bytes < 0;
+    return 0;
+  }
+  *length = bytes;
+  return mBuffers[0];
+}
+
+bool
+AsyncReader::Failed()
+{
+  return mError;
+}
+
+void
+AsyncReader::Close()
+{
+  if (mOwnsFile) {
+    fclose(mFile);
+    mOwnsFile = false;
+  }
+  mFile = 0;
+  delete[] mBuffers[0];
+  mBuffers[0] = 0;
+}
+
+#endif
+
+bool ReadPage(ogg_sync_state* state,
+              ogg_page* page,
+              AsyncReader& reader,
+              ogg_uint64_t& bytesRead)
+{
+  ogg_uint64_t intialBytesRead = bytesRead;
+  while (ogg_sync_pageout(state, page) != 1) {
+    long bytes = 0;
+    const char* chunk = reader.NextChunk(&bytes);
+    if (!chunk) {
+      // End of file
+      if (intialBytesRead != bytesRead) {
+        cerr << "WARNING: Reached end of file, when expecting to find more data! "
+             << "Page header may be incorrect!" << endl;
+      }
+      return false;
+    }
+    char* buffer = ogg_sync_buffer(state, bytes);
+    assert(buffer);
+    memcpy(buffer, chunk, bytes);
+    bytesRead += bytes;
+    ogg_int32_t ret = ogg_sync_wrote(state, bytes);
+    assert(ret == 0);
+  }
+  return true;
+}
@@ -0,0 +1,158 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+/*
+ * AsyncReader.hpp - Reads ahead on a background thread.
+ */
+
+#ifndef __ASYNC_READER_HPP__
+#define __ASYNC_READER_HPP__
+
+#include <ogg/ogg.h>
+#include <stdio.h>
+
+#if !defined WIN32
+#include <pthread.h>
+#define HAVE_READER_THREAD
+#endif
+
+#include "Utils.hpp"
+#include "IoRing.hpp"
+
+// Number of buffers the reader thread fills ahead of its consumer.
+#define ASYNC_READER_BUFFERS 4
+
+// Size of each buffer, as much as ReadPage() reads from a stream at once.
+#define ASYNC_READER_BUFFER_SIZE (1024 * 1024)
+
+// Reads a file, or stdin, on a background thread into a ring of buffers,
+// so that reading the next chunks overlaps with decoding the pages in the
+// current one. Regular files are instead read with io_uring where it's
+// available, with a read in flight for every buffer, so a fast device has
+// several requests queued at once. Where we don't have threads, each chunk
+// is read when it's asked for.
+class AsyncReader {
+public:
+  AsyncReader();
+  ~AsyncReader();
+
+  // Starts reading filename, or stdin if it's STDIO_FILENAME. If useIoRing
+  // is false, the reader thread is used even if io_uring is available.
+  // Returns false if the file can't be opened.
+  bool Open(const char* filename, bool useIoRing = true);
+
+  // Describes how the file is being read.
+  const char* Method() const;
+
+  // Waits for the next chunk of the file, and returns it, storing its
+  // length in length. Returns 0 at the end of the file, or on a read error.
+  // The chunk is valid until the next call.
+  const char* NextChunk(long* length);
+
+  // True if reading stopped because of an error, rather than the end of
+  // the file.
+  bool Failed();
+
+  // Number of times NextChunk() had to wait for the chunk to be read, which
+  // is how often reading held up decoding.
+  ogg_int64_t Waits() const { return mWaits; }
+
+  // Stops the reader thread and closes the file.
+  void Close();
+
+private:
+  // Reads up to length bytes into buffer. Returns the number of bytes read,
+  // 0 at the end of the file, or -1 on error.
+  long Read(char* buffer, long length);
+
+  char* mBuffers[ASYNC_READER_BUFFERS];
+  long mLengths[ASYNC_READER_BUFFERS];
+
+  // Index of the first filled buffer, and the number filled, including one
+  // held by the consumer.
+  int mHead;
+  int mCount;
+
+  // True if the consumer holds the buffer at mHead.
+  bool mHolding;
+
+  // True once the reader has reached the end of the file, or an error.
+  bool mEnd;
+  bool mError;
+
+  ogg_int64_t mWaits;
+
+#if defined HAVE_READER_THREAD
+  static void* ThreadMain(void* reader);
+  void Run();
+
+#if defined HAVE_IO_URING
+  // Starts reading a regular file with io_uring. Returns false if it's not
+  // a regular file, or io_uring isn't usable.
+  bool StartRing();
+
+  // Queues a read of the next chunk of the file into buffer slot.
+  void QueueRingRead(int slot);
+
+  const char* NextRingChunk(long* length);
+
+  IoRing mRing;
+  bool mUseRing;
+  // File offset the next queued read starts at.
+  ogg_int64_t mNextOffset;
+  // Offset each buffer is being read from, and whether it's still reading.
+  ogg_int64_t mOffsets[ASYNC_READER_BUFFERS];
+  bool mPending[ASYNC_READER_BUFFERS];
+#endif
+
+  int mFd;
+  bool mStop;
+  bool mThreadStarted;
+  pthread_t mThread;
+  pthread_mutex_t mMutex;
+  // Signalled when a buffer is filled, and when one is released.
+  pthread_cond_t mFilled;
+  pthread_cond_t mReleased;
+#else
+  FILE* mFile;
+#endif
+  bool mOwnsFile;
+};
+
+// Same as ReadPage(), but reads through an AsyncReader.
+bool ReadPage(ogg_sync_state* state,
+              ogg_page* page,
+              AsyncReader& reader,
+              ogg_uint64_t& bytesRead);
+
+#endif
@@ -0,0 +1,388 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+/*
+ * Batch.cpp - Indexes many files at once.
+ */
+
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !defined WIN32
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#include "Batch.hpp"
+#include "Options.hpp"
+#include "Utils.hpp"
+
+// Extensions of the files searched for in a batch directory.
+static const char* sOggExtensions[] = {
+  ".ogg", ".ogv", ".oga", ".ogx", ".spx", ".opus", 0
+};
+
+static bool
+EndsWith(const string& s, const char* suffix) {
+  size_t n = strlen(suffix);
+  if (s.size() < n) {
+    return false;
+  }
+  for (size_t i=0; i<n; i++) {
+    if (tolower(s[s.size() - n + i]) != suffix[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool
+IsOggFilename(const string& name) {
+  // Skip our own output, so that indexing a directory again doesn't index
+  // the indexed copies.
+  if (name.find(".indexed") != string::npos) {
+    return false;
+  }
+  for (int i=0; sOggExtensions[i]; i++) {
+    if (EndsWith(name, sOggExtensions[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#if !defined WIN32
+
+// Adds the Ogg files in dir and its subdirectories to files. Symbolic links
+// to files are followed, but not links to directories, so we can't loop.
+static bool
+FindOggFiles(const string& dir, vector<string>& files) {
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    return false;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(d)) != 0) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    string path = dir + "/" + entry->d_name;
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      FindOggFiles(path, files);
+    } else if (IsOggFilename(entry->d_name) &&
+               (S_ISREG(st.st_mode) ||
+                (S_ISLNK(st.st_mode) &&
+                 stat(path.c_str(), &st) == 0 &&
+                 S_ISREG(st.st_mode))))
+    {
+      files.push_back(path);
+    }
+  }
+  closedir(d);
+  return true;
+}
+
+#endif
+
+bool
+ReadBatchList(const string& list, vector<string>& files) {
+  struct stat st;
+  if (stat(list.c_str(), &st) != 0) {
+    return false;
+  }
+  if (S_ISDIR(st.st_mode)) {
+#if defined WIN32
+    return false;
+#else
+    if (!FindOggFiles(list, files)) {
+      return false;
+    }
+    sort(files.begin(), files.end());
+    return true;
+#endif
+  }
+  ifstream input(list.c_str());
+  if (!input.good()) {
+    return false;
+  }
+  string line;
+  while (getline(input, line)) {
+    // Allow lists written on Windows.
+    if (!line.empty() && line[line.size() - 1] == '\r') {
+      line.erase(line.size() - 1);
+    }
+    if (!line.empty()) {
+      files.push_back(line);
+    }
+  }
+  return !input.bad();
+}
+
+#if defined WIN32
+
+int IndexBatch(int argc, char** argv) {
+  cerr << "ERROR: Batch indexing with -l isn't supported on Windows." << endl;
+  return -1;
+}
+
+#else
+
+struct BatchFile {
+  string name;
+  ogg_int64_t length;
+};
+
+static bool
+LongerFirst(const BatchFile& a, const BatchFile& b) {
+  return a.length > b.length;
+}
+
+// A child indexing one file, and what it has printed so far.
+struct BatchJob {
+  pid_t pid;
+  int fd;
+  BatchFile file;
+  double start;
+  string log;
+};
+
+// Returns our arguments without the batch options, to run each child with.
+static vector<string>
+ChildArguments(int argc, char** argv) {
+  vector<string> args;
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "-j") == 0) {
+      i++;
+      continue;
+    }
+    args.push_back(argv[i]);
+  }
+  return args;
+}
+
+// Starts a child indexing file, with its stdout and stderr going to a pipe
+// which job reads. Returns false if the child can't be started.
+static bool
+StartJob(const char* program,
+         const vector<string>& args,
+         const BatchFile& file,
+         BatchJob* job)
+{
+  // A filename starting with '-' would be taken as an option.
+  string name = file.name[0] == '-' ? "./" + file.name : file.name;
+  vector<char*> childArgv;
+  childArgv.push_back((char*)program);
+  for (size_t i=0; i<args.size(); i++) {
+    childArgv.push_back((char*)args[i].c_str());
+  }
+  childArgv.push_back((char*)name.c_str());
+  childArgv.push_back(0);
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  // Later children mustn't inherit this child's pipe.
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  cout.flush();
+  cerr.flush();
+  pid_t pid = fork();
+  if (pid == -1) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    execvp(program, &childArgv[0]);
+    cerr << "ERROR: Failed to run " << program << endl;
+    _exit(127);
+  }
+  close(fds[1]);
+  job->pid = pid;
+  job->fd = fds[0];
+  job->file = file;
+  job->start = WallClockSeconds();
+  job->log.clear();
+  return true;
+}
+
+// Reaps a child whose output has ended, and prints its result. Returns
+// true if it indexed its file.
+static bool
+FinishJob(BatchJob& job) {
+  close(job.fd);
+  int status = 0;
+  while (waitpid(job.pid, &status, 0) == -1 && errno == EINTR) { }
+  double seconds = WallClockSeconds() - job.start;
+  bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  cout << (ok ? "OK     " : "FAILED ") << job.file.name << " ("
+       << job.file.length << " bytes in " << seconds << "s";
+  if (WIFSIGNALED(status)) {
+    cout << ", killed by signal " << WTERMSIG(status);
+  }
+  cout << ")" << endl;
+  if (!ok) {
+    // Show what the indexer said about the file.
+    size_t start = 0;
+    while (start < job.log.size()) {
+      size_t end = job.log.find('\n', start);
+      if (end == string::npos) {
+        end = job.log.size();
+      }
+      cout << "  " << job.log.substr(start, end - start) << endl;
+      start = end + 1;
+    }
+  }
+  return ok;
+}
+
+int IndexBatch(int argc, char** argv) {
+  vector<string> names;
+  if (!ReadBatchList(gOptions.GetBatchList(), names)) {
+    cerr << "ERROR: Failed to read batch list '"
+         << gOptions.GetBatchList() << "'" << endl;
+    return -1;
+  }
+  vector<BatchFile> files(names.size());
+  for (size_t i=0; i<names.size(); i++) {
+    files[i].name = names[i];
+    files[i].length = FileLength(names[i].c_str());
+  }
+  // Start the largest files first, so that a large file started last
+  // doesn't leave the other jobs idle at the end of the batch.
+  stable_sort(files.begin(), files.end(), LongerFirst);
+
+  int jobs = gOptions.GetJobs();
+  if (jobs <= 0) {
+    jobs = max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+  }
+  // Run the children from our own executable, wherever it was found.
+  const char* program = access("/proc/self/exe", X_OK) == 0 ? "/proc/self/exe"
+                                                            : argv[0];
+  vector<string> args = ChildArguments(argc, argv);
+  cout << "Indexing " << files.size() << " files, " << jobs
+       << " at a time" << endl;
+
+  vector<BatchJob> running;
+  size_t next = 0;
+  ogg_int64_t failed = 0;
+  ogg_int64_t bytesIndexed = 0;
+  double start = WallClockSeconds();
+  while (next < files.size() || !running.empty()) {
+    while ((int)running.size() < jobs && next < files.size()) {
+      const BatchFile& file = files[next++];
+      BatchJob job;
+      if (file.length < 0) {
+        cout << "FAILED " << file.name << " (can't be read)" << endl;
+        failed++;
+      } else if (!StartJob(program, args, file, &job)) {
+        cout << "FAILED " << file.name << " (couldn't start the indexer)"
+             << endl;
+        failed++;
+      } else {
+        running.push_back(job);
+      }
+    }
+    if (running.empty()) {
+      continue;
+    }
+    vector<struct pollfd> fds(running.size());
+    for (size_t i=0; i<running.size(); i++) {
+      fds[i].fd = running[i].fd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    if (poll(&fds[0], fds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      cerr << "ERROR: Failed to wait for the indexers." << endl;
+      return -1;
+    }
+    // Go backwards, so that finished jobs can be removed as we go.
+    for (size_t i=running.size(); i-- > 0; ) {
+      if (!fds[i].revents) {
+        continue;
+      }
+      char buffer[4096];
+      ssize_t n = read(running[i].fd, buffer, sizeof(buffer));
+      if (n > 0) {
+        running[i].log.append(buffer, n);
+        continue;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      // The child has closed its output, so it has finished.
+      if (FinishJob(running[i])) {
+        bytesIndexed += running[i].file.length;
+      } else {
+        failed++;
+      }
+      running.erase(running.begin() + i);
+    }
+  }
+
+  double seconds = WallClockSeconds() - start;
+  cout << "Indexed " << (ogg_int64_t)files.size() - failed << " of "
+       << files.size() << " files, " << bytesIndexed << " bytes in "
+       << seconds << "s";
+  if (seconds > 0) {
+    cout << ", " << (bytesIndexed / seconds) / (1024 * 1024) << " MB/s";
+  }
+  cout << endl;
+  if (failed > 0) {
+    cerr << "ERROR: " << failed << " files failed to index." << endl;
+    return -1;
+  }
+  return 0;
+}
+
+#endif
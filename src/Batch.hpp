@@ -0,0 +1,61 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+/*
+ * Batch.hpp - Indexes many files at once.
+ */
+
+#ifndef __BATCH_HPP__
+#define __BATCH_HPP__
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Indexes every file named in the batch list given with -l, which is
+// either a file naming one input per line, or a directory which is searched
+// for Ogg files. Each file is indexed by a child OggIndex process, run with
+// the same options as this one, so a file which fails, or crashes the
+// indexer, doesn't stop the rest of the batch. As many children run at once
+// as -j allows, and each is handed the next file as it finishes, largest
+// files first. Prints a line for each file as it finishes, with the
+// indexer's output for those which fail, then totals for the batch.
+// Returns 0 if every file was indexed.
+int IndexBatch(int argc, char** argv);
+
+// Fills files with the inputs named by a batch list. Returns false if the
+// list can't be read.
+bool ReadBatchList(const string& list, vector<string>& files);
+
+#endif
@@ -0,0 +1,126 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+/*
+ * ContentSpool.cpp - Holds content pages read from a pipe until the
+ * skeleton track which goes in front of them has been written.
+ */
+
+#include <assert.h>
+#include <iostream>
+
+#include "ContentSpool.hpp"
+
+// Size of the chunks the temporary file is read back in.
+#define SPOOL_READ_CHUNK (1024 * 1024)
+
+ContentSpool::ContentSpool(ogg_int64_t memoryLimit)
+  : mMemoryLimit(memoryLimit)
+  , mFile(0)
+  , mFileLength(0)
+{
+}
+
+ContentSpool::~ContentSpool()
+{
+  if (mFile) {
+    fclose(mFile);
+  }
+}
+
+bool
+ContentSpool::Append(const ogg_page& page)
+{
+  return Write(page.header, page.header_len) &&
+         Write(page.body, page.body_len);
+}
+
+bool
+ContentSpool::Write(const unsigned char* data, ogg_int64_t length)
+{
+  // Fill the memory buffer first. Once anything has gone to the file,
+  // everything after it must too, to keep the pages in order.
+  if (!mFile) {
+    ogg_int64_t n = mMemoryLimit - MemoryLength();
+    if (n > length) {
+      n = length;
+    }
+    if (n > 0) {
+      mMemory.insert(mMemory.end(), data, data + n);
+      data += n;
+      length -= n;
+    }
+    if (length == 0) {
+      return true;
+    }
+    mFile = tmpfile();
+    if (!mFile) {
+      cerr << "ERROR: Failed to create a temporary file to spool content to."
+           << endl;
+      return false;
+    }
+  }
+  if (fwrite(data, 1, (size_t)length, mFile) != (size_t)length) {
+    cerr << "ERROR: Failed to spool content to a temporary file." << endl;
+    return false;
+  }
+  mFileLength += length;
+  return true;
+}
+
+bool
+ContentSpool::WriteTo(ostream& output)
+{
+  if (!mMemory.empty()) {
+    output.write((const char*)&mMemory[0], mMemory.size());
+  }
+  if (!mFile) {
+    return output.good();
+  }
+  if (fflush(mFile) != 0) {
+    return false;
+  }
+  rewind(mFile);
+  vector<char> buffer(SPOOL_READ_CHUNK);
+  ogg_int64_t remaining = mFileLength;
+  while (remaining > 0 && output.good()) {
+    size_t n = remaining < SPOOL_READ_CHUNK ? (size_t)remaining
+                                            : SPOOL_READ_CHUNK;
+    if (fread(&buffer[0], 1, n, mFile) != n) {
+      return false;
+    }
+    output.write(&buffer[0], n);
+    remaining -= n;
+  }
+  return output.good();
+}
@@ -0,0 +1,81 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+/*
+ * ContentSpool.hpp - Holds content pages read from a pipe until the
+ * skeleton track which goes in front of them has been written.
+ */
+
+#ifndef __CONTENT_SPOOL_HPP__
+#define __CONTENT_SPOOL_HPP__
+
+#include <ogg/ogg.h>
+#include <stdio.h>
+#include <ostream>
+#include <vector>
+
+using namespace std;
+
+// Bytes of content kept in memory before the rest spills to disk.
+#define DEFAULT_SPOOL_MEMORY_LIMIT (64 * 1024 * 1024)
+
+// Stores the pages of a stream which can't be read twice, such as stdin,
+// in order. The first memoryLimit bytes are kept in memory, the rest go in
+// an anonymous temporary file, which is deleted when the spool is.
+class ContentSpool {
+public:
+  ContentSpool(ogg_int64_t memoryLimit);
+  ~ContentSpool();
+
+  // Appends a page. Returns false if it couldn't be stored.
+  bool Append(const ogg_page& page);
+
+  // Writes everything spooled so far to output. Returns false on failure.
+  bool WriteTo(ostream& output);
+
+  // Total bytes spooled. The spool only grows, so this is also its peak size.
+  ogg_int64_t Length() const { return MemoryLength() + mFileLength; }
+
+  ogg_int64_t MemoryLength() const { return (ogg_int64_t)mMemory.size(); }
+  ogg_int64_t TempFileLength() const { return mFileLength; }
+
+private:
+  bool Write(const unsigned char* data, ogg_int64_t length);
+
+  vector<unsigned char> mMemory;
+  ogg_int64_t mMemoryLimit;
+  FILE* mFile;
+  ogg_int64_t mFileLength;
+};
+
+#endif
@@ -0,0 +1,245 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * DecodePipeline.cpp - Decodes each track's pages on its own thread.
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <iomanip>
+
+#include "DecodePipeline.hpp"
+
+#if defined HAVE_DECODE_THREADS
+
+PageQueue::PageQueue()
+  : mHead(0)
+  , mTail(0)
+  , mClosed(false)
+  , mPusherWaiting(false)
+  , mPopperWaiting(false)
+  , mPushed(0)
+  , mDepthSum(0)
+  , mMaxDepth(0)
+  , mPushWaits(0)
+  , mPopWaits(0)
+{
+  pthread_mutex_init(&mMutex, 0);
+  pthread_cond_init(&mNotFull, 0);
+  pthread_cond_init(&mNotEmpty, 0);
+}
+
+PageQueue::~PageQueue()
+{
+  pthread_cond_destroy(&mNotEmpty);
+  pthread_cond_destroy(&mNotFull);
+  pthread_mutex_destroy(&mMutex);
+}
+
+// A waiting thread sets its flag before it checks the queue one last time,
+// and the other thread changes the queue before it checks the flag, all in
+// sequentially consistent order. So either the waiting thread sees the
+// change, or the other thread sees the flag and signals it. The waiting
+// thread holds the lock from setting its flag until it waits, so the signal
+// can't arrive before it's waiting.
+void
+PageQueue::Wake(bool* waiting, pthread_cond_t* cond)
+{
+  if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&mMutex);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&mMutex);
+  }
+}
+
+void
+PageQueue::Push(const QueuedPage& page)
+{
+  ogg_int64_t depth = mTail - __atomic_load_n(&mHead, __ATOMIC_ACQUIRE);
+  if (depth == PAGE_QUEUE_LENGTH) {
+    mPushWaits++;
+    pthread_mutex_lock(&mMutex);
+    __atomic_store_n(&mPusherWaiting, true, __ATOMIC_SEQ_CST);
+    while (mTail - __atomic_load_n(&mHead, __ATOMIC_SEQ_CST) ==
+           PAGE_QUEUE_LENGTH) {
+      pthread_cond_wait(&mNotFull, &mMutex);
+    }
+    __atomic_store_n(&mPusherWaiting, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&mMutex);
+    depth = mTail - __atomic_load_n(&mHead, __ATOMIC_ACQUIRE);
+  }
+  mPushed++;
+  mDepthSum += depth;
+  mMaxDepth = max(mMaxDepth, depth + 1);
+  mPages[mTail % PAGE_QUEUE_LENGTH] = page;
+  __atomic_store_n(&mTail, mTail + 1, __ATOMIC_SEQ_CST);
+  Wake(&mPopperWaiting, &mNotEmpty);
+}
+
+bool
+PageQueue::Pop(QueuedPage* page)
+{
+  if (__atomic_load_n(&mTail, __ATOMIC_ACQUIRE) == mHead) {
+    pthread_mutex_lock(&mMutex);
+    __atomic_store_n(&mPopperWaiting, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&mTail, __ATOMIC_SEQ_CST) == mHead &&
+           !__atomic_load_n(&mClosed, __ATOMIC_SEQ_CST)) {
+      pthread_cond_wait(&mNotEmpty, &mMutex);
+    }
+    __atomic_store_n(&mPopperWaiting, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&mMutex);
+    if (__atomic_load_n(&mTail, __ATOMIC_ACQUIRE) == mHead) {
+      // Closed, and there's nothing left.
+      return false;
+    }
+    // Waiting at the end of the pages isn't a stall.
+    mPopWaits++;
+  }
+  *page = mPages[mHead % PAGE_QUEUE_LENGTH];
+  __atomic_store_n(&mHead, mHead + 1, __ATOMIC_SEQ_CST);
+  Wake(&mPusherWaiting, &mNotFull);
+  return true;
+}
+
+void
+PageQueue::Close()
+{
+  __atomic_store_n(&mClosed, true, __ATOMIC_SEQ_CST);
+  Wake(&mPopperWaiting, &mNotEmpty);
+}
+
+void*
+DecodePipeline::ThreadMain(void* arg)
+{
+  Track* track = (Track*)arg;
+  QueuedPage queued;
+  while (track->queue.Pop(&queued)) {
+    track->decoder->Decode(&queued.page, queued.offset);
+    if (track->copyPages) {
+      delete[] queued.page.header;
+    }
+  }
+  return 0;
+}
+
+#endif
+
+DecodePipeline::DecodePipeline(bool copyPages)
+  : mCopyPages(copyPages)
+{
+}
+
+DecodePipeline::~DecodePipeline()
+{
+  Finish();
+#if defined HAVE_DECODE_THREADS
+  map<ogg_uint32_t, Track*>::iterator itr = mTracks.begin();
+  for (; itr != mTracks.end(); itr++) {
+    delete itr->second;
+  }
+#endif
+}
+
+void
+DecodePipeline::Decode(Decoder* decoder, ogg_page* page, ogg_int64_t offset)
+{
+#if defined HAVE_DECODE_THREADS
+  ogg_uint32_t serial = decoder->GetSerial();
+  map<ogg_uint32_t, Track*>::iterator itr = mTracks.find(serial);
+  Track* track = 0;
+  if (itr == mTracks.end()) {
+    track = new Track();
+    track->decoder = decoder;
+    track->copyPages = mCopyPages;
+    track->started =
+      pthread_create(&track->thread, 0, ThreadMain, track) == 0;
+    if (!track->started) {
+      cerr << "WARNING: Failed to start a decoder thread, decoding serialno="
+           << serial << " on the reading thread." << endl;
+    }
+    mTracks[serial] = track;
+  } else {
+    track = itr->second;
+  }
+  if (track->started) {
+    QueuedPage queued;
+    queued.page = *page;
+    queued.offset = offset;
+    if (mCopyPages) {
+      // Copy the header and body into one buffer, freed once it's decoded.
+      unsigned char* data = new unsigned char[page->header_len + page->body_len];
+      memcpy(data, page->header, page->header_len);
+      memcpy(data + page->header_len, page->body, page->body_len);
+      queued.page.header = data;
+      queued.page.body = data + page->header_len;
+    }
+    track->queue.Push(queued);
+    return;
+  }
+#endif
+  decoder->Decode(page, offset);
+}
+
+void
+DecodePipeline::Finish()
+{
+#if defined HAVE_DECODE_THREADS
+  map<ogg_uint32_t, Track*>::iterator itr = mTracks.begin();
+  for (; itr != mTracks.end(); itr++) {
+    Track* track = itr->second;
+    if (track->started) {
+      track->queue.Close();
+      pthread_join(track->thread, 0);
+      track->started = false;
+    }
+  }
+#endif
+}
+
+void
+DecodePipeline::PrintStats(ostream& out)
+{
+#if defined HAVE_DECODE_THREADS
+  streamsize precision = out.precision();
+  map<ogg_uint32_t, Track*>::iterator itr = mTracks.begin();
+  for (; itr != mTracks.end(); itr++) {
+    Track* track = itr->second;
+    const PageQueue& q = track->queue;
+    out << "[" << track->decoder->TypeStr() << "] s=" << itr->first
+        << " decoded " << q.Pushed() << " pages on its own thread,"
+        << " queue depth mean " << setprecision(3) << q.MeanDepth()
+        << " max " << q.MaxDepth() << ", waited for pages " << q.PopWaits()
+        << " times, held up reading " << q.PushWaits() << " times" << endl;
+  }
+  out.precision(precision);
+#endif
+}
@@ -0,0 +1,172 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * DecodePipeline.hpp - Decodes each track's pages on its own thread.
+ */
+
+#ifndef __DECODE_PIPELINE_HPP__
+#define __DECODE_PIPELINE_HPP__
+
+#include <ogg/ogg.h>
+#include <iostream>
+#include <map>
+
+#if !defined WIN32
+#include <pthread.h>
+#define HAVE_DECODE_THREADS
+#endif
+
+#include "Decoder.hpp"
+
+using namespace std;
+
+// Number of pages which can wait in each track's queue before the thread
+// handing them out has to wait for the track's decoder to catch up.
+#define PAGE_QUEUE_LENGTH 256
+
+// A page waiting to be decoded, and its offset in the input.
+struct QueuedPage {
+  ogg_page page;
+  ogg_int64_t offset;
+};
+
+#if defined HAVE_DECODE_THREADS
+
+// Bounded queue of pages, with one thread pushing pages and another popping
+// them. Pages are pushed and popped without taking a lock; the lock is only
+// taken by a thread which must sleep because the queue is full or empty, and
+// by the thread which wakes it.
+class PageQueue {
+public:
+  PageQueue();
+  ~PageQueue();
+
+  // Adds page to the tail of the queue, waiting while the queue is full.
+  void Push(const QueuedPage& page);
+
+  // Removes the page at the head of the queue, waiting while it's empty.
+  // Returns false once the queue is empty and closed.
+  bool Pop(QueuedPage* page);
+
+  // Marks the end of the pages. Called by the pushing thread.
+  void Close();
+
+  // Number of pages pushed.
+  ogg_int64_t Pushed() const { return mPushed; }
+
+  // Mean and greatest number of pages in the queue when a page was pushed.
+  double MeanDepth() const {
+    return mPushed ? (double)mDepthSum / mPushed : 0;
+  }
+  ogg_int64_t MaxDepth() const { return mMaxDepth; }
+
+  // Number of times Push() waited for the queue to have room, and Pop()
+  // waited for a page.
+  ogg_int64_t PushWaits() const { return mPushWaits; }
+  ogg_int64_t PopWaits() const { return mPopWaits; }
+
+private:
+  // Wakes the other thread if it's waiting for the queue to change.
+  void Wake(bool* waiting, pthread_cond_t* cond);
+
+  QueuedPage mPages[PAGE_QUEUE_LENGTH];
+
+  // Count of pages ever popped, written only by the popping thread, and of
+  // pages ever pushed, written only by the pushing thread.
+  ogg_int64_t mHead;
+  ogg_int64_t mTail;
+  bool mClosed;
+
+  // True while a thread is waiting, or about to wait, on the condition.
+  bool mPusherWaiting;
+  bool mPopperWaiting;
+  pthread_mutex_t mMutex;
+  pthread_cond_t mNotFull;
+  pthread_cond_t mNotEmpty;
+
+  // Statistics, each only written by one of the threads.
+  ogg_int64_t mPushed;
+  ogg_int64_t mDepthSum;
+  ogg_int64_t mMaxDepth;
+  ogg_int64_t mPushWaits;
+  ogg_int64_t mPopWaits;
+};
+
+#endif
+
+// Decodes pages on a thread per track, so that files with several tracks
+// are decoded on several cores. The thread reading the input hands each
+// page to its track's thread through a PageQueue, and the tracks' pages are
+// each still decoded in order. A track's thread is started when its first
+// page is queued. Where we don't have threads, pages are decoded as they're
+// queued.
+class DecodePipeline {
+public:
+  // If copyPages is true, pages are copied when they're queued, because the
+  // caller reuses their memory; otherwise they must stay valid until
+  // Finish() returns.
+  DecodePipeline(bool copyPages);
+
+  // Waits for the decoders to finish, if Finish() wasn't called.
+  ~DecodePipeline();
+
+  // Queues page, at offset in the input, to be decoded by decoder.
+  void Decode(Decoder* decoder, ogg_page* page, ogg_int64_t offset);
+
+  // Waits for all queued pages to be decoded, and stops the threads.
+  void Finish();
+
+  // Prints how many pages each track's thread decoded, how full its queue
+  // was, and how often the thread waited for pages, or held up the thread
+  // queueing them, so we can see which is the bottleneck.
+  void PrintStats(ostream& out);
+
+private:
+#if defined HAVE_DECODE_THREADS
+  struct Track {
+    Decoder* decoder;
+    PageQueue queue;
+    pthread_t thread;
+    bool started;
+    bool copyPages;
+  };
+
+  static void* ThreadMain(void* track);
+
+  // Maps serialno to the track decoding it.
+  map<ogg_uint32_t, Track*> mTracks;
+#endif
+
+  bool mCopyPages;
+};
+
+#endif
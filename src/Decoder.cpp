@@ -54,8 +54,6 @@
 #include "Options.hpp"
 #include "Utils.hpp"
 #include "SkeletonEncoder.hpp"
-#include "VectorUtils.hpp"
-#include "RiceCode.hpp"
 
 // Need to index keyframe if we've not seen 1 in 64K.
 #define MIN_KEYFRAME_OFFSET (64 * 1024)
@@ -122,7 +120,7 @@ public:
   // Map from granule of a packet to the range of bytes required to
   // read that packet, including all the pages spanned by the packet.
   // For non-spanning packets, the range represents a single page.
-  RangeMap mReadRange;
+  SeekTable mReadRange;
 
   // Map from granule of a packet to the entire range of bytes
   // required to (a) correctly decode the contents of that packet and
@@ -131,39 +129,42 @@ public:
   // packet, and ends at the end of the page on which the packet ends.
   // If a granule is not listed, its range is the same as the
   // closest lower granule's.
-  RangeMap mDecodeRange;
+  SeekTable mDecodeRange;
 
   // A vector of all the granposes that must be checked in order to
   // compute mDecodeRange from mReadRange
   vector<ogg_int64_t> mGranposes;
 
-  virtual const RangeMap& GetSeekBlocks() {
-    if(mDecodeRange.size() > 0 || mReadRange.size() == 0) {
+  virtual const SeekTable& GetSeekBlocks() {
+    if(mDecodeRange.Size() > 0) {
+      // Already computed.
+      return mDecodeRange;
+    }
+    if(mReadRange.Size() == 0) {
       cerr << "Warning: Failed to produce index." << endl;
       return mDecodeRange;
     }
 
     vector<ogg_int64_t>::iterator granpos_it = mGranposes.begin();
-    RangeMap::iterator read_it = mReadRange.begin();
-    RangeMap::iterator decode_it = mDecodeRange.end();
+    mDecodeRange.Reserve(mReadRange.Size());
 
     for(;granpos_it != mGranposes.end(); ++granpos_it) {
       ogg_int64_t key_granule = (*granpos_it)>>mInfo.keyframe_granule_shift,
                  this_granule = GranuleposToGranule(*granpos_it);
-      if (key_granule >= mReadRange.begin()->first) {
+      if (key_granule >= mReadRange.Granule(0)) {
         // The range is from the start of the keyframe range to the end
         // of the target range.
         OffsetRange r;
-        read_it = --mReadRange.upper_bound(key_granule);
-        r.start = read_it->second.start;
-        read_it = --mReadRange.upper_bound(this_granule);
-        r.end = read_it->second.end;
+        ogg_int64_t read_idx = mReadRange.Find(key_granule);
+        r.start = mReadRange.Range(read_idx).start;
+        read_idx = mReadRange.Find(this_granule);
+        r.end = mReadRange.Range(read_idx).end;
         
-        if (mDecodeRange.size() == 0 || 
-           (decode_it->second.start != r.start ||
-            decode_it->second.end != r.end)) {
-          decode_it = mDecodeRange.insert(decode_it,
-                        RangePair(read_it->first, r));
+        ogg_int64_t last = mDecodeRange.Size() - 1;
+        if (last < 0 || 
+           (mDecodeRange.Range(last).start != r.start ||
+            mDecodeRange.Range(last).end != r.end)) {
+          mDecodeRange.Insert(mReadRange.Granule(read_idx), r);
         }
       }
     }
@@ -197,7 +198,6 @@ public:
     ogg_int64_t page_granulepos = ogg_page_granulepos(page);
     assert(ret == 0);
 
-    RangeMap::iterator it = mReadRange.end();
     ogg_int64_t end_offset = offset + page->header_len + page->body_len;
 
     ogg_packet packet;
@@ -264,11 +264,13 @@ public:
       ((packet_granule-mCurrentBackref)<<mInfo.keyframe_granule_shift)
                                                               | mCurrentBackref;
       
-      if (mReadRange.size() == 0 ||
-                       it->second.start != r.start || it->second.end != r.end) {
+      ogg_int64_t last = mReadRange.Size() - 1;
+      if (last < 0 ||
+          mReadRange.Range(last).start != r.start ||
+          mReadRange.Range(last).end != r.end) {
         // If this packet does not have the same range as the preceding
         // packet, then add the new range to the map.
-        it = mReadRange.insert(it, RangePair(packet_granule,r));
+        mReadRange.Insert(packet_granule, r);
         mGranposes.push_back(gp_estimate);
       }
     } // end while packetout.
@@ -875,13 +877,16 @@ bool SkeletonDecoder::Decode(ogg_page* page, ogg_int64_t offset) {
 
     if (IsIndexPacket(&packet)) {
       assert(!packet.e_o_s);
-      if (SKELETON_VERSION(SKELETON_VERSION_MAJOR,SKELETON_VERSION_MINOR) != mVersion) {
+      if (mVersion < SKELETON_VERSION(SKELETON_VERSION_MAJOR,SKELETON_VERSION_MINOR) ||
+          mVersion > SKELETON_VERSION(SKELETON_VERSION_MAJOR,SKELETON_VERSION_MINOR_CODEC)) {
         cerr << "WARNING: Encountered an index packet of version " 
              << mVersionMajor << "." << mVersionMinor
-             << ". I can only read version "
+             << ". I can only read versions "
              << SKELETON_VERSION_MAJOR << "." << SKELETON_VERSION_MINOR 
+             << " to " << SKELETON_VERSION_MAJOR << "."
+             << SKELETON_VERSION_MINOR_CODEC
              << ", so skipping index packet." << endl;
-      } else if (!::DecodeIndex(mIndex, &packet)) {
+      } else if (!::ReadIndex(mIndex, &packet, mVersion)) {
         cerr << "WARNING: Index packet " << packet.packetno << " of stream "
              << ogg_page_serialno(page) << " failed to parse." << endl;
       }
@@ -897,9 +902,9 @@ bool SkeletonDecoder::Decode(ogg_page* page, ogg_int64_t offset) {
       mVersionMinor = LEUint16(packet.packet + 10);
       mVersion = SKELETON_VERSION(mVersionMajor, mVersionMinor);
       if (mVersion < SKELETON_VERSION(3,0) ||
-          mVersion > SKELETON_VERSION(4,0)) { 
+          mVersion > SKELETON_VERSION(4,3)) { 
         cerr << "FAIL: Skeleton version " << mVersionMajor << "." << mVersionMinor   
-             << " detected. I can only handle version [3.x,4.0]" << endl;
+             << " detected. I can only handle version [3.x,4.3]" << endl;
         exit(-1);
       }
       mFileLength = LEInt64(packet.packet + SKELETON_FILE_LENGTH_OFFSET);
@@ -940,66 +945,3 @@ Decoder* Decoder::Create(ogg_page* page)
   }
   return 0;
 }
-
-bool DecodeIndex(SeekBlockIndex& index, ogg_packet* packet) {
-  assert(IsIndexPacket(packet));
-  ogg_uint32_t serialno = LEUint32(packet->packet + INDEX_SERIALNO_OFFSET);
-  ogg_int64_t numSeekPoints = LEUint64(packet->packet + INDEX_NUM_SEEKPOINTS_OFFSET);
-
-  // Ensure that the packet's not smaller or significantly larger than
-  // we expect. These cases denote a malicious or invalid num_key_points
-  // field.
-  ogg_int64_t min_packet_size = INDEX_SEEKPOINT_OFFSET + (numSeekPoints * MIN_SEEK_POINT_SIZE)/8;
-  if (packet->bytes < min_packet_size) {
-    // Packet is less than the theoretical minimum size. This means that the
-    // num_key_points field is too large for the packet to possibly contain as
-    // many packets as it claims to, so the num_key_points field is probably
-    // malicious. Don't try decoding this file, we may run out of memory.
-    cerr << "WARNING: Possibly malicious number of key points reported in index packet." << endl;
-    return false;
-  }
-
-  unsigned char offset_rice_param, granule_rice_param,
-                offset_roundoff, granule_roundoff;
-  granule_roundoff = Uint8(packet->packet + INDEX_GRANULE_ROUNDOFF);
-  granule_rice_param = Uint8(packet->packet + INDEX_GRANULE_RICE_PARAM);
-  offset_roundoff = Uint8(packet->packet + INDEX_OFFSET_ROUNDOFF);
-  offset_rice_param = Uint8(packet->packet + INDEX_OFFSET_RICE_PARAM);
-  ogg_int64_t b_max, init_offset, init_granule;
-  b_max = LEInt64(packet->packet + INDEX_MAX_EXCESS_BYTES);
-  init_offset = LEInt64(packet->packet + INDEX_INIT_OFFSET);
-  init_granule = LEInt64(packet->packet + INDEX_INIT_GRANULE);
-
-  RangeMap* seekblocks = new RangeMap();
-    
-  /* Read in key points. */
-  unsigned char* p = packet->packet + INDEX_SEEKPOINT_OFFSET;
-
-  ogg_int64_t num_bytes = packet->bytes - INDEX_SEEKPOINT_OFFSET;
-
-  vector<ogg_int64_t> offset_diffs, granule_diffs;
-  rice_read_alternate(&offset_diffs, &granule_diffs, p, num_bytes,
-                          numSeekPoints, offset_rice_param, granule_rice_param);
-  vector<ogg_int64_t> offset_integrated, granule_integrated;
-  shift_integrate(&offset_integrated, &offset_diffs, offset_roundoff,
-                                                                   init_offset);
-  shift_integrate(&granule_integrated, &granule_diffs, granule_roundoff,
-                                                                  init_granule);
-  merge_vectors(seekblocks, &offset_integrated, &granule_integrated, b_max);
-  
-  index[serialno] = seekblocks;
-  
-  assert(index[serialno] == seekblocks);
-  
-  return true;
-}
-
-void ClearSeekBlockIndex(SeekBlockIndex& index) {
-  SeekBlockIndex::iterator itr = index.begin();
-  while (itr != index.end()) {
-    RangeMap* v = itr->second;
-    delete v;
-    itr++;
-  }
-  index.clear();
-}
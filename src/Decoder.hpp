@@ -43,6 +43,12 @@
 #include <map>
 #include <vector>
 #include <ogg/ogg.h>
+#include "SeekTable.hpp"
+
+#if !defined WIN32
+#include <pthread.h>
+#define HAVE_INDEX_LOCK
+#endif
 
 using namespace std;
 
@@ -53,6 +59,11 @@ using namespace std;
 #define HEADER_MAGIC "index"
 #define HEADER_MAGIC_LEN (sizeof(HEADER_MAGIC) / sizeof(HEADER_MAGIC[0]))
 
+// Magic bytes for padding packet, which pads out the skeleton track. The
+// rest of the packet is ignored.
+#define PADDING_MAGIC "padding"
+#define PADDING_MAGIC_LEN (sizeof(PADDING_MAGIC) / sizeof(PADDING_MAGIC[0]))
+
 // Stores codec-specific skeleton info.
 class FisboneInfo {
 public:
@@ -91,33 +102,111 @@ public:
   string mName;
 };
 
-struct OffsetRange {
-  // Offset of beginning of range in bytes.
-  ogg_int64_t start;
-
-  // Offset of end of range in bytes.
-  // Special value end==-1 indicates that the endpoint is not yet
-  // known.
-  ogg_int64_t end;
+// The fixed fields of an index packet, and the location of its keypoints.
+struct IndexHeader {
+  ogg_uint32_t serialno;
+  ogg_int64_t num_seekpoints;
+  ogg_int64_t last_granpos;
+  unsigned char granule_roundoff;
+  unsigned char granule_rice_param;
+  unsigned char offset_roundoff;
+  unsigned char offset_rice_param;
+  ogg_int64_t b_max;
+  ogg_int64_t init_offset;
+  ogg_int64_t init_granule;
+
+  // Number of keypoints per block, or 0 if the keypoints aren't partitioned
+  // into blocks (Skeleton 4.0).
+  ogg_int64_t block_size;
+  ogg_int64_t num_blocks;
+  unsigned char* block_table;
+
+  // Size of each block table entry. Skeleton 4.2 entries also store the
+  // block's own Rice parameters.
+  ogg_int64_t block_entry_size;
+  bool block_rice_params;
+
+  // IndexCodecId of the coder used for the keypoints. Always CODEC_RICE
+  // before Skeleton 4.3.
+  unsigned char codec;
+
+  // The coded keypoints.
+  unsigned char* keypoints;
+  ogg_int64_t keypoints_bytes;
 };
 
-// A pair of a granule and a range of bytes
-typedef pair<ogg_int64_t,OffsetRange> RangePair;
+class PackedIndex;
 
-// A map from granules to byte ranges.  If a range is not specified
-// for a granule g, the range associated with g
-// is the one mapped to the next lower granule.
-typedef map<ogg_int64_t,OffsetRange> RangeMap;
-
-// Maps a track's serialno to its seek range map.
-typedef map<ogg_uint32_t, RangeMap*> SeekBlockIndex;
+// Maps a track's serialno to its index.
+typedef map<ogg_uint32_t, PackedIndex*> SeekBlockIndex;
 
 // Frees all memory stored in the seek block index.
 void ClearSeekBlockIndex(SeekBlockIndex& index);
 
-// Decodes an index packet, storing the decoded index in the SeekBlockIndex,
-// mapped to by the track's serialno.
-bool DecodeIndex(SeekBlockIndex& index, ogg_packet* packet);
+// A track's index packet, kept compressed until its keypoints are needed.
+// Only the packet's fixed fields are parsed when it's read; the keypoints
+// are decoded on the first call to GetTable(). Most readers only seek in one
+// track, if they seek at all, so this saves decoding and storing the rest.
+class PackedIndex {
+public:
+  PackedIndex();
+  ~PackedIndex();
+
+  // Copies the index packet and parses its header. Returns false if the
+  // header is invalid.
+  bool Init(ogg_packet* packet, ogg_uint32_t version);
+
+  const IndexHeader& GetHeader() const { return mHeader; }
+
+  // Returns the decoded keypoints, decoding them on the first call, or 0 if
+  // they fail to decode. Safe to call from several threads at once; the
+  // first call decodes while the others wait for it. Without pthreads
+  // (HAVE_INDEX_LOCK), only one thread may call it.
+  const SeekTable* GetTable() const;
+
+  // Returns true if the keypoints have been decoded.
+  bool IsDecoded() const;
+
+private:
+  vector<unsigned char> mPacket;
+  ogg_uint32_t mVersion;
+  IndexHeader mHeader;
+
+  // Decoded keypoints, or 0 if not yet decoded or they failed to decode.
+  mutable SeekTable* mTable;
+  mutable bool mDecoded;
+
+#if defined HAVE_INDEX_LOCK
+  // Guards mTable and mDecoded.
+  mutable pthread_mutex_t mMutex;
+#endif
+};
+
+// Parses and sanity checks the fixed fields of an index packet from a
+// Skeleton track of the given version. Does not decode the keypoints.
+bool ParseIndexHeader(ogg_packet* packet,
+                      ogg_uint32_t version,
+                      IndexHeader* header);
+
+// Reads an index packet, storing it in the SeekBlockIndex, mapped to by the
+// track's serialno, in place of any earlier index for the track. Only the
+// packet's header is parsed; its keypoints are decoded on demand.
+bool ReadIndex(SeekBlockIndex& index, ogg_packet* packet,
+               ogg_uint32_t version);
+
+// Decodes all the keypoints of an index packet into table.
+bool DecodeIndexKeypoints(const IndexHeader& header,
+                          ogg_uint32_t version,
+                          SeekTable* table);
+
+// Finds the last keypoint at or before granule in a block partitioned index,
+// decoding only the block which contains it. Stores the keypoint's granule and
+// its byte range. Returns false if granule is outside the indexed range, or
+// the block fails to decode.
+bool LookupIndexBlock(const IndexHeader& header,
+                      ogg_int64_t granule,
+                      ogg_int64_t* keypoint_granule,
+                      OffsetRange* range);
 
 enum StreamType {
   TYPE_UNKNOWN = 0,
@@ -158,7 +247,7 @@ public:
 
   // Returns the seek blocks for indexing. Call this after the entire stream
   // has been decoded.
-  virtual const RangeMap& GetSeekBlocks() = 0;
+  virtual const SeekTable& GetSeekBlocks() = 0;
 
   virtual StreamType Type() = 0;
   virtual const char* TypeStr() = 0;
@@ -191,6 +280,18 @@ typedef map<ogg_uint32_t, Decoder*> DecoderMap;
 #define SKELETON_FILE_LENGTH_OFFSET 64
 #define SKELETON_CONTENT_OFFSET 72
 
+// Offset of fisbone fields. All field offsets are the same between Skeleton
+// version 3 and version 4, except Radix, which doesn't exist in version 3.
+#define FISBONE_HEADERS_OFFSET_FIELD_OFFSET 8
+#define FISBONE_SERIALNO_OFFSET 12
+#define FISBONE_NUM_HEADERS_OFFSET 16
+#define FISBONE_GRAN_NUMER_OFFSET 20
+#define FISBONE_GRAN_DENOM_OFFSET 28
+#define FISBONE_START_GRAN_OFFSET 36
+#define FISBONE_PREROLL_OFFSET 44
+#define FISBONE_GRAN_SHIFT_OFFSET 48
+#define FISBONE_RADIX_OFFSET 52
+
 #define INDEX_SERIALNO_OFFSET 6
 #define INDEX_NUM_SEEKPOINTS_OFFSET 10
 #define INDEX_LAST_GRANPOS 18
@@ -203,6 +304,31 @@ typedef map<ogg_uint32_t, Decoder*> DecoderMap;
 #define INDEX_INIT_GRANULE 46
 #define INDEX_SEEKPOINT_OFFSET 54
 
+// Skeleton 4.1 index packets partition the keypoints into blocks of
+// INDEX_BLOCK_SIZE keypoints. In place of the keypoints at
+// INDEX_SEEKPOINT_OFFSET there's a table holding, for each block, the bit
+// offset of its first keypoint in the Rice coded data, and the offset and
+// granule its deltas start from. The Rice coded keypoints follow the table.
+#define INDEX_BLOCK_SIZE 54
+#define INDEX_BLOCK_TABLE_OFFSET 58
+#define INDEX_BLOCK_ENTRY_SIZE 24
+#define INDEX_BLOCK_BIT_OFFSET 0
+#define INDEX_BLOCK_BASE_OFFSET 8
+#define INDEX_BLOCK_BASE_GRANULE 16
+
+// Skeleton 4.2 index packets choose Rice parameters per block, and store
+// them at the end of each block's table entry. The parameters in the
+// packet header are then unused.
+#define INDEX_BLOCK_OFFSET_RICE_PARAM 24
+#define INDEX_BLOCK_GRANULE_RICE_PARAM 25
+#define INDEX_BLOCK_PARAMS_ENTRY_SIZE 26
+
+// Skeleton 4.3 index packets name the coder used for their keypoints in the
+// byte at INDEX_CODEC, and the coder's payload follows it. Rice coded
+// payloads carry their own parameters, so the header's are unused.
+#define INDEX_CODEC 54
+#define INDEX_CODEC_PAYLOAD_OFFSET 55
+
 // Skeleton decoder. Must have public interface, as we use this in the
 // skeleton encoder as well.
 class SkeletonDecoder : public Decoder {
@@ -229,9 +355,9 @@ public:
   
   virtual ogg_int64_t GetContentOffset() {return mContentOffset;}
 
-  RangeMap mDummy;
+  SeekTable mDummy;
 
-  virtual const RangeMap& GetSeekBlocks() {
+  virtual const SeekTable& GetSeekBlocks() {
     return mDummy;
   }
 
@@ -242,7 +368,7 @@ public:
 
   // Maps track serialno to seekpoint index, storing the seekpoint indexes
   // as they're read from the skeleton track.
-  map<ogg_uint32_t, RangeMap*> mIndex;
+  SeekBlockIndex mIndex;
 
   ogg_uint32_t GetVersion() { return mVersion; }
 
@@ -0,0 +1,571 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * IndexCodec.cpp - Entropy coders for index keypoints.
+ */
+
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include "IndexCodec.hpp"
+#include "RiceCode.hpp"
+#include "Utils.hpp"
+
+// Number of bits of precision in the rANS frequency tables.
+#define ANS_SCALE_BITS 12
+#define ANS_SCALE (1 << ANS_SCALE_BITS)
+
+// Largest frequency of any one symbol. Capping symbols at half the range
+// makes every symbol cost at least one bit, so a keypoint costs at least
+// MIN_SEEK_POINT_SIZE bits as with the other coders, and the decoder's
+// sanity check on the number of keypoints still holds.
+#define ANS_MAX_FREQ (ANS_SCALE / 2)
+
+// Lower bound of the rANS state's normalization interval.
+#define ANS_L ((ogg_uint32_t)1 << 23)
+
+// Number of symbols in the rANS alphabet; a value's symbol is its bit
+// length, 0 to 63.
+#define ANS_NUM_SYMBOLS 64
+
+// Reads a run of zero bits terminated by a one bit, consuming the zeros but
+// not the one. Returns false if the run is longer than max_zeros or runs
+// off the end of the buffer.
+static bool
+read_zero_run(BitReader& reader, unsigned max_zeros, unsigned* zeros) {
+  unsigned n = 0;
+  while (n <= max_zeros) {
+    ogg_uint64_t word = reader.PeekWord();
+    unsigned avail = reader.Available();
+    if (avail == 0) {
+      reader.SetOverrun();
+      return false;
+    }
+    if (word != 0) {
+      unsigned z = count_leading_zeros(word);
+      if (z < avail) {
+        reader.Skip(z);
+        *zeros = n + z;
+        return *zeros <= max_zeros;
+      }
+    }
+    reader.Skip(avail);
+    n += avail;
+  }
+  return false;
+}
+
+// Returns the number of significant bits in v, 0 for 0.
+static inline unsigned
+bit_length(ogg_uint64_t v) {
+  return v == 0 ? 0 : 64 - count_leading_zeros(v);
+}
+
+// Elias gamma codes v >= 1.
+static inline void
+gamma_write(BitWriter* writer, ogg_uint64_t v) {
+  assert(v >= 1);
+  unsigned n = bit_length(v) - 1;
+  writer->WriteBits(0, n);
+  writer->WriteBits(v, n + 1);
+}
+
+static inline bool
+gamma_read(BitReader& reader, ogg_uint64_t* v) {
+  unsigned n = 0;
+  if (!read_zero_run(reader, 63, &n)) {
+    return false;
+  }
+  *v = reader.ReadBits(n + 1);
+  return !reader.Overrun();
+}
+
+// Elias delta codes v >= 1.
+static inline void
+delta_write(BitWriter* writer, ogg_uint64_t v) {
+  assert(v >= 1);
+  unsigned n = bit_length(v) - 1;
+  gamma_write(writer, n + 1);
+  writer->WriteBits(v, n);
+}
+
+static inline bool
+delta_read(BitReader& reader, ogg_uint64_t* v) {
+  ogg_uint64_t length = 0;
+  if (!gamma_read(reader, &length) || length > 64) {
+    return false;
+  }
+  unsigned n = (unsigned)length - 1;
+  *v = (n < 64 ? (ogg_uint64_t)1 << n : 0) | reader.ReadBits(n);
+  return !reader.Overrun();
+}
+
+// Payload is the first and second Rice parameters, one byte each, followed
+// by the interleaved Rice codes, exactly as in a Skeleton 4.0 index packet.
+class RiceCodec : public IndexCodec {
+public:
+  virtual IndexCodecId Id() { return CODEC_RICE; }
+  virtual const char* Name() { return "rice"; }
+
+  virtual void Encode(vector<unsigned char>* out,
+                      vector<ogg_int64_t>* first,
+                      vector<ogg_int64_t>* second)
+  {
+    ogg_int64_t first_bits = 0, second_bits = 0;
+    unsigned char rice_first = optimal_rice_parameter(first, &first_bits);
+    unsigned char rice_second = optimal_rice_parameter(second, &second_bits);
+    out->assign(2 + tobytes(first_bits + second_bits), 0);
+    (*out)[0] = rice_first;
+    (*out)[1] = rice_second;
+    rice_encode_alternate_parallel(&(*out)[0] + 2, out->size() - 2,
+                                   first, second, rice_first, rice_second,
+                                   ProcessorCount());
+  }
+
+  virtual bool Decode(vector<ogg_int64_t>* first,
+                      vector<ogg_int64_t>* second,
+                      unsigned char* p,
+                      ogg_int64_t num_bytes,
+                      ogg_int64_t num_pairs)
+  {
+    if (num_bytes < 2 || p[0] > MAX_RICE_PARAM || p[1] > MAX_RICE_PARAM) {
+      return false;
+    }
+    return rice_read_alternate(first, second, p + 2, num_bytes - 2,
+                               num_pairs, p[0], p[1]);
+  }
+};
+
+// Payload is the interleaved Elias gamma codes of each value plus one.
+// Needs no parameters, but spends nearly two bits per significant bit.
+class EliasGammaCodec : public IndexCodec {
+public:
+  virtual IndexCodecId Id() { return CODEC_ELIAS_GAMMA; }
+  virtual const char* Name() { return "gamma"; }
+
+  virtual void Encode(vector<unsigned char>* out,
+                      vector<ogg_int64_t>* first,
+                      vector<ogg_int64_t>* second)
+  {
+    assert(first->size() == second->size());
+    ogg_int64_t num_bits = 0;
+    for (size_t i = 0; i < first->size(); i++) {
+      num_bits += 2 * bit_length((ogg_uint64_t)first->at(i) + 1) - 1;
+      num_bits += 2 * bit_length((ogg_uint64_t)second->at(i) + 1) - 1;
+    }
+    out->assign(tobytes(num_bits), 0);
+    BitWriter writer(out->empty() ? 0 : &(*out)[0], out->size());
+    for (size_t i = 0; i < first->size(); i++) {
+      gamma_write(&writer, (ogg_uint64_t)first->at(i) + 1);
+      gamma_write(&writer, (ogg_uint64_t)second->at(i) + 1);
+    }
+    writer.Flush();
+    assert(writer.BitsWritten() == num_bits);
+  }
+
+  virtual bool Decode(vector<ogg_int64_t>* first,
+                      vector<ogg_int64_t>* second,
+                      unsigned char* p,
+                      ogg_int64_t num_bytes,
+                      ogg_int64_t num_pairs)
+  {
+    BitReader reader(p, num_bytes);
+    first->reserve(first->size() + num_pairs);
+    second->reserve(second->size() + num_pairs);
+    for (ogg_int64_t i = 0; i < num_pairs; i++) {
+      ogg_uint64_t a = 0, b = 0;
+      if (!gamma_read(reader, &a) || !gamma_read(reader, &b)) {
+        return false;
+      }
+      first->push_back((ogg_int64_t)(a - 1));
+      second->push_back((ogg_int64_t)(b - 1));
+    }
+    return true;
+  }
+};
+
+// Payload is the interleaved Elias delta codes of each value plus one.
+class EliasDeltaCodec : public IndexCodec {
+public:
+  virtual IndexCodecId Id() { return CODEC_ELIAS_DELTA; }
+  virtual const char* Name() { return "delta"; }
+
+  virtual void Encode(vector<unsigned char>* out,
+                      vector<ogg_int64_t>* first,
+                      vector<ogg_int64_t>* second)
+  {
+    assert(first->size() == second->size());
+    ogg_int64_t num_bits = 0;
+    for (size_t i = 0; i < first->size(); i++) {
+      num_bits += DeltaBits((ogg_uint64_t)first->at(i) + 1);
+      num_bits += DeltaBits((ogg_uint64_t)second->at(i) + 1);
+    }
+    out->assign(tobytes(num_bits), 0);
+    BitWriter writer(out->empty() ? 0 : &(*out)[0], out->size());
+    for (size_t i = 0; i < first->size(); i++) {
+      delta_write(&writer, (ogg_uint64_t)first->at(i) + 1);
+      delta_write(&writer, (ogg_uint64_t)second->at(i) + 1);
+    }
+    writer.Flush();
+    assert(writer.BitsWritten() == num_bits);
+  }
+
+  virtual bool Decode(vector<ogg_int64_t>* first,
+                      vector<ogg_int64_t>* second,
+                      unsigned char* p,
+                      ogg_int64_t num_bytes,
+                      ogg_int64_t num_pairs)
+  {
+    BitReader reader(p, num_bytes);
+    first->reserve(first->size() + num_pairs);
+    second->reserve(second->size() + num_pairs);
+    for (ogg_int64_t i = 0; i < num_pairs; i++) {
+      ogg_uint64_t a = 0, b = 0;
+      if (!delta_read(reader, &a) || !delta_read(reader, &b)) {
+        return false;
+      }
+      first->push_back((ogg_int64_t)(a - 1));
+      second->push_back((ogg_int64_t)(b - 1));
+    }
+    return true;
+  }
+
+private:
+  static ogg_int64_t DeltaBits(ogg_uint64_t v) {
+    unsigned n = bit_length(v) - 1;
+    return 2 * bit_length(n + 1) - 1 + n;
+  }
+};
+
+// Frequency table for one rANS context.
+struct AnsTable {
+  ogg_uint32_t freq[ANS_NUM_SYMBOLS];
+  ogg_uint32_t start[ANS_NUM_SYMBOLS];
+  // Number of symbols stored in the packet; symbols above this have zero
+  // frequency.
+  unsigned num_symbols;
+
+  // Builds a table from symbol counts, scaling the frequencies so they sum
+  // to ANS_SCALE while keeping every symbol which occurs codeable.
+  void Build(const ogg_int64_t* counts, ogg_int64_t total) {
+    memset(freq, 0, sizeof(freq));
+    num_symbols = 0;
+    if (total == 0) {
+      SetStarts();
+      return;
+    }
+    ogg_int64_t sum = 0;
+    for (unsigned s = 0; s < ANS_NUM_SYMBOLS; s++) {
+      if (counts[s] == 0) {
+        continue;
+      }
+      freq[s] = (ogg_uint32_t)max((ogg_int64_t)1,
+                                  (counts[s] * ANS_SCALE) / total);
+      freq[s] = min(freq[s], (ogg_uint32_t)ANS_MAX_FREQ);
+      sum += freq[s];
+      num_symbols = s + 1;
+    }
+    // Rounding leaves the sum off by at most one per symbol. Settle the
+    // difference against the most frequent symbols, which have the most
+    // slack and where the change costs the least. If only one symbol
+    // occurs it can't take the whole range, so a neighbour gets the rest.
+    while (sum != ANS_SCALE) {
+      int target = -1;
+      for (unsigned s = 0; s < num_symbols; s++) {
+        bool usable = sum < ANS_SCALE ? freq[s] < ANS_MAX_FREQ : freq[s] > 1;
+        if (freq[s] > 0 && usable &&
+            (target == -1 || freq[s] > freq[target])) {
+          target = s;
+        }
+      }
+      if (target == -1) {
+        target = num_symbols < ANS_NUM_SYMBOLS ? num_symbols : 0;
+        num_symbols = max(num_symbols, (unsigned)target + 1);
+      }
+      ogg_int64_t d = sum < ANS_SCALE
+                    ? min(ANS_SCALE - sum,
+                          (ogg_int64_t)(ANS_MAX_FREQ - freq[target]))
+                    : -min(sum - ANS_SCALE, (ogg_int64_t)freq[target] - 1);
+      freq[target] += (ogg_uint32_t)d;
+      sum += d;
+    }
+    SetStarts();
+  }
+
+  void SetStarts() {
+    ogg_uint32_t s = 0;
+    for (unsigned i = 0; i < ANS_NUM_SYMBOLS; i++) {
+      start[i] = s;
+      s += freq[i];
+    }
+  }
+
+  ogg_int64_t SerializedSize() const {
+    return 1 + 2 * num_symbols;
+  }
+
+  unsigned char* Write(unsigned char* p) const {
+    p = WriteUint8(p, (unsigned char)num_symbols);
+    for (unsigned s = 0; s < num_symbols; s++) {
+      p = WriteLEUint16(p, (ogg_uint16_t)freq[s]);
+    }
+    return p;
+  }
+
+  // Reads a table from the packet. Returns 0 if it's malformed or doesn't
+  // fit, or a pointer to the byte after the table.
+  unsigned char* Read(unsigned char* p, unsigned char* end, bool required) {
+    memset(freq, 0, sizeof(freq));
+    if (p >= end) {
+      return 0;
+    }
+    num_symbols = Uint8(p++);
+    if (num_symbols > ANS_NUM_SYMBOLS || end - p < 2 * num_symbols) {
+      return 0;
+    }
+    ogg_uint32_t sum = 0;
+    for (unsigned s = 0; s < num_symbols; s++, p += 2) {
+      freq[s] = LEUint16(p);
+      if (freq[s] > ANS_MAX_FREQ) {
+        return 0;
+      }
+      sum += freq[s];
+    }
+    if (required ? sum != ANS_SCALE : sum != 0) {
+      return 0;
+    }
+    SetStarts();
+    return p;
+  }
+};
+
+// Payload is a rANS (range asymmetric numeral system) coded stream of each
+// value's bit length, modelled separately for the first and second values,
+// followed by the bits below each value's leading one bit, stored raw:
+//
+//   first table: symbol count (1 byte), then frequency (2 bytes LE) each.
+//   second table: as above.
+//   rANS stream length (4 bytes LE).
+//   rANS stream, state first, big endian.
+//   raw low-order bits, first value then second, most significant first.
+//
+// Closest to the entropy of the keypoint deltas, at the cost of a table per
+// packet and a division per symbol on encode.
+class AnsCodec : public IndexCodec {
+public:
+  virtual IndexCodecId Id() { return CODEC_ANS; }
+  virtual const char* Name() { return "ans"; }
+
+  virtual void Encode(vector<unsigned char>* out,
+                      vector<ogg_int64_t>* first,
+                      vector<ogg_int64_t>* second)
+  {
+    assert(first->size() == second->size());
+    ogg_int64_t n = first->size();
+
+    ogg_int64_t first_counts[ANS_NUM_SYMBOLS];
+    ogg_int64_t second_counts[ANS_NUM_SYMBOLS];
+    memset(first_counts, 0, sizeof(first_counts));
+    memset(second_counts, 0, sizeof(second_counts));
+    ogg_int64_t raw_bits = 0;
+    for (ogg_int64_t i = 0; i < n; i++) {
+      unsigned a = bit_length(first->at(i));
+      unsigned b = bit_length(second->at(i));
+      first_counts[a]++;
+      second_counts[b]++;
+      raw_bits += (a > 0 ? a - 1 : 0) + (b > 0 ? b - 1 : 0);
+    }
+    AnsTable first_table, second_table;
+    first_table.Build(first_counts, n);
+    second_table.Build(second_counts, n);
+
+    // rANS is last-in first-out, so code the symbols in reverse. The
+    // stream is built back to front and reversed at the end.
+    vector<unsigned char> stream;
+    stream.reserve(n / 2 + 16);
+    ogg_uint32_t x = ANS_L;
+    for (ogg_int64_t i = n - 1; i >= 0; i--) {
+      Put(&stream, &x, second_table, bit_length(second->at(i)));
+      Put(&stream, &x, first_table, bit_length(first->at(i)));
+    }
+    for (int shift = 0; shift < 32; shift += 8) {
+      stream.push_back((unsigned char)(x >> shift));
+    }
+    reverse(stream.begin(), stream.end());
+
+    ogg_int64_t header = first_table.SerializedSize() +
+                         second_table.SerializedSize() + 4;
+    out->assign(header + stream.size() + tobytes(raw_bits), 0);
+    unsigned char* p = &(*out)[0];
+    p = first_table.Write(p);
+    p = second_table.Write(p);
+    p = WriteLEUint32(p, (ogg_uint32_t)stream.size());
+    memcpy(p, &stream[0], stream.size());
+    p += stream.size();
+
+    BitWriter writer(p, &(*out)[0] + out->size() - p);
+    for (ogg_int64_t i = 0; i < n; i++) {
+      WriteLowBits(&writer, first->at(i));
+      WriteLowBits(&writer, second->at(i));
+    }
+    writer.Flush();
+    assert(writer.BitsWritten() == raw_bits);
+  }
+
+  virtual bool Decode(vector<ogg_int64_t>* first,
+                      vector<ogg_int64_t>* second,
+                      unsigned char* p,
+                      ogg_int64_t num_bytes,
+                      ogg_int64_t num_pairs)
+  {
+    unsigned char* end = p + num_bytes;
+    AnsTable first_table, second_table;
+    p = first_table.Read(p, end, num_pairs > 0);
+    if (!p) {
+      return false;
+    }
+    p = second_table.Read(p, end, num_pairs > 0);
+    if (!p || end - p < 4) {
+      return false;
+    }
+    ogg_uint32_t stream_length = LEUint32(p);
+    p += 4;
+    if (stream_length < 4 || end - p < stream_length) {
+      return false;
+    }
+    unsigned char* stream = p;
+    unsigned char* stream_end = p + stream_length;
+
+    unsigned char first_slots[ANS_SCALE];
+    unsigned char second_slots[ANS_SCALE];
+    FillSlots(first_slots, first_table);
+    FillSlots(second_slots, second_table);
+
+    ogg_uint32_t x = 0;
+    for (int i = 0; i < 4; i++) {
+      x = (x << 8) | *stream++;
+    }
+
+    BitReader reader(stream_end, end - stream_end);
+    first->reserve(first->size() + num_pairs);
+    second->reserve(second->size() + num_pairs);
+    for (ogg_int64_t i = 0; i < num_pairs; i++) {
+      unsigned a, b;
+      if (!Get(&stream, stream_end, &x, first_table, first_slots, &a) ||
+          !Get(&stream, stream_end, &x, second_table, second_slots, &b)) {
+        return false;
+      }
+      first->push_back(ReadLowBits(reader, a));
+      second->push_back(ReadLowBits(reader, b));
+    }
+    return !reader.Overrun();
+  }
+
+private:
+  static void Put(vector<unsigned char>* stream,
+                  ogg_uint32_t* x,
+                  const AnsTable& table,
+                  unsigned s)
+  {
+    ogg_uint32_t freq = table.freq[s];
+    assert(freq > 0);
+    ogg_uint32_t x_max = ((ANS_L >> ANS_SCALE_BITS) << 8) * freq;
+    while (*x >= x_max) {
+      stream->push_back((unsigned char)*x);
+      *x >>= 8;
+    }
+    *x = ((*x / freq) << ANS_SCALE_BITS) + (*x % freq) + table.start[s];
+  }
+
+  static bool Get(unsigned char** stream,
+                  unsigned char* stream_end,
+                  ogg_uint32_t* x,
+                  const AnsTable& table,
+                  const unsigned char* slots,
+                  unsigned* s)
+  {
+    ogg_uint32_t slot = *x & (ANS_SCALE - 1);
+    *s = slots[slot];
+    *x = table.freq[*s] * (*x >> ANS_SCALE_BITS) + slot - table.start[*s];
+    while (*x < ANS_L) {
+      if (*stream >= stream_end) {
+        return false;
+      }
+      *x = (*x << 8) | *(*stream)++;
+    }
+    return true;
+  }
+
+  static void FillSlots(unsigned char* slots, const AnsTable& table) {
+    for (unsigned s = 0; s < table.num_symbols; s++) {
+      memset(slots + table.start[s], s, table.freq[s]);
+    }
+  }
+
+  // Writes the bits of v below its leading one bit.
+  static void WriteLowBits(BitWriter* writer, ogg_int64_t v) {
+    unsigned n = bit_length(v);
+    if (n > 1) {
+      writer->WriteBits((ogg_uint64_t)v, n - 1);
+    }
+  }
+
+  static ogg_int64_t ReadLowBits(BitReader& reader, unsigned length) {
+    if (length == 0) {
+      return 0;
+    }
+    ogg_uint64_t high = (ogg_uint64_t)1 << (length - 1);
+    return (ogg_int64_t)(high | reader.ReadBits(length - 1));
+  }
+};
+
+IndexCodec* IndexCodec::Create(unsigned char id) {
+  switch (id) {
+    case CODEC_RICE: return new RiceCodec();
+    case CODEC_ELIAS_GAMMA: return new EliasGammaCodec();
+    case CODEC_ELIAS_DELTA: return new EliasDeltaCodec();
+    case CODEC_ANS: return new AnsCodec();
+    default: return 0;
+  }
+}
+
+int IndexCodec::IdFromName(const char* name) {
+  for (int id = 0; id <= CODEC_MAX; id++) {
+    IndexCodec* codec = IndexCodec::Create(id);
+    bool match = strcmp(codec->Name(), name) == 0;
+    delete codec;
+    if (match) {
+      return id;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,87 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * IndexCodec.hpp - Entropy coders for index keypoints.
+ */
+
+#ifndef __INDEX_CODEC_HPP__
+#define __INDEX_CODEC_HPP__
+
+#include <vector>
+#include <ogg/ogg.h>
+
+using namespace std;
+
+// Identifies the coder used for the keypoints of a Skeleton 4.3 index
+// packet. Skeleton 4.0 to 4.2 index packets are always Rice coded.
+enum IndexCodecId {
+  CODEC_RICE = 0,
+  CODEC_ELIAS_GAMMA = 1,
+  CODEC_ELIAS_DELTA = 2,
+  CODEC_ANS = 3,
+  CODEC_MAX = CODEC_ANS
+};
+
+// Superclass for index keypoint coders. A coder codes two interleaved
+// streams of non-negative deltas, the offset and granule deltas of each
+// keypoint, into a self-describing block of bytes.
+class IndexCodec {
+public:
+  virtual ~IndexCodec() {}
+
+  // Factory, creates the coder with the given id, or returns 0 if the id is
+  // unknown.
+  static IndexCodec* Create(unsigned char id);
+
+  // Returns the coder id for a name as given on the command line, or -1 if
+  // the name is unknown.
+  static int IdFromName(const char* name);
+
+  virtual IndexCodecId Id() = 0;
+  virtual const char* Name() = 0;
+
+  // Codes first and second, which must have the same length, replacing the
+  // contents of out.
+  virtual void Encode(vector<unsigned char>* out,
+                      vector<ogg_int64_t>* first,
+                      vector<ogg_int64_t>* second) = 0;
+
+  // Decodes num_pairs pairs from num_bytes at p, appending them to first
+  // and second. Returns false if the data is truncated or malformed.
+  virtual bool Decode(vector<ogg_int64_t>* first,
+                      vector<ogg_int64_t>* second,
+                      unsigned char* p,
+                      ogg_int64_t num_bytes,
+                      ogg_int64_t num_pairs) = 0;
+};
+
+#endif
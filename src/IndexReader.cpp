@@ -0,0 +1,439 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * IndexReader.cpp - Parsing and decoding of Skeleton index packets.
+ *
+ * The index packet parsing was moved here from Decoder.cpp, which was
+ * written by Chris Pearce <chris@pearce.org.nz>.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+#include <ogg/ogg.h>
+
+#include "Utils.hpp"
+#include "Decoder.hpp"
+#include "SkeletonEncoder.hpp"
+#include "VectorUtils.hpp"
+#include "RiceCode.hpp"
+#include "IndexCodec.hpp"
+
+using namespace std;
+
+bool ParseIndexHeader(ogg_packet* packet,
+                      ogg_uint32_t version,
+                      IndexHeader* header)
+{
+  assert(IsIndexPacket(packet));
+  // Only Skeleton 4.1 and 4.2 index packets are partitioned into blocks;
+  // Skeleton 4.3 packets leave the layout of the keypoints to their coder.
+  bool blocked =
+    version == SKELETON_VERSION(SKELETON_VERSION_MAJOR,
+                                SKELETON_VERSION_MINOR_BLOCKED) ||
+    version == SKELETON_VERSION(SKELETON_VERSION_MAJOR,
+                                SKELETON_VERSION_MINOR_BLOCK_PARAMS);
+  bool coded = version >= SKELETON_VERSION(SKELETON_VERSION_MAJOR,
+                                           SKELETON_VERSION_MINOR_CODEC);
+  ogg_int64_t min_size = INDEX_SEEKPOINT_OFFSET;
+  if (blocked) {
+    min_size = INDEX_BLOCK_TABLE_OFFSET;
+  } else if (coded) {
+    min_size = INDEX_CODEC_PAYLOAD_OFFSET;
+  }
+  if (packet->bytes < min_size) {
+    cerr << "WARNING: Index packet is too short to hold its header." << endl;
+    return false;
+  }
+  header->serialno = LEUint32(packet->packet + INDEX_SERIALNO_OFFSET);
+  header->num_seekpoints = LEUint64(packet->packet + INDEX_NUM_SEEKPOINTS_OFFSET);
+  header->last_granpos = LEInt64(packet->packet + INDEX_LAST_GRANPOS);
+  header->granule_roundoff = Uint8(packet->packet + INDEX_GRANULE_ROUNDOFF);
+  header->granule_rice_param = Uint8(packet->packet + INDEX_GRANULE_RICE_PARAM);
+  header->offset_roundoff = Uint8(packet->packet + INDEX_OFFSET_ROUNDOFF);
+  header->offset_rice_param = Uint8(packet->packet + INDEX_OFFSET_RICE_PARAM);
+  header->b_max = LEInt64(packet->packet + INDEX_MAX_EXCESS_BYTES);
+  header->init_offset = LEInt64(packet->packet + INDEX_INIT_OFFSET);
+  header->init_granule = LEInt64(packet->packet + INDEX_INIT_GRANULE);
+  header->block_size = 0;
+  header->num_blocks = 0;
+  header->block_table = 0;
+  header->block_rice_params =
+    version == SKELETON_VERSION(SKELETON_VERSION_MAJOR,
+                                SKELETON_VERSION_MINOR_BLOCK_PARAMS);
+  header->block_entry_size = header->block_rice_params
+                           ? INDEX_BLOCK_PARAMS_ENTRY_SIZE
+                           : INDEX_BLOCK_ENTRY_SIZE;
+  header->codec = CODEC_RICE;
+  header->keypoints = packet->packet + INDEX_SEEKPOINT_OFFSET;
+
+  if (header->num_seekpoints < 0) {
+    cerr << "WARNING: Negative number of key points reported in index packet." << endl;
+    return false;
+  }
+
+  // Skeleton 4.2 and 4.3 packets keep their Rice parameters elsewhere, and
+  // leave these fields unused.
+  if (!header->block_rice_params && !coded &&
+      (header->offset_rice_param > MAX_RICE_PARAM ||
+       header->granule_rice_param > MAX_RICE_PARAM)) {
+    cerr << "WARNING: Invalid Rice parameter in index packet." << endl;
+    return false;
+  }
+
+  ogg_int64_t header_size = INDEX_SEEKPOINT_OFFSET;
+  if (blocked) {
+    header->block_size = LEUint32(packet->packet + INDEX_BLOCK_SIZE);
+    if (header->block_size == 0) {
+      cerr << "WARNING: Index packet has a zero block size." << endl;
+      return false;
+    }
+    header->num_blocks = (header->num_seekpoints + header->block_size - 1) /
+                         header->block_size;
+    header->block_table = packet->packet + INDEX_BLOCK_TABLE_OFFSET;
+    if (header->num_blocks > (packet->bytes - INDEX_BLOCK_TABLE_OFFSET) /
+                             header->block_entry_size) {
+      cerr << "WARNING: Index packet is too short to hold its block table." << endl;
+      return false;
+    }
+    header_size = INDEX_BLOCK_TABLE_OFFSET +
+                  header->num_blocks * header->block_entry_size;
+    header->keypoints = packet->packet + header_size;
+  } else if (coded) {
+    header->codec = Uint8(packet->packet + INDEX_CODEC);
+    if (header->codec > CODEC_MAX) {
+      cerr << "WARNING: Unknown keypoint coder " << (int)header->codec
+           << " in index packet." << endl;
+      return false;
+    }
+    header_size = INDEX_CODEC_PAYLOAD_OFFSET;
+    header->keypoints = packet->packet + header_size;
+  }
+  header->keypoints_bytes = packet->bytes - header_size;
+
+  // Ensure that the packet's not smaller or significantly larger than
+  // we expect. These cases denote a malicious or invalid num_key_points
+  // field.
+  if (header->num_seekpoints >
+      (header->keypoints_bytes * 8) / MIN_SEEK_POINT_SIZE) {
+    // Packet is less than the theoretical minimum size. This means that the
+    // num_key_points field is too large for the packet to possibly contain as
+    // many packets as it claims to, so the num_key_points field is probably
+    // malicious. Don't try decoding this file, we may run out of memory.
+    cerr << "WARNING: Possibly malicious number of key points reported in index packet." << endl;
+    return false;
+  }
+
+  // Each block must start within the keypoint data, in order, and have
+  // Rice parameters we can decode with.
+  ogg_int64_t prev_bit_offset = 0;
+  for (ogg_int64_t i=0; i<header->num_blocks; i++) {
+    unsigned char* entry = header->block_table + i * header->block_entry_size;
+    ogg_int64_t bit_offset = LEInt64(entry + INDEX_BLOCK_BIT_OFFSET);
+    if (bit_offset < prev_bit_offset ||
+        bit_offset / 8 > header->keypoints_bytes) {
+      cerr << "WARNING: Invalid block bit offset in index packet." << endl;
+      return false;
+    }
+    prev_bit_offset = bit_offset;
+    if (header->block_rice_params &&
+        (Uint8(entry + INDEX_BLOCK_OFFSET_RICE_PARAM) > MAX_RICE_PARAM ||
+         Uint8(entry + INDEX_BLOCK_GRANULE_RICE_PARAM) > MAX_RICE_PARAM)) {
+      cerr << "WARNING: Invalid Rice parameter in index packet block table." << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Gets the Rice parameters used to code a block of keypoints.
+static void
+GetBlockRiceParams(const IndexHeader& header,
+                   ogg_int64_t block,
+                   unsigned char* offset_rice_param,
+                   unsigned char* granule_rice_param)
+{
+  if (!header.block_rice_params) {
+    *offset_rice_param = header.offset_rice_param;
+    *granule_rice_param = header.granule_rice_param;
+    return;
+  }
+  unsigned char* entry = header.block_table + block * header.block_entry_size;
+  *offset_rice_param = Uint8(entry + INDEX_BLOCK_OFFSET_RICE_PARAM);
+  *granule_rice_param = Uint8(entry + INDEX_BLOCK_GRANULE_RICE_PARAM);
+}
+
+// Decodes every keypoint of an index whose blocks have their own Rice
+// parameters. The blocks are contiguous, so one reader runs across them all.
+static bool
+DecodeBlocksWithParams(const IndexHeader& header,
+                       vector<ogg_int64_t>* offset_diffs,
+                       vector<ogg_int64_t>* granule_diffs)
+{
+  BitReader reader(header.keypoints, header.keypoints_bytes);
+  offset_diffs->reserve(header.num_seekpoints);
+  granule_diffs->reserve(header.num_seekpoints);
+  for (ogg_int64_t b=0; b<header.num_blocks && !reader.Overrun(); b++) {
+    unsigned char offset_rice_param, granule_rice_param;
+    GetBlockRiceParams(header, b, &offset_rice_param, &granule_rice_param);
+    ogg_int64_t count = min(header.block_size,
+                            header.num_seekpoints - b * header.block_size);
+    for (ogg_int64_t i=0; i<count; i++) {
+      offset_diffs->push_back(rice_read_one(reader, offset_rice_param));
+      granule_diffs->push_back(rice_read_one(reader, granule_rice_param));
+    }
+  }
+  return !reader.Overrun();
+}
+
+// Decodes every keypoint of an index partitioned into blocks which share
+// the packet's Rice parameters. The block table says where each block
+// starts, so runs of blocks are decoded on several threads.
+static bool
+DecodeBlocks(const IndexHeader& header,
+             vector<ogg_int64_t>* offset_diffs,
+             vector<ogg_int64_t>* granule_diffs)
+{
+  ogg_int64_t blocks_per_chunk = max((ogg_int64_t)1,
+                                     RICE_CHUNK_PAIRS / header.block_size);
+  vector<ogg_int64_t> hints;
+  for (ogg_int64_t b=0; b<header.num_blocks; b+=blocks_per_chunk) {
+    unsigned char* entry = header.block_table + b * header.block_entry_size;
+    hints.push_back(LEInt64(entry + INDEX_BLOCK_BIT_OFFSET));
+  }
+  return rice_read_alternate_parallel(offset_diffs, granule_diffs,
+                                      header.keypoints,
+                                      header.keypoints_bytes,
+                                      header.num_seekpoints,
+                                      header.offset_rice_param,
+                                      header.granule_rice_param,
+                                      hints,
+                                      blocks_per_chunk * header.block_size,
+                                      ProcessorCount());
+}
+
+bool DecodeIndexKeypoints(const IndexHeader& header,
+                          ogg_uint32_t version,
+                          SeekTable* table)
+{
+  /* Read in key points. Skeleton 4.3 keypoints are decoded by the coder
+     the packet names. Otherwise the blocks are contiguous in the Rice coded
+     data, so unless they have their own Rice parameters we can decode the
+     keypoints in one pass, using the block table only to split the pass
+     between threads. */
+  vector<ogg_int64_t> offset_diffs, granule_diffs;
+  bool ok;
+  if (version >= SKELETON_VERSION(SKELETON_VERSION_MAJOR,
+                                 SKELETON_VERSION_MINOR_CODEC)) {
+    IndexCodec* codec = IndexCodec::Create(header.codec);
+    ok = codec->Decode(&offset_diffs, &granule_diffs,
+                       header.keypoints, header.keypoints_bytes,
+                       header.num_seekpoints);
+    delete codec;
+  } else if (header.block_rice_params) {
+    ok = DecodeBlocksWithParams(header, &offset_diffs, &granule_diffs);
+  } else if (header.num_blocks > 0) {
+    ok = DecodeBlocks(header, &offset_diffs, &granule_diffs);
+  } else {
+    ok = rice_read_alternate(&offset_diffs, &granule_diffs,
+                             header.keypoints, header.keypoints_bytes,
+                             header.num_seekpoints,
+                             header.offset_rice_param,
+                             header.granule_rice_param);
+  }
+  if (!ok) {
+    cerr << "WARNING: Index packet keypoints overrun the end of the packet." << endl;
+    return false;
+  }
+  vector<ogg_int64_t> offset_integrated, granule_integrated;
+  shift_integrate(&offset_integrated, &offset_diffs, header.offset_roundoff,
+                                                            header.init_offset);
+  shift_integrate(&granule_integrated, &granule_diffs, header.granule_roundoff,
+                                                           header.init_granule);
+  merge_vectors(table, &offset_integrated, &granule_integrated, header.b_max);
+  return true;
+}
+
+PackedIndex::PackedIndex()
+  : mVersion(0)
+  , mTable(0)
+  , mDecoded(false)
+{
+  memset(&mHeader, 0, sizeof(IndexHeader));
+#if defined HAVE_INDEX_LOCK
+  pthread_mutex_init(&mMutex, 0);
+#endif
+}
+
+PackedIndex::~PackedIndex() {
+  delete mTable;
+#if defined HAVE_INDEX_LOCK
+  pthread_mutex_destroy(&mMutex);
+#endif
+}
+
+bool PackedIndex::Init(ogg_packet* packet, ogg_uint32_t version) {
+  // Parse our own copy of the packet, so that the header's pointers to the
+  // block table and keypoints remain valid.
+  mPacket.assign(packet->packet, packet->packet + packet->bytes);
+  mVersion = version;
+  ogg_packet copy = *packet;
+  copy.packet = mPacket.empty() ? 0 : &mPacket[0];
+  return ParseIndexHeader(&copy, version, &mHeader);
+}
+
+const SeekTable* PackedIndex::GetTable() const {
+#if defined HAVE_INDEX_LOCK
+  pthread_mutex_lock(&mMutex);
+#endif
+  if (!mDecoded) {
+    mDecoded = true;
+    SeekTable* table = new SeekTable();
+    if (DecodeIndexKeypoints(mHeader, mVersion, table)) {
+      mTable = table;
+    } else {
+      cerr << "WARNING: Index of stream " << mHeader.serialno
+           << " failed to decode." << endl;
+      delete table;
+    }
+  }
+  const SeekTable* table = mTable;
+#if defined HAVE_INDEX_LOCK
+  pthread_mutex_unlock(&mMutex);
+#endif
+  return table;
+}
+
+bool PackedIndex::IsDecoded() const {
+#if defined HAVE_INDEX_LOCK
+  pthread_mutex_lock(&mMutex);
+#endif
+  bool decoded = mDecoded;
+#if defined HAVE_INDEX_LOCK
+  pthread_mutex_unlock(&mMutex);
+#endif
+  return decoded;
+}
+
+bool ReadIndex(SeekBlockIndex& index, ogg_packet* packet,
+               ogg_uint32_t version)
+{
+  PackedIndex* packed = new PackedIndex();
+  if (!packed->Init(packet, version)) {
+    delete packed;
+    return false;
+  }
+  ogg_uint32_t serialno = packed->GetHeader().serialno;
+  SeekBlockIndex::iterator itr = index.find(serialno);
+  if (itr != index.end()) {
+    delete itr->second;
+  }
+  index[serialno] = packed;
+  return true;
+}
+
+bool LookupIndexBlock(const IndexHeader& header,
+                      ogg_int64_t granule,
+                      ogg_int64_t* keypoint_granule,
+                      OffsetRange* range)
+{
+  assert(header.block_size > 0);
+  if (header.num_blocks == 0 || granule < header.init_granule) {
+    return false;
+  }
+
+  // Binary search for the last block which starts at or before granule.
+  ogg_int64_t lo = 0, hi = header.num_blocks;
+  while (hi - lo > 1) {
+    ogg_int64_t mid = lo + (hi - lo) / 2;
+    unsigned char* entry = header.block_table + mid * header.block_entry_size;
+    if (LEInt64(entry + INDEX_BLOCK_BASE_GRANULE) <= granule) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  unsigned char* entry = header.block_table + lo * header.block_entry_size;
+  ogg_int64_t bit_offset = LEInt64(entry + INDEX_BLOCK_BIT_OFFSET);
+  ogg_int64_t base_offset = LEInt64(entry + INDEX_BLOCK_BASE_OFFSET);
+  ogg_int64_t base_granule = LEInt64(entry + INDEX_BLOCK_BASE_GRANULE);
+  ogg_int64_t count = min(header.block_size,
+                          header.num_seekpoints - lo * header.block_size);
+  unsigned char offset_rice_param, granule_rice_param;
+  GetBlockRiceParams(header, lo, &offset_rice_param, &granule_rice_param);
+
+  // Decode the block, starting from its bit offset.
+  ogg_int64_t start_byte = bit_offset / 8;
+  BitReader reader(header.keypoints + start_byte,
+                   header.keypoints_bytes - start_byte);
+  reader.ReadBits((unsigned)(bit_offset % 8));
+  vector<ogg_int64_t> offset_diffs, granule_diffs;
+  offset_diffs.reserve(count);
+  granule_diffs.reserve(count);
+  for (ogg_int64_t i=0; i<count && !reader.Overrun(); i++) {
+    offset_diffs.push_back(rice_read_one(reader, offset_rice_param));
+    granule_diffs.push_back(rice_read_one(reader, granule_rice_param));
+  }
+  if (reader.Overrun()) {
+    return false;
+  }
+  vector<ogg_int64_t> offsets, granules;
+  shift_integrate(&offsets, &offset_diffs, header.offset_roundoff,
+                  base_offset);
+  shift_integrate(&granules, &granule_diffs, header.granule_roundoff,
+                  base_granule);
+
+  // The last keypoint decoded starts the next block, or for the last block
+  // it only bounds the final range. As with a SeekTable, granules past the
+  // end of the index map to the final range.
+  ogg_int64_t i = upper_bound(granules.begin(), granules.end(), granule) -
+                  granules.begin() - 1;
+  if (i < 0 || granules.size() < 2) {
+    return false;
+  }
+  i = min(i, (ogg_int64_t)granules.size() - 2);
+  *keypoint_granule = granules[i];
+  range->start = offsets[i];
+  range->end = offsets[i+1] + header.b_max;
+  return true;
+}
+
+void ClearSeekBlockIndex(SeekBlockIndex& index) {
+  SeekBlockIndex::iterator itr = index.begin();
+  while (itr != index.end()) {
+    PackedIndex* v = itr->second;
+    delete v;
+    itr++;
+  }
+  index.clear();
+}
@@ -0,0 +1,383 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+/*
+ * IoRing.cpp - Keeps several reads and writes in flight with io_uring.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "IoRing.hpp"
+
+#if defined HAVE_IO_URING
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+static int
+SysSetup(unsigned entries, struct io_uring_params* params)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+SysEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+                      0, 0);
+}
+
+static int
+SysRegister(int fd, unsigned opcode, void* arg, unsigned count)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+IoRing::IoRing()
+  : mFd(-1)
+  , mRegistered(false)
+  , mToSubmit(0)
+  , mInFlight(0)
+  , mSqRing(0)
+  , mSqRingSize(0)
+  , mCqRing(0)
+  , mCqRingSize(0)
+  , mSqes(0)
+  , mSqesSize(0)
+{
+}
+
+IoRing::~IoRing()
+{
+  Close();
+}
+
+bool
+IoRing::Init(unsigned entries)
+{
+  assert(mFd == -1);
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = SysSetup(entries, &params);
+  if (fd < 0) {
+    return false;
+  }
+  mFd = fd;
+  if (!(params.features & IORING_FEAT_FAST_POLL)) {
+    // Older than 5.7, so IORING_OP_READ and IORING_OP_WRITE may be missing.
+    Close();
+    return false;
+  }
+
+  mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  mCqRingSize = params.cq_off.cqes +
+                params.cq_entries * sizeof(struct io_uring_cqe);
+  bool singleMapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (singleMapping) {
+    mSqRingSize = mCqRingSize = max(mSqRingSize, mCqRingSize);
+  }
+  void* sq = mmap(0, mSqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    Close();
+    return false;
+  }
+  mSqRing = sq;
+  if (singleMapping) {
+    mCqRing = mSqRing;
+  } else {
+    void* cq = mmap(0, mCqRingSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      Close();
+      return false;
+    }
+    mCqRing = cq;
+  }
+  mSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(0, mSqesSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    Close();
+    return false;
+  }
+  mSqes = (struct io_uring_sqe*)sqes;
+
+  char* s = (char*)mSqRing;
+  mSqHead = (unsigned*)(s + params.sq_off.head);
+  mSqTail = (unsigned*)(s + params.sq_off.tail);
+  mSqMask = *(unsigned*)(s + params.sq_off.ring_mask);
+  mSqEntries = params.sq_entries;
+  mSqArray = (unsigned*)(s + params.sq_off.array);
+  char* c = (char*)mCqRing;
+  mCqHead = (unsigned*)(c + params.cq_off.head);
+  mCqTail = (unsigned*)(c + params.cq_off.tail);
+  mCqMask = *(unsigned*)(c + params.cq_off.ring_mask);
+  mCqes = (struct io_uring_cqe*)(c + params.cq_off.cqes);
+  return true;
+}
+
+bool
+IoRing::RegisterBuffers(char** buffers, unsigned count, size_t length)
+{
+  assert(mFd != -1);
+  assert(!mRegistered);
+  struct iovec* iov = new struct iovec[count];
+  for (unsigned i=0; i<count; i++) {
+    iov[i].iov_base = buffers[i];
+    iov[i].iov_len = length;
+  }
+  mRegistered =
+    SysRegister(mFd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+  delete[] iov;
+  return mRegistered;
+}
+
+bool
+IoRing::Queue(unsigned char opcode, int fd, const char* buffer, int index,
+              unsigned length, ogg_int64_t offset, ogg_uint64_t tag)
+{
+  assert(mFd != -1);
+  unsigned tail = *mSqTail;
+  unsigned head = __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+  if (tail - head >= mSqEntries) {
+    return false;
+  }
+  unsigned i = tail & mSqMask;
+  struct io_uring_sqe* sqe = &mSqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  bool fixed = mRegistered && index >= 0;
+  if (fixed) {
+    opcode = opcode == IORING_OP_READ ? IORING_OP_READ_FIXED
+                                      : IORING_OP_WRITE_FIXED;
+    sqe->buf_index = (unsigned short)index;
+  }
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  // An offset of -1 means the file position.
+  sqe->off = (ogg_uint64_t)offset;
+  sqe->addr = (ogg_uint64_t)(size_t)buffer;
+  sqe->len = length;
+  sqe->user_data = tag;
+  mSqArray[i] = i;
+  __atomic_store_n(mSqTail, tail + 1, __ATOMIC_RELEASE);
+  mToSubmit++;
+  mInFlight++;
+  return true;
+}
+
+bool
+IoRing::QueueRead(int fd, char* buffer, int index, unsigned length,
+                  ogg_int64_t offset, ogg_uint64_t tag)
+{
+  return Queue(IORING_OP_READ, fd, buffer, index, length, offset, tag);
+}
+
+bool
+IoRing::QueueWrite(int fd, const char* buffer, int index, unsigned length,
+                   ogg_int64_t offset, ogg_uint64_t tag)
+{
+  return Queue(IORING_OP_WRITE, fd, buffer, index, length, offset, tag);
+}
+
+bool
+IoRing::Wait(ogg_uint64_t* tag, int* result)
+{
+  if (mInFlight == 0) {
+    return false;
+  }
+  while (true) {
+    unsigned head = *mCqHead;
+    if (head != __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe* cqe = &mCqes[head & mCqMask];
+      *tag = cqe->user_data;
+      *result = cqe->res;
+      __atomic_store_n(mCqHead, head + 1, __ATOMIC_RELEASE);
+      mInFlight--;
+      return true;
+    }
+    int submitted = SysEnter(mFd, mToSubmit, 1, IORING_ENTER_GETEVENTS);
+    if (submitted < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    mToSubmit -= submitted;
+  }
+}
+
+void
+IoRing::Close()
+{
+  if (mFd == -1) {
+    return;
+  }
+  // The kernel may still be writing into buffers which our caller is about
+  // to free.
+  ogg_uint64_t tag;
+  int result;
+  while (Wait(&tag, &result)) { }
+  if (mSqes) {
+    munmap(mSqes, mSqesSize);
+  }
+  if (mCqRing && mCqRing != mSqRing) {
+    munmap(mCqRing, mCqRingSize);
+  }
+  if (mSqRing) {
+    munmap(mSqRing, mSqRingSize);
+  }
+  close(mFd);
+  mFd = -1;
+  mSqes = 0;
+  mCqRing = 0;
+  mSqRing = 0;
+  mRegistered = false;
+  mToSubmit = 0;
+  mInFlight = 0;
+}
+
+enum RingCopyState {
+  SLOT_FREE,
+  SLOT_READING,
+  SLOT_READ,
+  SLOT_WRITING
+};
+
+struct RingCopySlot {
+  RingCopyState state;
+  // Position of the slot's bytes from the start of the copy.
+  ogg_int64_t position;
+  unsigned length;
+  // Bytes read or written so far.
+  unsigned done;
+};
+
+#endif
+
+ogg_int64_t
+RingCopy(int in, ogg_int64_t inputOffset, int out, ogg_int64_t outputOffset,
+         ogg_int64_t bytesToCopy)
+{
+#if defined HAVE_IO_URING
+  assert(bytesToCopy >= 0);
+  IoRing ring;
+  if (bytesToCopy == 0 || !ring.Init(RING_COPY_BUFFERS)) {
+    return 0;
+  }
+  char* buffers[RING_COPY_BUFFERS];
+  RingCopySlot slots[RING_COPY_BUFFERS];
+  for (int i=0; i<RING_COPY_BUFFERS; i++) {
+    buffers[i] = new char[RING_COPY_BUFFER_SIZE];
+    slots[i].state = SLOT_FREE;
+  }
+  ring.RegisterBuffers(buffers, RING_COPY_BUFFERS, RING_COPY_BUFFER_SIZE);
+
+  // Writes to a stream go one at a time, in order. Writes to a file go at
+  // their own offsets, in whatever order their reads finish.
+  const bool stream = outputOffset < 0;
+  ogg_int64_t nextRead = 0;
+  ogg_int64_t written = 0;
+  bool failed = false;
+  while (ring.InFlight() > 0 || (!failed && written < bytesToCopy)) {
+    for (int i=0; i<RING_COPY_BUFFERS && !failed; i++) {
+      RingCopySlot& slot = slots[i];
+      if (slot.state == SLOT_FREE && nextRead < bytesToCopy) {
+        slot.position = nextRead;
+        slot.length = (unsigned)min(bytesToCopy - nextRead,
+                                    (ogg_int64_t)RING_COPY_BUFFER_SIZE);
+        slot.done = 0;
+        slot.state = SLOT_READING;
+        ring.QueueRead(in, buffers[i], i, slot.length,
+                       inputOffset + slot.position, i);
+        nextRead += slot.length;
+      } else if (slot.state == SLOT_READ &&
+                 (!stream || slot.position == written)) {
+        slot.done = 0;
+        slot.state = SLOT_WRITING;
+        ring.QueueWrite(out, buffers[i], i, slot.length,
+                        stream ? -1 : outputOffset + slot.position, i);
+      }
+    }
+    ogg_uint64_t tag;
+    int result;
+    if (!ring.Wait(&tag, &result)) {
+      failed = true;
+      break;
+    }
+    RingCopySlot& slot = slots[tag];
+    bool reading = slot.state == SLOT_READING;
+    if (result <= 0) {
+      // An error, or the input ended early. Let what's in flight finish.
+      failed = true;
+      continue;
+    }
+    slot.done += result;
+    if (!reading) {
+      written += result;
+    }
+    if (slot.done < slot.length) {
+      if (failed) {
+        continue;
+      }
+      // A short read or write; queue the rest.
+      char* rest = buffers[tag] + slot.done;
+      ogg_int64_t position = slot.position + slot.done;
+      unsigned length = slot.length - slot.done;
+      if (reading) {
+        ring.QueueRead(in, rest, (int)tag, length,
+                       inputOffset + position, tag);
+      } else {
+        ring.QueueWrite(out, rest, (int)tag, length,
+                        stream ? -1 : outputOffset + position, tag);
+      }
+      continue;
+    }
+    slot.state = reading ? SLOT_READ : SLOT_FREE;
+  }
+  ring.Close();
+  for (int i=0; i<RING_COPY_BUFFERS; i++) {
+    delete[] buffers[i];
+  }
+  if (failed) {
+    // What reached a stream is all in order, but a file may have holes.
+    return stream ? written : 0;
+  }
+  return bytesToCopy;
+#else
+  return 0;
+#endif
+}
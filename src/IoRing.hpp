@@ -0,0 +1,149 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+/*
+ * IoRing.hpp - Keeps several reads and writes in flight with io_uring.
+ */
+
+#ifndef __IO_RING_HPP__
+#define __IO_RING_HPP__
+
+#include <ogg/ogg.h>
+#include <stddef.h>
+
+// io_uring needs Linux 5.7 or later, for IORING_OP_READ and IORING_OP_WRITE,
+// and the fast poll feature which tells us they're available. We talk to the
+// kernel directly rather than depending on liburing.
+#if defined __linux__ && defined __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined IORING_FEAT_FAST_POLL && defined __NR_io_uring_setup
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#include "Utils.hpp"
+
+// Number of buffers RingCopy() keeps in flight.
+#define RING_COPY_BUFFERS 8
+
+// Size of each of RingCopy()'s buffers.
+#define RING_COPY_BUFFER_SIZE (1024 * 1024)
+
+#if defined HAVE_IO_URING
+
+// A minimal io_uring submission and completion queue pair. Reads and writes
+// are queued with a tag, submitted together, and their completions collected
+// in whatever order they finish. If buffers have been registered with the
+// kernel, reads and writes into them use the fixed buffer operations, which
+// saves the kernel mapping the pages on every call.
+class IoRing {
+public:
+  IoRing();
+  ~IoRing();
+
+  // Sets up a ring which can hold entries requests at once. Returns false
+  // if the kernel doesn't support io_uring, or it's not permitted.
+  bool Init(unsigned entries);
+
+  // Registers count buffers of length bytes each. Returns false if they
+  // can't be registered, for example because they exceed the locked memory
+  // limit, in which case requests still work, but aren't fixed.
+  bool RegisterBuffers(char** buffers, unsigned count, size_t length);
+
+  // Queues a read of length bytes at offset in fd into buffer, which is
+  // registered buffer number index, or any buffer if index is -1. An offset
+  // of -1 reads from the file position. Returns false if the ring is full.
+  bool QueueRead(int fd, char* buffer, int index, unsigned length,
+                 ogg_int64_t offset, ogg_uint64_t tag);
+
+  // Queues a write, as QueueRead() queues a read.
+  bool QueueWrite(int fd, const char* buffer, int index, unsigned length,
+                  ogg_int64_t offset, ogg_uint64_t tag);
+
+  // Waits for a request to complete, submitting any which are queued first.
+  // Stores the request's tag, and its result, which is the number of bytes
+  // transferred, or minus the error number. Returns false if nothing is in
+  // flight, or the kernel reports an error.
+  bool Wait(ogg_uint64_t* tag, int* result);
+
+  // Number of requests queued or submitted which haven't completed.
+  unsigned InFlight() const { return mInFlight; }
+
+  // Waits for everything in flight, discarding the results, then tears
+  // down the ring.
+  void Close();
+
+private:
+  bool Queue(unsigned char opcode, int fd, const char* buffer, int index,
+             unsigned length, ogg_int64_t offset, ogg_uint64_t tag);
+
+  int mFd;
+  bool mRegistered;
+  unsigned mToSubmit;
+  unsigned mInFlight;
+
+  void* mSqRing;
+  size_t mSqRingSize;
+  void* mCqRing;
+  size_t mCqRingSize;
+  struct io_uring_sqe* mSqes;
+  size_t mSqesSize;
+
+  unsigned* mSqHead;
+  unsigned* mSqTail;
+  unsigned mSqMask;
+  unsigned mSqEntries;
+  unsigned* mSqArray;
+  unsigned* mCqHead;
+  unsigned* mCqTail;
+  unsigned mCqMask;
+  struct io_uring_cqe* mCqes;
+};
+
+#endif
+
+// Copies bytesToCopy bytes from inputOffset in the file in, to outputOffset
+// in out, keeping RING_COPY_BUFFERS reads and writes in flight at once with
+// io_uring, into registered buffers. If outputOffset is -1, out is written
+// at its file position, in order, so it can be a pipe. Returns the number
+// of bytes copied, which is 0 if io_uring isn't available. Everything
+// before that in the output has been written; for seekable output, nothing
+// is counted unless the whole copy succeeds.
+ogg_int64_t
+RingCopy(int in, ogg_int64_t inputOffset, int out, ogg_int64_t outputOffset,
+         ogg_int64_t bytesToCopy);
+
+#endif
@@ -54,6 +54,16 @@
 #include "Decoder.hpp"
 #include "SkeletonEncoder.hpp"
 #include "Utils.hpp"
+#include "PageScanner.hpp"
+#include "ContentSpool.hpp"
+#include "AsyncReader.hpp"
+#include "Batch.hpp"
+#include "DecodePipeline.hpp"
+
+#if defined WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 using namespace std;
 
@@ -63,8 +73,36 @@ int main(int argc, char** argv)
     return -1;
   }
 
+  if (gOptions.GetBatch()) {
+    return IndexBatch(argc, argv);
+  }
+
+  // When the output goes to stdout, send everything we'd print there to
+  // stderr instead, and keep stdout's buffer for the output.
+  const bool toStdout = gOptions.GetOutputToStdout();
+  streambuf* stdoutBuf = toStdout ? cout.rdbuf(cerr.rdbuf()) : 0;
+
+  // Input from stdin can only be read once, so spool its content pages
+  // until we've written the skeleton track which goes before them.
+  const bool fromStdin = gOptions.GetInputFromStdin();
+  ContentSpool* spool = fromStdin ? new ContentSpool(DEFAULT_SPOOL_MEMORY_LIMIT)
+                                  : 0;
+#if defined WIN32
+  if (fromStdin) {
+    _setmode(_fileno(stdin), _O_BINARY);
+  }
+  if (toStdout) {
+    _setmode(_fileno(stdout), _O_BINARY);
+  }
+#endif
+
   string filename = gOptions.GetInputFilename();
-  ifstream input(filename.c_str(), ios::in | ios::binary);
+
+  // In one-pass mode the content pages are written as they're read, after
+  // space reserved for a skeleton track of predicted length.
+  bool onePass = gOptions.GetOnePass();
+  ofstream contentOutput;
+  ogg_int64_t reservedLength = 0;
   ogg_sync_state state;
   ogg_int32_t ret = ogg_sync_init(&state);
   assert(ret==0);
@@ -86,8 +124,39 @@ int main(int argc, char** argv)
   // so that we can rewrite them easily.
   vector<ogg_page*> headerPages;
 
-  while (ReadPage(&state, &page, input, bytesRead)) {
-    assert(IsPageAtOffset(filename, offset, &page));
+  // Scan the input through a memory mapping where we can, so that pages are
+  // handed to the decoders in place, rather than being copied into libogg's
+  // sync buffer. Otherwise read it through libogg, with a thread reading
+  // ahead while we decode.
+  MappedFile mapped;
+  bool useMapping = !fromStdin && mapped.Open(filename.c_str());
+  AsyncReader reader;
+  if (!useMapping && !reader.Open(filename.c_str())) {
+    cerr << "ERROR: Failed to open input." << endl;
+    return -1;
+  }
+  PageScanner scanner(mapped.Data(), mapped.Length());
+  scanner.SetVerifyChecksums(gOptions.GetVerifyChecksums());
+  scanner.SetThreads(gOptions.GetScanThreads());
+  const ogg_int64_t inputLength = useMapping ? mapped.Length()
+                                : fromStdin ? 0
+                                : InputFileLength();
+
+  // Once all the headers are decoded, each track's pages can be decoded on
+  // its own thread. Header pages are decoded here, as we need to know when
+  // they're done, and so is everything when we're dumping, so that the dump
+  // is in file order. Pages read through libogg are copied, as its buffer
+  // is reused, while mapped pages stay valid until we unmap.
+  const bool decodeThreads = gOptions.GetDecodeThreads() &&
+                             !gOptions.GetDumpPackets() &&
+                             !gOptions.GetDumpKeyPackets() &&
+                             !gOptions.GetDumpPages();
+  DecodePipeline pipeline(!useMapping);
+
+  while (useMapping ? scanner.NextPage(&page)
+                    : ReadPage(&state, &page, reader, bytesRead)) {
+    assert(useMapping ? scanner.PageOffset() == offset
+                      : fromStdin || IsPageAtOffset(filename, offset, &page));
     pageNumber++;
     ogg_uint32_t serial = ogg_page_serialno(&page);
     Decoder* decoder = 0;
@@ -115,8 +184,12 @@ int main(int argc, char** argv)
            << " checksum=" << GetChecksum(&page) << endl;
     }
 
-    decoder->Decode(&page, offset);
-    
+    if (gotAllHeaders && decodeThreads) {
+      pipeline.Decode(decoder, &page, offset);
+    } else {
+      decoder->Decode(&page, offset);
+    }
+
     if (!gotAllHeaders) {
       gotAllHeaders = true;
       DecoderMap::iterator itr = decoders.begin();
@@ -138,6 +211,21 @@ int main(int argc, char** argv)
       if (gotAllHeaders) {
         endOfHeaders = offset + length;
       }
+      if (gotAllHeaders && onePass) {
+        reservedLength = PredictTrackLength(decoders, inputLength) +
+                         gOptions.GetReservedPadding();
+        contentOutput.open(gOptions.GetOutputFilename().c_str(),
+                           ios::out | ios::binary);
+        contentOutput.seekp(endOfHeaders - oldSkeletonLength + reservedLength);
+      }
+    } else if (spool && !spool->Append(page)) {
+      return -1;
+    } else if (onePass) {
+      WritePage(contentOutput, page);
+      if (!contentOutput.good()) {
+        cerr << "ERROR: Failed to write content pages." << endl;
+        return -1;
+      }
     }
 
     offset += length;
@@ -151,29 +239,120 @@ int main(int argc, char** argv)
     endOfHeaders = offset;
   }
 
+  pipeline.Finish();
+  if (decodeThreads) {
+    if (!useMapping) {
+      cout << "Reading held up decoding " << reader.Waits() << " times" << endl;
+    }
+    pipeline.PrintStats(cout);
+  }
+
+  if (useMapping) {
+    if (scanner.BytesSkipped() > 0) {
+      cerr << "WARNING: Skipped " << scanner.BytesSkipped()
+           << " bytes which weren't part of a valid Ogg page!" << endl;
+    }
+    bytesRead = mapped.Length();
+    mapped.Close();
+  } else {
+    if (reader.Failed()) {
+      cerr << "ERROR: Failed to read input." << endl;
+      return -1;
+    }
+    reader.Close();
+  }
+
   const ogg_int64_t fileLength = bytesRead;
-  assert(input.eof());
   if (offset != fileLength) {
     cerr << "WARNING: Ogg page lengths don't sum to file length!" << endl;
   }  
   
-  assert(fileLength == InputFileLength());
+  assert(fromStdin || fileLength == InputFileLength());
+
+  if (onePass && contentOutput.is_open()) {
+    contentOutput.close();
+    if (contentOutput.fail()) {
+      cerr << "ERROR: Failed to write content pages." << endl;
+      return -1;
+    }
+  } else {
+    // We never found the end of the headers, so never reserved anything.
+    onePass = false;
+  }
+
+  if (spool) {
+    cout << "Peak spool size " << spool->Length() << " bytes, "
+         << spool->MemoryLength() << " in memory and "
+         << spool->TempFileLength() << " in a temporary file" << endl;
+  }
   
   ogg_sync_clear(&state);
-  
-  SkeletonEncoder encoder(decoders, fileLength, oldSkeletonLength, endOfHeaders);
 
-  // Reopen the file so we can write it out with the index.
-  input.close();
-  input.clear();
-  input.open(filename.c_str(), ios::in | ios::binary);
-  assert(input.good());
-  
-  // Open output file.
-  ofstream output(gOptions.GetOutputFilename().c_str(), ios::out | ios::binary);
+  // Re-indexing in place needs an old skeleton track to overwrite. Without
+  // one, the encoder would choose its own track length, and overwrite the
+  // start of the content.
+  if (gOptions.GetRewriteInPlace() && oldSkeletonLength == 0) {
+    cerr << "ERROR: '" << filename << "' has no skeleton track to re-index "
+         << "in place, re-index into a new file instead." << endl;
+    return -1;
+  }
   
-  // Encode the new skeleton track.
-  encoder.Encode();
+  // The content written in one-pass mode is just the pages we found.
+  SkeletonEncoder encoder(decoders, onePass ? offset : fileLength,
+                          oldSkeletonLength, endOfHeaders);
+  if (gOptions.GetAlignContent()) {
+    encoder.SetContentAlignment(FileBlockSize(filename));
+  }
+  const bool inPlace = gOptions.GetRewriteInPlace();
+  if (inPlace) {
+    encoder.SetTrackLength(oldSkeletonLength);
+  } else if (onePass) {
+    encoder.SetTrackLength(reservedLength);
+  }
+
+  // Encode the new skeleton track. In one-pass mode, make the index coarser
+  // until it fits in the space reserved for it, or else give up and copy
+  // the content again.
+  bool encoded = encoder.Encode();
+  int coarsenings = 0;
+  while (!encoded && onePass && encoder.CoarsenIndex()) {
+    coarsenings++;
+    encoded = encoder.Encode();
+  }
+  if (!encoded && onePass) {
+    cerr << "WARNING: The skeleton track doesn't fit in the "
+         << reservedLength << " bytes reserved for it, copying the content "
+         << "again." << endl;
+    // The whole input's content is copied, skipped bytes and all.
+    onePass = false;
+    encoder.SetFileLength(fileLength);
+    encoder.SetTrackLength(0);
+    encoded = encoder.Encode();
+  }
+  if (!encoded) {
+    assert(inPlace);
+    if (encoder.GetUnpaddedLength() <= (ogg_int64_t)oldSkeletonLength) {
+      cerr << "ERROR: No padding makes the new skeleton track exactly the "
+           << oldSkeletonLength << " bytes of the old one, re-index into a "
+           << "new file." << endl;
+    } else {
+      cerr << "ERROR: The new skeleton track doesn't fit in the "
+           << oldSkeletonLength << " bytes of the old one, re-index into a "
+           << "new file, using -s to reserve padding." << endl;
+    }
+    return -1;
+  }
+
+  // Open output file. When re-indexing in place, or when the content has
+  // been written in one pass, open it without truncating it, and write the
+  // header pages in the space in front of the content.
+  ofstream outputFile;
+  if (!toStdout) {
+    ios::openmode mode = inPlace || onePass ? ios::in | ios::out | ios::binary
+                                            : ios::out | ios::binary;
+    outputFile.open(gOptions.GetOutputFilename().c_str(), mode);
+  }
+  ostream output(toStdout ? stdoutBuf : outputFile.rdbuf());
   
   // Write out the new skeleton BOS page.
   encoder.WriteBosPage(output);
@@ -199,27 +378,77 @@ int main(int argc, char** argv)
     return -1;
   }
 
-  assert(encoder.ContentOffset() == output.tellp());
+  assert(toStdout || encoder.ContentOffset() == output.tellp());
 
-  // Copy content pages.
-  input.seekg((std::streamoff)endOfHeaders);
-  CopyFileData(input, output, fileLength - endOfHeaders);
-  if (!output.good()) {
-    cerr << "ERROR: Failed to write remaining content pages." << endl;
-    return -1;
+  ogg_int64_t contentLength = fileLength - endOfHeaders;
+  const bool streamContent = fromStdin || toStdout;
+  if (streamContent) {
+    // The content has to pass through the output stream, either out of the
+    // spool, or read back from the input if we're writing to a pipe.
+    bool copied = true;
+    if (spool) {
+      copied = spool->WriteTo(output);
+      delete spool;
+      spool = 0;
+    } else {
+      copied = CopyFileToStream(filename, endOfHeaders, output,
+                                fileno(stdout), contentLength);
+    }
+    output.flush();
+    if (!copied || !output.good()) {
+      cerr << "ERROR: Failed to write remaining content pages." << endl;
+      return -1;
+    }
+  }
+
+  // Flush what we've written.
+  if (!toStdout) {
+    outputFile.close();
+    if (outputFile.fail()) {
+      cerr << "ERROR: Failed to write header pages." << endl;
+      return -1;
+    }
+  }
+
+  if (inPlace) {
+    assert(encoder.ContentOffset() == (ogg_int64_t)endOfHeaders);
+    cout << "Rewrote " << endOfHeaders << " bytes of header pages in place"
+         << endl;
+  } else if (onePass) {
+    cout << "Wrote content in one pass, after " << reservedLength
+         << " bytes reserved for the skeleton track";
+    if (coarsenings > 0) {
+      cout << ", coarsening the index by " << coarsenings << " bits to fit";
+    }
+    cout << endl;
+  } else if (!streamContent) {
+    // Copy the content pages in after the headers.
+    const char* copyMethod = 0;
+    double copyStart = WallClockSeconds();
+    if (!CopyFileRange(filename, endOfHeaders,
+                       gOptions.GetOutputFilename(), encoder.ContentOffset(),
+                       contentLength, &copyMethod))
+    {
+      cerr << "ERROR: Failed to write remaining content pages." << endl;
+      return -1;
+    }
+    double copySeconds = WallClockSeconds() - copyStart;
+    cout << "Copied " << contentLength << " bytes of content with "
+         << copyMethod << " in " << copySeconds << "s";
+    if (copySeconds > 0) {
+      cout << ", " << (contentLength / copySeconds) / (1024 * 1024) << " MB/s";
+    }
+    cout << endl;
   }
-  
-  output.close();
-  input.close();
 
   ogg_int64_t trackLength = encoder.GetTrackLength();
-  cout << "Skeleton " << SKELETON_VERSION_MAJOR << "." << SKELETON_VERSION_MINOR 
+  cout << "Skeleton " << SKELETON_VERSION_MAJOR << "." << encoder.GetVersionMinor()
        << " track with keyframe indexes uses " << trackLength << " bytes, "
        << ((float)trackLength / (float)(fileLength + trackLength)) * 100.0
        << "% overhead" << endl;
 
   int retval = 0;
-  if (gOptions.GetVerifyIndex()) {
+  if (gOptions.GetVerifyIndex() && !toStdout) {
     cout << "Validating keyframe indexes..." << endl;
     if (!ValidateIndexedOgg(gOptions.GetOutputFilename())) {
       cerr << "FAIL: Verification of the index failed!" << endl;
@@ -0,0 +1,979 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * OggIndexBench.cpp - microbenchmarks for the indexer's inner loops.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <math.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "Utils.hpp"
+#include "RiceCode.hpp"
+#include "IndexCodec.hpp"
+#include "Decoder.hpp"
+#include "SkeletonEncoder.hpp"
+#include "SeekQuery.hpp"
+#include "PageScanner.hpp"
+#include "PageChecksum.hpp"
+#include "AsyncReader.hpp"
+#include "IoRing.hpp"
+
+#if defined HAVE_IO_URING
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Number of times each decode is repeated, to get measurable times.
+#define BENCH_REPEATS 10
+
+// Minimum time to spend timing each coder, in seconds.
+#define MIN_BENCH_SECONDS 0.25
+
+// Size of an uncompressed keypoint, an offset and a granule, in bytes.
+#define KEYPOINT_SIZE 16
+
+static void
+PrintUsage() {
+  cout << "OggIndexBench " << VERSION << endl
+       << endl
+       << "Usage:" << endl
+       << "  OggIndexBench rice [<num seekpoints>]" << endl
+       << "  OggIndexBench codecs <ogg file> [<ogg file> ...]" << endl
+       << "  OggIndexBench seek [<num keypoints>]" << endl
+       << "  OggIndexBench query <indexed ogg file> [<num targets>]" << endl
+       << "  OggIndexBench pages <ogg file>" << endl
+       << "  OggIndexBench read <ogg file>" << endl
+       << "  OggIndexBench copy <file>" << endl
+       << "  OggIndexBench sparse <theora file> <out file> <gigabytes>" << endl
+       << endl
+       << "Modes:" << endl
+       << "  rice    --  Rice decode throughput, fast vs reference decoder, and" << endl
+       << "              coding on several threads vs one" << endl
+       << "  codecs  --  size and speed of each index keypoint coder, over the" << endl
+       << "              keypoints the indexer would store for the given files" << endl
+       << "  seek    --  keypoint lookup latency, SeekTable vs std::map" << endl
+       << "  query   --  seek latency of the seek library, one Seek() per target" << endl
+       << "              vs one SeekBatch() for them all, checking they agree" << endl
+       << "  pages   --  page scanning throughput, libogg vs PageScanner, and" << endl
+       << "              the speed of each page checksum method" << endl
+       << "  read    --  read and decode throughput, reading synchronously vs" << endl
+       << "              reading ahead on a thread or with io_uring; drop the" << endl
+       << "              page cache first to see I/O overlap with decoding" << endl
+       << "  copy    --  copy throughput through a buffer vs with io_uring" << endl
+       << "  sparse  --  not a benchmark; writes a theora file of the given size," << endl
+       << "              with the headers of <theora file>, whose page bodies are" << endl
+       << "              left as holes, for testing inputs larger than 4GB, see" << endl
+       << "              test-large-file.sh" << endl
+       << endl;
+}
+
+static double
+Seconds(clock_t start, clock_t end) {
+  return (double)(end - start) / CLOCKS_PER_SEC;
+}
+
+// Fills values with n exponentially distributed deltas with the given mean,
+// which is roughly what keypoint deltas look like.
+static void
+MakeDeltas(vector<ogg_int64_t>& values, ogg_int64_t n, double mean) {
+  values.clear();
+  values.reserve(n);
+  for (ogg_int64_t i=0; i<n; i++) {
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    values.push_back((ogg_int64_t)(-mean * log(u)));
+  }
+}
+
+static ogg_int64_t
+DecodeReference(unsigned char* p,
+                ogg_int64_t num_bytes,
+                ogg_int64_t num_pairs,
+                unsigned char rice_first,
+                unsigned char rice_second)
+{
+  BitReader reader(p, num_bytes);
+  ogg_int64_t sum = 0;
+  for (ogg_int64_t i=0; i<num_pairs; i++) {
+    sum += rice_read_one_reference(reader, rice_first);
+    sum += rice_read_one_reference(reader, rice_second);
+  }
+  return sum;
+}
+
+static ogg_int64_t
+DecodeFast(unsigned char* p,
+           ogg_int64_t num_bytes,
+           ogg_int64_t num_pairs,
+           unsigned char rice_first,
+           unsigned char rice_second)
+{
+  BitReader reader(p, num_bytes);
+  ogg_int64_t sum = 0;
+  for (ogg_int64_t i=0; i<num_pairs; i++) {
+    sum += rice_read_one(reader, rice_first);
+    sum += rice_read_one(reader, rice_second);
+  }
+  return sum;
+}
+
+// Measures Rice decode throughput over synthetic seekpoint deltas, for the
+// parameters optimal_rice_parameter() picks across a range of mean deltas.
+static int
+BenchRice(ogg_int64_t num_pairs) {
+  cout << setw(12) << "mean_delta" << setw(8) << "params"
+       << setw(10) << "bytes" << setw(16) << "reference_sp/s"
+       << setw(16) << "fast_sp/s" << setw(10) << "speedup" << endl;
+  for (double mean = 1; mean <= (1 << 24); mean *= 4) {
+    vector<ogg_int64_t> offsets, granules;
+    MakeDeltas(offsets, num_pairs, mean);
+    MakeDeltas(granules, num_pairs, mean / 16);
+    unsigned char offset_param = optimal_rice_parameter(&offsets);
+    unsigned char granule_param = optimal_rice_parameter(&granules);
+    ogg_int64_t num_bytes = tobytes(rice_total_bits(&offsets, offset_param) +
+                                    rice_total_bits(&granules, granule_param));
+    vector<unsigned char> buffer(num_bytes + 1);
+    BitWriter writer(&buffer[0], num_bytes);
+    rice_encode_alternate(&writer, &offsets, &granules,
+                          offset_param, granule_param);
+    writer.Flush();
+
+    ogg_int64_t expected = 0, sum = 0;
+    for (ogg_int64_t i=0; i<num_pairs; i++) {
+      expected += offsets[i] + granules[i];
+    }
+
+    clock_t start = clock();
+    for (int r=0; r<BENCH_REPEATS; r++) {
+      sum = DecodeReference(&buffer[0], num_bytes, num_pairs,
+                            offset_param, granule_param);
+    }
+    double reference = Seconds(start, clock());
+    assert(sum == expected);
+
+    start = clock();
+    for (int r=0; r<BENCH_REPEATS; r++) {
+      sum = DecodeFast(&buffer[0], num_bytes, num_pairs,
+                       offset_param, granule_param);
+    }
+    double fast = Seconds(start, clock());
+    if (sum != expected) {
+      cerr << "FAIL: fast Rice decoder disagrees with the encoder" << endl;
+      return -1;
+    }
+
+    double total = (double)num_pairs * BENCH_REPEATS;
+    ostringstream params;
+    params << (int)offset_param << "/" << (int)granule_param;
+    cout << setw(12) << (ogg_int64_t)mean << setw(8) << params.str()
+         << setw(10) << num_bytes
+         << setw(16) << (ogg_int64_t)(total / reference)
+         << setw(16) << (ogg_int64_t)(total / fast)
+         << setw(9) << setprecision(3) << (reference / fast) << "x" << endl;
+  }
+
+  // Code and decode the same pairs on several threads, by the wall clock.
+  // Each must give exactly the bits and values one thread does.
+  vector<ogg_int64_t> offsets, granules;
+  MakeDeltas(offsets, num_pairs, 1 << 16);
+  MakeDeltas(granules, num_pairs, 1 << 12);
+  unsigned char offset_param = optimal_rice_parameter(&offsets);
+  unsigned char granule_param = optimal_rice_parameter(&granules);
+  ogg_int64_t num_bytes = tobytes(rice_total_bits(&offsets, offset_param) +
+                                  rice_total_bits(&granules, granule_param));
+  vector<unsigned char> expected(num_bytes + 1), buffer(num_bytes + 1);
+  vector<ogg_int64_t> hints;
+  rice_encode_alternate_parallel(&expected[0], num_bytes, &offsets, &granules,
+                                 offset_param, granule_param, 1,
+                                 RICE_CHUNK_PAIRS, &hints);
+  cout << setw(12) << "threads" << setw(16) << "encode_sp/s"
+       << setw(16) << "decode_sp/s" << endl;
+  int processors = ProcessorCount();
+  for (int threads=1; threads==1 || threads<=max(2, processors); threads*=2) {
+    int repeats = 0;
+    double start = WallClockSeconds();
+    do {
+      rice_encode_alternate_parallel(&buffer[0], num_bytes, &offsets,
+                                     &granules, offset_param, granule_param,
+                                     threads);
+      repeats++;
+    } while (WallClockSeconds() - start < MIN_BENCH_SECONDS);
+    double encode = (WallClockSeconds() - start) / repeats;
+    if (memcmp(&buffer[0], &expected[0], num_bytes) != 0) {
+      cerr << "FAIL: Rice coding on " << threads << " threads disagrees "
+           << "with one thread" << endl;
+      return -1;
+    }
+
+    vector<ogg_int64_t> first, second;
+    repeats = 0;
+    start = WallClockSeconds();
+    do {
+      first.clear();
+      second.clear();
+      if (!rice_read_alternate_parallel(&first, &second, &buffer[0],
+                                        num_bytes, num_pairs, offset_param,
+                                        granule_param, hints,
+                                        RICE_CHUNK_PAIRS, threads)) {
+        break;
+      }
+      repeats++;
+    } while (WallClockSeconds() - start < MIN_BENCH_SECONDS);
+    double decode = (WallClockSeconds() - start) / max(repeats, 1);
+    if (first != offsets || second != granules) {
+      cerr << "FAIL: Rice decoding on " << threads << " threads disagrees "
+           << "with the encoder" << endl;
+      return -1;
+    }
+    cout << setw(12) << threads
+         << setw(16) << (ogg_int64_t)(num_pairs / encode)
+         << setw(16) << (ogg_int64_t)(num_pairs / decode) << endl;
+  }
+  return 0;
+}
+
+// Reads the keypoints the indexer would store for each indexable track in
+// an Ogg file, appending them to tracks. Returns false if the file can't
+// be opened.
+static bool
+ReadKeypoints(const char* filename, vector<IndexKeypoints>* tracks) {
+  ifstream input(filename, ios::in | ios::binary);
+  if (!input.good()) {
+    return false;
+  }
+  ogg_sync_state state;
+  ogg_int32_t ret = ogg_sync_init(&state);
+  assert(ret == 0);
+
+  DecoderMap decoders;
+  ogg_page page;
+  memset(&page, 0, sizeof(ogg_page));
+  ogg_uint64_t bytesRead = 0;
+  ogg_int64_t offset = 0;
+  while (ReadPage(&state, &page, input, bytesRead)) {
+    ogg_uint32_t serial = ogg_page_serialno(&page);
+    if (ogg_page_bos(&page)) {
+      decoders[serial] = Decoder::Create(&page);
+    }
+    Decoder* decoder = decoders[serial];
+    if (decoder) {
+      decoder->Decode(&page, offset);
+    }
+    offset += page.header_len + page.body_len;
+    memset(&page, 0, sizeof(ogg_page));
+  }
+  ogg_sync_clear(&state);
+
+  for (DecoderMap::iterator itr = decoders.begin();
+       itr != decoders.end();
+       itr++)
+  {
+    Decoder* decoder = itr->second;
+    if (decoder &&
+        decoder->Type() != TYPE_SKELETON &&
+        decoder->GetSeekBlocks().Size() > 0)
+    {
+      IndexKeypoints keypoints;
+      ComputeIndexKeypoints(decoder, OFFSET_ROUNDOFF, GRANULE_ROUNDOFF,
+                            &keypoints);
+      tracks->push_back(keypoints);
+    }
+    delete decoder;
+  }
+  return true;
+}
+
+// Measures the size of each track's index keypoints under every coder, and
+// how fast each coder encodes and decodes them. Throughput is in MB/s of
+// uncompressed keypoints.
+static int
+BenchCodecs(int num_files, char** files) {
+  vector<IndexKeypoints> tracks;
+  for (int i=0; i<num_files; i++) {
+    if (!ReadKeypoints(files[i], &tracks)) {
+      cerr << "ERROR: Can't read " << files[i] << endl;
+      return -1;
+    }
+  }
+  ogg_int64_t num_keypoints = 0;
+  for (size_t t=0; t<tracks.size(); t++) {
+    num_keypoints += tracks[t].offset_diffs.size();
+  }
+  if (num_keypoints == 0) {
+    cerr << "ERROR: No keypoints found in the input files" << endl;
+    return -1;
+  }
+  cout << num_keypoints << " keypoints in " << tracks.size() << " tracks of "
+       << num_files << " files" << endl;
+  cout << setw(8) << "codec" << setw(12) << "bytes"
+       << setw(14) << "bits/keypoint" << setw(14) << "encode_MB/s"
+       << setw(14) << "decode_MB/s" << endl;
+
+  double megabytes = (double)num_keypoints * KEYPOINT_SIZE / (1024 * 1024);
+  for (int id=0; id<=CODEC_MAX; id++) {
+    IndexCodec* codec = IndexCodec::Create(id);
+    vector<vector<unsigned char> > coded(tracks.size());
+
+    ogg_int64_t bytes = 0;
+    int repeats = 0;
+    clock_t start = clock();
+    do {
+      for (size_t t=0; t<tracks.size(); t++) {
+        codec->Encode(&coded[t], &tracks[t].offset_diffs,
+                      &tracks[t].granule_diffs);
+      }
+      repeats++;
+    } while (Seconds(start, clock()) < MIN_BENCH_SECONDS);
+    double encode = Seconds(start, clock()) / repeats;
+    for (size_t t=0; t<tracks.size(); t++) {
+      bytes += coded[t].size();
+    }
+
+    // Check the round trip before timing the decoder on its own.
+    for (size_t t=0; t<tracks.size(); t++) {
+      vector<ogg_int64_t> offsets, granules;
+      bool ok = codec->Decode(&offsets, &granules,
+                              coded[t].empty() ? 0 : &coded[t][0],
+                              coded[t].size(), tracks[t].offset_diffs.size());
+      if (!ok ||
+          offsets != tracks[t].offset_diffs ||
+          granules != tracks[t].granule_diffs)
+      {
+        cerr << "FAIL: " << codec->Name()
+             << " decoder disagrees with its encoder" << endl;
+        delete codec;
+        return -1;
+      }
+    }
+
+    repeats = 0;
+    start = clock();
+    do {
+      for (size_t t=0; t<tracks.size(); t++) {
+        vector<ogg_int64_t> offsets, granules;
+        codec->Decode(&offsets, &granules,
+                      coded[t].empty() ? 0 : &coded[t][0],
+                      coded[t].size(), tracks[t].offset_diffs.size());
+      }
+      repeats++;
+    } while (Seconds(start, clock()) < MIN_BENCH_SECONDS);
+    double decode = Seconds(start, clock()) / repeats;
+
+    cout << setw(8) << codec->Name() << setw(12) << bytes
+         << setw(14) << setprecision(3) << (double)bytes * 8 / num_keypoints
+         << setw(14) << setprecision(4) << megabytes / encode
+         << setw(14) << setprecision(4) << megabytes / decode << endl;
+    delete codec;
+  }
+  return 0;
+}
+
+// Number of lookups timed per table in the seek benchmark.
+#define SEEK_LOOKUPS 10000000
+
+// Measures the latency of finding the keypoint for random granules in a
+// SeekTable, against the std::map the indexes used to be stored in.
+static int
+BenchSeek(ogg_int64_t num_keypoints) {
+  map<ogg_int64_t, OffsetRange> tree;
+  SeekTable table;
+  ogg_int64_t granule = 0, offset = 0;
+  for (ogg_int64_t i=0; i<num_keypoints; i++) {
+    granule += 1 + rand() % 100;
+    offset += 1 + rand() % 65536;
+    OffsetRange r = { offset, offset + 65536 };
+    tree[granule] = r;
+    table.Insert(granule, r);
+  }
+  vector<ogg_int64_t> targets(SEEK_LOOKUPS);
+  for (size_t i=0; i<targets.size(); i++) {
+    targets[i] = table.Granule(0) + (ogg_int64_t)rand() % granule;
+  }
+
+  ogg_int64_t tree_sum = 0;
+  clock_t start = clock();
+  for (size_t i=0; i<targets.size(); i++) {
+    tree_sum += (--tree.upper_bound(targets[i]))->second.start;
+  }
+  double tree_time = Seconds(start, clock());
+
+  ogg_int64_t table_sum = 0;
+  start = clock();
+  for (size_t i=0; i<targets.size(); i++) {
+    table_sum += table.Range(table.Find(targets[i])).start;
+  }
+  double table_time = Seconds(start, clock());
+  if (tree_sum != table_sum) {
+    cerr << "FAIL: SeekTable disagrees with std::map" << endl;
+    return -1;
+  }
+
+  cout << setw(12) << "keypoints" << setw(14) << "map_ns"
+       << setw(14) << "table_ns" << setw(10) << "speedup" << endl;
+  cout << setw(12) << num_keypoints
+       << setw(14) << setprecision(3) << tree_time * 1e9 / targets.size()
+       << setw(14) << setprecision(3) << table_time * 1e9 / targets.size()
+       << setw(9) << setprecision(3) << (tree_time / table_time) << "x"
+       << endl;
+  return 0;
+}
+
+// Measures how long the seek library takes to answer evenly spaced seeks in
+// an indexed file, one at a time and as a batch, and checks that the batch
+// finds the same range as Seek() for every target. The targets run past the
+// end of the longest stream, so that streams which end early drop out of
+// the later seeks.
+static int
+BenchQuery(const char* filename, ogg_int64_t num_targets) {
+  MappedFile mapped;
+  if (!mapped.Open(filename)) {
+    cerr << "ERROR: Can't map " << filename << endl;
+    return -1;
+  }
+  SeekIndex index;
+  index.ReadHeaders(mapped.Data(), mapped.Length());
+  ogg_int64_t duration = index.GetDuration();
+  if (index.GetIndex().empty() || duration < 0) {
+    cerr << "ERROR: " << filename << " has no keyframe index to seek with"
+         << endl;
+    return -1;
+  }
+  vector<ogg_int64_t> times(num_targets);
+  for (ogg_int64_t t=0; t<num_targets; t++) {
+    times[t] = t * (duration + duration / 10 + 1) / num_targets;
+  }
+
+  vector<OffsetRange> single(num_targets);
+  vector<bool> found(num_targets);
+  clock_t start = clock();
+  for (ogg_int64_t t=0; t<num_targets; t++) {
+    found[t] = index.Seek(times[t], &single[t]);
+  }
+  double seek_time = Seconds(start, clock());
+
+  vector<OffsetRange> ranges, fetches;
+  start = clock();
+  if (!index.SeekBatch(times, &ranges, &fetches)) {
+    cerr << "FAIL: SeekBatch() found nothing to seek with" << endl;
+    return -1;
+  }
+  double batch_time = Seconds(start, clock());
+
+  for (ogg_int64_t t=0; t<num_targets; t++) {
+    OffsetRange expected = single[t];
+    if (!found[t]) {
+      expected.start = expected.end = -1;
+    }
+    if (ranges[t].start != expected.start || ranges[t].end != expected.end) {
+      cerr << "FAIL: SeekBatch() disagrees with Seek() at " << times[t]
+           << "ms, [" << ranges[t].start << "," << ranges[t].end
+           << "] vs [" << expected.start << "," << expected.end << "]"
+           << endl;
+      return -1;
+    }
+  }
+
+  cout << setw(10) << "targets" << setw(10) << "fetches"
+       << setw(14) << "seek_us" << setw(14) << "batch_us" << endl;
+  cout << setw(10) << num_targets << setw(10) << fetches.size()
+       << setw(14) << setprecision(3) << seek_time * 1e6 / num_targets
+       << setw(14) << setprecision(3) << batch_time * 1e6 / num_targets
+       << endl;
+  return 0;
+}
+
+// Size of the chunks fed to libogg in the page benchmark, as ReadPage() uses.
+#define PAGE_BENCH_CHUNK (1024 * 1024)
+
+// Finds every page in data through an ogg_sync_state, as ReadPage() does,
+// but without the file reads. Returns the number of pages found.
+static ogg_int64_t
+ScanWithLibogg(const unsigned char* data, ogg_int64_t length) {
+  ogg_sync_state state;
+  ogg_sync_init(&state);
+  ogg_page page;
+  ogg_int64_t pages = 0, pos = 0;
+  while (true) {
+    if (ogg_sync_pageout(&state, &page) == 1) {
+      pages++;
+      continue;
+    }
+    if (pos == length) {
+      break;
+    }
+    long bytes = (long)min((ogg_int64_t)PAGE_BENCH_CHUNK, length - pos);
+    char* buffer = ogg_sync_buffer(&state, bytes);
+    memcpy(buffer, data + pos, bytes);
+    ogg_sync_wrote(&state, bytes);
+    pos += bytes;
+  }
+  ogg_sync_clear(&state);
+  return pages;
+}
+
+// Finds every page in data with a PageScanner, using threads threads.
+// Returns the number of pages found, and stores a checksum of their offsets
+// and the number of bytes skipped in check, if it's non-null.
+static ogg_int64_t
+ScanWithScanner(const unsigned char* data, ogg_int64_t length, bool verify,
+                int threads = 1, ogg_int64_t* check = 0) {
+  PageScanner scanner(data, length);
+  scanner.SetVerifyChecksums(verify);
+  scanner.SetThreads(threads);
+  ogg_page page;
+  ogg_int64_t pages = 0;
+  ogg_int64_t sum = 0;
+  while (scanner.NextPage(&page)) {
+    pages++;
+    sum = sum * 31 + scanner.PageOffset();
+  }
+  if (check) {
+    *check = sum * 31 + scanner.BytesSkipped();
+  }
+  return pages;
+}
+
+// Measures how fast the pages of an Ogg file can be found, by libogg and by
+// our own page scanner, and how fast each checksum method runs over the
+// whole file. The file is memory mapped and read once before timing, so
+// this times parsing, not I/O. Throughput is in MB/s of input.
+static int
+BenchPages(const char* filename) {
+  MappedFile mapped;
+  if (!mapped.Open(filename)) {
+    cerr << "ERROR: Can't map " << filename << endl;
+    return -1;
+  }
+  const unsigned char* data = mapped.Data();
+  ogg_int64_t length = mapped.Length();
+  double megabytes = (double)length / (1024 * 1024);
+
+  ogg_int64_t libogg_pages = ScanWithLibogg(data, length);
+  if (ScanWithScanner(data, length, true) != libogg_pages) {
+    cerr << "FAIL: PageScanner disagrees with libogg on the number of pages"
+         << endl;
+    return -1;
+  }
+  cout << libogg_pages << " pages in " << length << " bytes, checksums by "
+       << checksum_method_name(best_checksum_method()) << endl;
+  cout << setw(20) << "scanner" << setw(14) << "MB/s" << endl;
+
+  const char* names[] = { "libogg", "PageScanner", "PageScanner -t" };
+  for (int s=0; s<3; s++) {
+    int repeats = 0;
+    clock_t start = clock();
+    do {
+      if (s == 0) {
+        ScanWithLibogg(data, length);
+      } else {
+        ScanWithScanner(data, length, s == 1);
+      }
+      repeats++;
+    } while (Seconds(start, clock()) < MIN_BENCH_SECONDS);
+    double seconds = Seconds(start, clock()) / repeats;
+    cout << setw(20) << names[s]
+         << setw(14) << setprecision(4) << megabytes / seconds << endl;
+  }
+
+  // Threads are timed by the wall clock, not by the processor time they
+  // use between them. Each must find exactly the pages one thread does.
+  ogg_int64_t expected = 0;
+  ScanWithScanner(data, length, true, 1, &expected);
+  int processors = 1;
+#if !defined WIN32
+  processors = max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+  cout << setw(20) << "threads" << setw(14) << "MB/s" << endl;
+  for (int threads=1; threads==1 || threads<=max(2, processors); threads*=2) {
+    ogg_int64_t check = 0;
+    int repeats = 0;
+    double start = WallClockSeconds();
+    do {
+      ScanWithScanner(data, length, true, threads, &check);
+      if (check != expected) {
+        cerr << "FAIL: PageScanner with " << threads << " threads found "
+             << "different pages" << endl;
+        return -1;
+      }
+      repeats++;
+    } while (WallClockSeconds() - start < MIN_BENCH_SECONDS);
+    double seconds = (WallClockSeconds() - start) / repeats;
+    cout << setw(20) << threads
+         << setw(14) << setprecision(4) << megabytes / seconds << endl;
+  }
+
+  cout << setw(20) << "checksum" << setw(14) << "MB/s" << endl;
+  for (int m=0; m<=CHECKSUM_MAX; m++) {
+    ChecksumMethod method = (ChecksumMethod)m;
+    if (!checksum_method_supported(method)) {
+      continue;
+    }
+    int repeats = 0;
+    ogg_uint32_t crc = 0;
+    clock_t start = clock();
+    do {
+      crc = checksum_update(method, crc, data, length);
+      repeats++;
+    } while (Seconds(start, clock()) < MIN_BENCH_SECONDS);
+    double seconds = Seconds(start, clock()) / repeats;
+    cout << setw(20) << checksum_method_name(method)
+         << setw(14) << setprecision(4) << megabytes / seconds << endl;
+  }
+  return 0;
+}
+
+enum ReadMethod {
+  READ_IFSTREAM,
+  READ_THREAD,
+  READ_IO_URING
+};
+
+// Reads and decodes every page of an Ogg file, as the indexer does when it
+// can't map its input, either reading synchronously through an ifstream,
+// or reading ahead through an AsyncReader, on a thread or with io_uring.
+// Stores the name of the method used in name. Returns the number of pages,
+// or -1 if the file can't be opened.
+static ogg_int64_t
+DecodeFile(const char* filename, ReadMethod method, const char** name) {
+  ifstream input;
+  AsyncReader reader;
+  bool async = method != READ_IFSTREAM;
+  if (async ? !reader.Open(filename, method == READ_IO_URING)
+            : (input.open(filename, ios::in | ios::binary), !input.good())) {
+    return -1;
+  }
+  *name = async ? reader.Method() : "ifstream";
+  ogg_sync_state state;
+  ogg_sync_init(&state);
+  DecoderMap decoders;
+  ogg_page page;
+  memset(&page, 0, sizeof(ogg_page));
+  ogg_uint64_t bytesRead = 0;
+  ogg_int64_t offset = 0, pages = 0;
+  while (async ? ReadPage(&state, &page, reader, bytesRead)
+               : ReadPage(&state, &page, input, bytesRead)) {
+    ogg_uint32_t serial = ogg_page_serialno(&page);
+    if (ogg_page_bos(&page)) {
+      decoders[serial] = Decoder::Create(&page);
+    }
+    Decoder* decoder = decoders[serial];
+    if (decoder) {
+      decoder->Decode(&page, offset);
+    }
+    offset += page.header_len + page.body_len;
+    pages++;
+  }
+  ogg_sync_clear(&state);
+  for (DecoderMap::iterator itr = decoders.begin();
+       itr != decoders.end();
+       itr++)
+  {
+    delete itr->second;
+  }
+  return pages;
+}
+
+// Measures how fast an Ogg file can be read and decoded, reading it
+// synchronously, with a thread reading ahead, and with io_uring. With a
+// warm page cache this shows the reader thread's overhead; with a cold
+// cache, or a network mount, it shows how much reading overlaps with
+// decoding. Times are wall clock, and throughput is in MB/s of input.
+static int
+BenchRead(const char* filename) {
+  ogg_int64_t length = FileLength(filename);
+  double megabytes = (double)length / (1024 * 1024);
+  cout << setw(20) << "reader" << setw(14) << "MB/s" << endl;
+  const ReadMethod methods[] = { READ_IFSTREAM, READ_THREAD, READ_IO_URING };
+  ogg_int64_t pages[3];
+  for (int r=0; r<3; r++) {
+    const char* name = 0;
+    double start = WallClockSeconds();
+    pages[r] = DecodeFile(filename, methods[r], &name);
+    double seconds = WallClockSeconds() - start;
+    if (pages[r] < 0) {
+      cerr << "ERROR: Can't open " << filename << endl;
+      return -1;
+    }
+    cout << setw(20) << name
+         << setw(14) << setprecision(4) << megabytes / seconds << endl;
+  }
+  if (pages[0] != pages[1] || pages[0] != pages[2]) {
+    cerr << "FAIL: The readers found different numbers of pages" << endl;
+    return -1;
+  }
+  return 0;
+}
+
+// Measures how fast a file can be copied through a buffer, as the indexer
+// does when the kernel can't copy it, and with io_uring. The copy is
+// written next to the file, so that it's on the same device, and removed
+// afterwards.
+static int
+BenchCopy(const char* filename) {
+  ogg_int64_t length = FileLength(filename);
+  double megabytes = (double)length / (1024 * 1024);
+  string copyName = string(filename) + ".benchcopy";
+  cout << setw(20) << "copy" << setw(14) << "MB/s" << endl;
+  for (int r=0; r<2; r++) {
+    const char* name = r == 0 ? "read/write" : "io_uring";
+    double start = WallClockSeconds();
+    bool copied = false;
+    if (r == 0) {
+      ifstream input(filename, ios::in | ios::binary);
+      ofstream output(copyName.c_str(), ios::out | ios::binary);
+      CopyFileData(input, output, length);
+      output.close();
+      copied = !output.fail();
+    } else {
+#if defined HAVE_IO_URING
+      int in = open(filename, O_RDONLY);
+      int out = open(copyName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      copied = in != -1 && out != -1 &&
+               RingCopy(in, 0, out, 0, length) == length;
+      if (in != -1) {
+        close(in);
+      }
+      if (out != -1 && close(out) != 0) {
+        copied = false;
+      }
+#else
+      cout << setw(20) << name << setw(14) << "unavailable" << endl;
+      continue;
+#endif
+    }
+    double seconds = WallClockSeconds() - start;
+    if (!copied || FileLength(copyName.c_str()) != length) {
+      cerr << "FAIL: " << name << " didn't copy " << filename << endl;
+      remove(copyName.c_str());
+      return -1;
+    }
+    cout << setw(20) << name
+         << setw(14) << setprecision(4) << megabytes / seconds << endl;
+  }
+  remove(copyName.c_str());
+  return 0;
+}
+
+// Length of each page body in a sparse file. Each page holds one packet,
+// laced as 254 lacing values of 255 and a final 254.
+#define SPARSE_BODY_BYTES (255 * 255 - 1)
+
+// Frames from one keyframe to the next in a sparse file.
+#define SPARSE_KEYFRAME_INTERVAL 64
+
+// Writes an Ogg file of about gigabytes GB holding one theora stream. The
+// stream's header pages are copied from the first theora stream in
+// theoraFilename. Its frames are one packet a page, with only their first
+// byte, which says whether they're a keyframe, written; the rest of each
+// page body is skipped over, so it's left as a hole on filesystems which
+// support sparse files. The indexer never decodes frames, so the file
+// indexes as any other does. Prints the offset of the first frame.
+static int
+WriteSparseFile(const char* theoraFilename,
+                const char* filename,
+                double gigabytes)
+{
+  MappedFile mapped;
+  if (!mapped.Open(theoraFilename)) {
+    cerr << "ERROR: Can't map " << theoraFilename << endl;
+    return -1;
+  }
+  ofstream out(filename, ios::out | ios::binary | ios::trunc);
+  if (!out) {
+    cerr << "ERROR: Can't open " << filename << " for writing" << endl;
+    return -1;
+  }
+
+  // Copy the theora stream's header pages.
+  PageScanner scanner(mapped.Data(), mapped.Length());
+  Decoder* decoder = 0;
+  ogg_page page;
+  ogg_int64_t offset = 0;
+  long pageno = 0;
+  while (!(decoder && decoder->GotAllHeaders()) && scanner.NextPage(&page)) {
+    if (!decoder && ogg_page_bos(&page)) {
+      decoder = Decoder::Create(&page);
+      if (decoder && decoder->Type() != TYPE_THEORA) {
+        delete decoder;
+        decoder = 0;
+      }
+    }
+    if (!decoder || (ogg_uint32_t)ogg_page_serialno(&page) != decoder->GetSerial()) {
+      continue;
+    }
+    decoder->Decode(&page, offset);
+    out.write((const char*)page.header, page.header_len);
+    out.write((const char*)page.body, page.body_len);
+    offset += page.header_len + page.body_len;
+    pageno = ogg_page_pageno(&page) + 1;
+  }
+  if (!decoder || !decoder->GotAllHeaders()) {
+    cerr << "ERROR: No theora stream's headers in " << theoraFilename << endl;
+    delete decoder;
+    return -1;
+  }
+  ogg_uint32_t serialno = decoder->GetSerial();
+  ogg_int32_t shift = decoder->GetFisboneInfo().mGranuleShift;
+  delete decoder;
+  cout << "Content offset: " << offset << endl;
+
+  // Write the frames.
+  ogg_int64_t target = (ogg_int64_t)(gigabytes * 1024 * 1024 * 1024);
+  vector<unsigned char> header(27 + 255, 0);
+  vector<unsigned char> body(SPARSE_BODY_BYTES, 0);
+  ogg_int64_t frame = 0, keyframe = 0;
+  while (offset < target) {
+    ogg_int64_t length = header.size() + body.size();
+    bool last = offset + 2 * length > target;
+    if (frame % SPARSE_KEYFRAME_INTERVAL == 0) {
+      keyframe = frame + 1;
+    }
+    ogg_int64_t granulepos = (keyframe << shift) | (frame + 1 - keyframe);
+    body[0] = keyframe == frame + 1 ? 0x00 : 0x40;
+
+    memcpy(&header[0], "OggS", 4);
+    header[4] = 0;
+    header[5] = last ? 0x04 : 0x00;
+    WriteLEInt64(&header[6], granulepos);
+    WriteLEUint32(&header[14], serialno);
+    WriteLEUint32(&header[18], (ogg_uint32_t)pageno);
+    WriteLEUint32(&header[22], 0);
+    header[26] = 255;
+    memset(&header[27], 255, 254);
+    header[27 + 254] = 254;
+    page.header = &header[0];
+    page.header_len = header.size();
+    page.body = &body[0];
+    page.body_len = body.size();
+    ogg_page_checksum_set(&page);
+
+    out.write((const char*)&header[0], header.size());
+    if (last) {
+      // Write the whole body, so that the file ends where the page does.
+      out.write((const char*)&body[0], body.size());
+    } else {
+      out.write((const char*)&body[0], 1);
+      out.seekp(body.size() - 1, ios::cur);
+    }
+    offset += length;
+    frame++;
+    pageno++;
+  }
+  out.close();
+  if (out.fail()) {
+    cerr << "ERROR: Failed writing " << filename << endl;
+    return -1;
+  }
+  cout << "Wrote " << offset << " bytes, " << frame << " frames" << endl;
+  return 0;
+}
+
+int main(int argc, char** argv) 
+{
+  if (argc < 2) {
+    PrintUsage();
+    return -1;
+  }
+  srand(1);
+  if (strcmp(argv[1], "rice") == 0) {
+    ogg_int64_t num_pairs = argc > 2 ? atoi(argv[2]) : 1000000;
+    if (num_pairs <= 0) {
+      PrintUsage();
+      return -1;
+    }
+    return BenchRice(num_pairs);
+  }
+  if (strcmp(argv[1], "seek") == 0) {
+    ogg_int64_t num_keypoints = argc > 2 ? atoi(argv[2]) : 100000;
+    if (num_keypoints <= 0) {
+      PrintUsage();
+      return -1;
+    }
+    return BenchSeek(num_keypoints);
+  }
+  if (strcmp(argv[1], "query") == 0) {
+    ogg_int64_t num_targets = argc > 3 ? atoi(argv[3]) : 1000;
+    if (argc < 3 || argc > 4 || num_targets <= 0) {
+      PrintUsage();
+      return -1;
+    }
+    return BenchQuery(argv[2], num_targets);
+  }
+  if (strcmp(argv[1], "codecs") == 0) {
+    if (argc < 3) {
+      PrintUsage();
+      return -1;
+    }
+    return BenchCodecs(argc - 2, argv + 2);
+  }
+  if (strcmp(argv[1], "pages") == 0) {
+    if (argc != 3) {
+      PrintUsage();
+      return -1;
+    }
+    return BenchPages(argv[2]);
+  }
+  if (strcmp(argv[1], "read") == 0) {
+    if (argc != 3) {
+      PrintUsage();
+      return -1;
+    }
+    return BenchRead(argv[2]);
+  }
+  if (strcmp(argv[1], "copy") == 0) {
+    if (argc != 3) {
+      PrintUsage();
+      return -1;
+    }
+    return BenchCopy(argv[2]);
+  }
+  if (strcmp(argv[1], "sparse") == 0) {
+    double gigabytes = argc == 5 ? atof(argv[4]) : 0;
+    if (gigabytes <= 0) {
+      PrintUsage();
+      return -1;
+    }
+    return WriteSparseFile(argv[2], argv[3], gigabytes);
+  }
+  PrintUsage();
+  return -1;
+}
@@ -43,9 +43,13 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 Options gOptions;
 
+// Keypoints per index block when -r is used without -b.
+#define DEFAULT_INDEX_BLOCK_SIZE 64
+
 Options::Options()
   : mDumpPackets(false)
   , mDumpKeyPackets(false)
@@ -53,6 +57,17 @@ Options::Options()
   , mDumpMerge(false)
   , mVerifyIndex(false)
   , mKeyPointInterval(2000)
+  , mIndexBlockSize(0)
+  , mBlockRiceParams(false)
+  , mIndexCodec(CODEC_RICE)
+  , mVerifyChecksums(true)
+  , mAlignContent(false)
+  , mReservedPadding(0)
+  , mRewriteInPlace(false)
+  , mOnePass(false)
+  , mJobs(0)
+  , mScanThreads(1)
+  , mDecodeThreads(false)
 {
 }
 
@@ -94,19 +109,58 @@ void Options::PrintHelp() {
     << "Indexes an Ogg file to provide allow faster seeking." << endl
     << endl
     << "Usage:" << endl
-    << "  OggIndex [-i <interval> -v -d -k -p -m -o <out filename>] <in filename>" << endl
+    << "  OggIndex [-i <interval> -b <keypoints> -r -c <coder> -n <threads> -w -t -a -s <bytes> -u -1 -v -d -k -p -m -o <out filename>] <in filename>" << endl
+    << "  OggIndex [options] -l <list> [-j <jobs>]" << endl
     << endl
     << "Options:" << endl
     << "  -i <interval>  --  minimum <interval> in ms between keyframes (default 2000)" << endl
+    << "  -b <keypoints> --  store index keypoints in blocks of <keypoints>, with a" << endl
+    << "                     table of blocks for fast lookups (Skeleton 4.1)" << endl
+    << "  -r             --  choose Rice parameters per index block (Skeleton 4.2)," << endl
+    << "                     uses blocks of " << DEFAULT_INDEX_BLOCK_SIZE << " keypoints unless -b is given" << endl
+    << "  -c <coder>     --  code index keypoints with <coder>, one of rice, gamma," << endl
+    << "                     delta or ans (default rice); others need Skeleton 4.3" << endl
+    << "  -n <threads>   --  find the input's pages with <threads> threads, which" << endl
+    << "                     helps with very large files (default 1)" << endl
+    << "  -w             --  decode each track on its own thread, which helps" << endl
+    << "                     with files which have several tracks" << endl
+    << "  -t             --  trust the input, don't check its page checksums" << endl
+    << "  -a             --  pad the skeleton track so the content keeps its offset" << endl
+    << "                     within a filesystem block, so that filesystems which" << endl
+    << "                     support reflinks can share it with the input" << endl
+    << "  -s <bytes>     --  reserve <bytes> of padding in the skeleton track, so" << endl
+    << "                     that the output can later be re-indexed with -u" << endl
+    << "  -u             --  re-index <in filename> in place, rewriting only its" << endl
+    << "                     header pages; needs enough padding reserved by -s" << endl
+    << "  -1             --  index in one pass, writing the content while it's" << endl
+    << "                     read, after space reserved for a predicted index" << endl
     << "  -v             --  verify the index in the output file" << endl
     << "  -d             --  dump packet info to stdout" << endl
     << "  -k             --  dump only keyframe packet info to stdout" << endl
     << "  -p             --  dump page info to stdout" << endl
     << "  -m             --  dump stream keyframe merge info to stdout" << endl
     << "  -o <filename>  --  use <filename> as the output filename" << endl
+    << "  -l <list>      --  index every file named in <list>, one per line, or" << endl
+    << "                     every Ogg file under the directory <list>" << endl
+    << "  -j <jobs>      --  with -l, index <jobs> files at once (default one per" << endl
+    << "                     processor)" << endl
     << endl
     << "If no output filename is specified, the indexed ogg file is written" << endl
     << "into <in filename>.indexed.ogg" << endl 
+    << endl
+    << "Use - as <in filename> to read from stdin, and as <out filename> to" << endl
+    << "write to stdout, which is the default when reading from stdin. Content" << endl
+    << "read from stdin is spooled in memory, and then in a temporary file, until" << endl
+    << "the index has been written." << endl
+    << endl
+    << "Re-indexing with -u keeps the content where it is, so it fails if the" << endl
+    << "new skeleton track doesn't fit in the space of the old one. With -1, the" << endl
+    << "index is made coarser until it fits the space reserved for it, and the" << endl
+    << "content is copied again if it never does." << endl
+    << endl
+    << "With -l, each file is indexed by a separate OggIndex process, with the" << endl
+    << "other options given, and written to <in filename>.indexed.ogg. A file" << endl
+    << "which fails to index doesn't stop the others." << endl
     << endl;
 }
 
@@ -119,7 +173,19 @@ IsArgument(const char* s) {
          strcmp(s, "-p") == 0 ||
          strcmp(s, "-o") == 0 ||
          strcmp(s, "-m") == 0 ||
-         strcmp(s, "-i") == 0;
+         strcmp(s, "-i") == 0 ||
+         strcmp(s, "-b") == 0 ||
+         strcmp(s, "-r") == 0 ||
+         strcmp(s, "-c") == 0 ||
+         strcmp(s, "-t") == 0 ||
+         strcmp(s, "-a") == 0 ||
+         strcmp(s, "-s") == 0 ||
+         strcmp(s, "-u") == 0 ||
+         strcmp(s, "-1") == 0 ||
+         strcmp(s, "-l") == 0 ||
+         strcmp(s, "-j") == 0 ||
+         strcmp(s, "-n") == 0 ||
+         strcmp(s, "-w") == 0;
 }
 
 static bool
@@ -128,6 +194,21 @@ FileExists(const char* filename) {
   return stat(filename, &x) != -1;
 }
 
+// Parses a positive 64 bit number of bytes, which may be larger than a
+// long holds on Windows and 32 bit targets. Returns false if s isn't a
+// number, or is out of range.
+static bool
+ParseBytes(const char* s, ogg_int64_t* bytes) {
+  char* end = 0;
+  errno = 0;
+#if defined WIN32
+  *bytes = _strtoi64(s, &end, 10);
+#else
+  *bytes = strtoll(s, &end, 10);
+#endif
+  return errno == 0 && end != s && *end == '\0' && *bytes > 0;
+}
+
 bool Options::Parse(int argc, char** argv) {
   const char* error = 0;
   if (!DoParse(argc, argv, &error)) {
@@ -135,7 +216,15 @@ bool Options::Parse(int argc, char** argv) {
     cout << error << endl;
     return false;
   }
-  cout << "Writing output to '" << mOutputFilename.c_str() << "'" << endl;
+  if (GetBatch()) {
+    // Each file's progress is reported as it finishes.
+  } else if (mRewriteInPlace) {
+    cout << "Re-indexing '" << mOutputFilename.c_str() << "' in place" << endl;
+  } else if (GetOutputToStdout()) {
+    cerr << "Writing output to stdout" << endl;
+  } else {
+    cout << "Writing output to '" << mOutputFilename.c_str() << "'" << endl;
+  }
   return true;
 }
 
@@ -182,6 +271,31 @@ bool Options::DoParse(int argc, char** argv, const char** error) {
       continue;
     }
 
+    if (strcmp(arg, "-t") == 0) {
+      mVerifyChecksums = false;
+      continue;
+    }
+
+    if (strcmp(arg, "-w") == 0) {
+      mDecodeThreads = true;
+      continue;
+    }
+
+    if (strcmp(arg, "-a") == 0) {
+      mAlignContent = true;
+      continue;
+    }
+
+    if (strcmp(arg, "-u") == 0) {
+      mRewriteInPlace = true;
+      continue;
+    }
+
+    if (strcmp(arg, "-1") == 0) {
+      mOnePass = true;
+      continue;
+    }
+
     if (strcmp(arg, "-m") == 0) {
       mDumpMerge = true;
       continue;
@@ -208,13 +322,85 @@ bool Options::DoParse(int argc, char** argv, const char** error) {
       continue;
     }
 
+    if (strcmp(arg, "-r") == 0) {
+      mBlockRiceParams = true;
+      continue;
+    }
+
+    if (strcmp(arg, "-c") == 0) {
+      int codec = -1;
+      if (argIndex+1 == argc || IsArgument(argv[argIndex+1]) || (codec = IndexCodec::IdFromName(argv[argIndex+1])) == -1) {
+        *error = "ERROR: You must specify one of rice, gamma, delta or ans with '-c' argument";
+        return false;
+      }
+      mIndexCodec = (unsigned char)codec;
+      argIndex++;
+      continue;
+    }
+
+    if (strcmp(arg, "-b") == 0) {
+      ogg_int32_t blockSize = 0;
+      if (argIndex+1 == argc || IsArgument(argv[argIndex+1]) || (blockSize = atoi(argv[argIndex+1])) <= 0) {
+        *error = "ERROR: You must specify a positive number of keypoints per block with '-b' argument";
+        return false;
+      }
+      mIndexBlockSize = blockSize;
+      argIndex++;
+      continue;
+    }
+
+    if (strcmp(arg, "-n") == 0) {
+      ogg_int32_t threads = 0;
+      if (argIndex+1 == argc || IsArgument(argv[argIndex+1]) || (threads = atoi(argv[argIndex+1])) <= 0) {
+        *error = "ERROR: You must specify a positive number of threads with '-n' argument";
+        return false;
+      }
+      mScanThreads = threads;
+      argIndex++;
+      continue;
+    }
+
+    if (strcmp(arg, "-s") == 0) {
+      ogg_int64_t bytes = 0;
+      if (argIndex+1 == argc || IsArgument(argv[argIndex+1]) || !ParseBytes(argv[argIndex+1], &bytes)) {
+        *error = "ERROR: You must specify a positive number of bytes with '-s' argument";
+        return false;
+      }
+      mReservedPadding = bytes;
+      argIndex++;
+      continue;
+    }
+
+    if (strcmp(arg, "-l") == 0) {
+      if (argIndex+1 == argc || IsArgument(argv[argIndex+1]) || !FileExists(argv[argIndex+1])) {
+        *error = "ERROR: You must specify a list of files, or a directory, with '-l' argument";
+        return false;
+      }
+      mBatchList = argv[argIndex+1];
+      argIndex++;
+      continue;
+    }
+
+    if (strcmp(arg, "-j") == 0) {
+      ogg_int32_t jobs = 0;
+      if (argIndex+1 == argc || IsArgument(argv[argIndex+1]) || (jobs = atoi(argv[argIndex+1])) <= 0) {
+        *error = "ERROR: You must specify a positive number of jobs with '-j' argument";
+        return false;
+      }
+      mJobs = jobs;
+      argIndex++;
+      continue;
+    }
+
     if (!mInputFilename.empty()) {
       *error = "ERROR: You cannot specify more than one input file";
       return false;
     }
 
     // Assume argument is input filename.
-    if (!FileExists(argv[argIndex])) {
+    if (strcmp(argv[argIndex], STDIO_FILENAME) != 0 &&
+        !FileExists(argv[argIndex]))
+    {
       *error = "ERROR: Input file does not exist";
       return false;
     }
@@ -222,12 +408,66 @@ bool Options::DoParse(int argc, char** argv, const char** error) {
     mInputFilename = argv[argIndex];
   }
 
+  if (mIndexCodec != CODEC_RICE && (mBlockRiceParams || mIndexBlockSize)) {
+    *error = "ERROR: Index blocks (-b and -r) can only be used with the rice coder";
+    return false;
+  }
+
+  if (mBlockRiceParams && mIndexBlockSize == 0) {
+    mIndexBlockSize = DEFAULT_INDEX_BLOCK_SIZE;
+  }
+
+  if (GetInputFromStdin() && (mRewriteInPlace || mAlignContent)) {
+    *error = "ERROR: You can't use -u or -a when reading from stdin";
+    return false;
+  }
+
+  if (mOnePass && (GetInputFromStdin() || mRewriteInPlace || mAlignContent)) {
+    *error = "ERROR: You can't use -1 with -u or -a, or when reading from stdin";
+    return false;
+  }
+
+  if (GetBatch()) {
+    if (!mInputFilename.empty() || !mOutputFilename.empty()) {
+      *error = "ERROR: You can't give an input file or -o with -l, which names the inputs";
+      return false;
+    }
+    if (mRewriteInPlace && (mAlignContent || mReservedPadding)) {
+      *error = "ERROR: You can't use -a or -s with -u, which rewrites each input file";
+      return false;
+    }
+    // Each file is checked by the indexer run on it.
+    return true;
+  }
+
+  if (mJobs) {
+    *error = "ERROR: You can only use -j with -l";
+    return false;
+  }
+
+  if (mRewriteInPlace) {
+    if (!mOutputFilename.empty() || mAlignContent || mReservedPadding) {
+      *error = "ERROR: You can't use -o, -a or -s with -u, which rewrites the input file";
+      return false;
+    }
+    mOutputFilename = mInputFilename;
+  }
+
   if (mOutputFilename.empty()) {
-    // No output filename specified, use input.indexed.extension.
-    mOutputFilename = OutputFilename(mInputFilename);
+    // No output filename specified, use input.indexed.extension, or stdout
+    // if the input is stdin.
+    mOutputFilename = GetInputFromStdin() ? string(STDIO_FILENAME)
+                                          : OutputFilename(mInputFilename);
+  }
+
+  if (GetOutputToStdout() && (mVerifyIndex || mAlignContent || mOnePass)) {
+    *error = "ERROR: You can't use -v, -a or -1 when writing to stdout";
+    return false;
   }
 
-  if (mInputFilename.compare(mOutputFilename) == 0) {
+  if (!mRewriteInPlace && !GetInputFromStdin() &&
+      mInputFilename.compare(mOutputFilename) == 0)
+  {
     *error = "ERROR: output filename must be different from the input filename";
     return false;
   }
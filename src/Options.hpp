@@ -45,6 +45,9 @@
 using namespace std;
 
 #define VERSION "1.0-alpha"
+
+// Filename which stands for stdin as the input, or stdout as the output.
+#define STDIO_FILENAME "-"
 #include "ogg/os_types.h"
 
 
@@ -65,6 +68,58 @@ public:
   bool GetDumpPages();
   bool GetVerifyIndex();
   ogg_int32_t GetKeyPointInterval() { return mKeyPointInterval; }
+
+  // Number of keypoints per block in block partitioned indexes, or 0 to
+  // write unpartitioned Skeleton 4.0 indexes.
+  ogg_int32_t GetIndexBlockSize() { return mIndexBlockSize; }
+
+  // True if each index block should choose its own Rice parameters.
+  bool GetBlockRiceParams() { return mBlockRiceParams; }
+
+  // IndexCodecId of the coder to use for index keypoints. Anything other
+  // than Rice writes Skeleton 4.3 indexes.
+  unsigned char GetIndexCodec() { return mIndexCodec; }
+
+  // False if the input is trusted, and its page checksums needn't be
+  // checked while indexing.
+  bool GetVerifyChecksums() { return mVerifyChecksums; }
+
+  // True if the skeleton track should be padded so that the content keeps
+  // its offset within a filesystem block.
+  bool GetAlignContent() { return mAlignContent; }
+
+  // Bytes of padding to reserve in the skeleton track, so that the file can
+  // later be re-indexed in place.
+  ogg_int64_t GetReservedPadding() { return mReservedPadding; }
+
+  // True if the input should be re-indexed in place, by rewriting only its
+  // header pages.
+  bool GetRewriteInPlace() { return mRewriteInPlace; }
+
+  // True if the content should be written while the input is scanned,
+  // after space reserved for a skeleton track of predicted length.
+  bool GetOnePass() { return mOnePass; }
+
+  // True if the input is read from stdin. It can only be read once, so its
+  // content is spooled while it's indexed.
+  bool GetInputFromStdin() { return mInputFilename.compare(STDIO_FILENAME) == 0; }
+
+  // True if the output is written to stdout. Messages then go to stderr.
+  bool GetOutputToStdout() { return mOutputFilename.compare(STDIO_FILENAME) == 0; }
+
+  // File listing the inputs to index in a batch, or a directory to search
+  // for them, or empty to index a single input.
+  string GetBatchList() { return mBatchList; }
+  bool GetBatch() { return !mBatchList.empty(); }
+
+  // Number of files to index at once in a batch, or 0 for one per core.
+  ogg_int32_t GetJobs() { return mJobs; }
+
+  // Number of threads which find the pages of a memory mapped input.
+  ogg_int32_t GetScanThreads() { return mScanThreads; }
+
+  // True if each track's pages should be decoded on its own thread.
+  bool GetDecodeThreads() { return mDecodeThreads; }
 private:
 
   void PrintHelp();
@@ -80,6 +135,18 @@ private:
   string mInputFilename;
   string mOutputFilename;
   ogg_int32_t mKeyPointInterval;
+  ogg_int32_t mIndexBlockSize;
+  bool mBlockRiceParams;
+  unsigned char mIndexCodec;
+  bool mVerifyChecksums;
+  bool mAlignContent;
+  ogg_int64_t mReservedPadding;
+  bool mRewriteInPlace;
+  bool mOnePass;
+  string mBatchList;
+  ogg_int32_t mJobs;
+  ogg_int32_t mScanThreads;
+  bool mDecodeThreads;
 
 };
 
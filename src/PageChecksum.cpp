@@ -0,0 +1,272 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * PageChecksum.cpp - Ogg page checksums.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <ogg/ogg.h>
+
+#include "PageChecksum.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CLMUL_CHECKSUM 1
+#include <immintrin.h>
+#endif
+
+#define CRC_POLY 0x04c11db7
+
+// Offset of the page checksum in the page header.
+#define PAGE_CHECKSUM_OFFSET 22
+
+// Smallest buffer worth folding with carry-less multiplication. Below this
+// the setup and the final reduction cost more than they save.
+#define CLMUL_MIN_BYTES 128
+
+// Lookup tables for the bytewise and slicing-by-8 checksums. mTable[k][b]
+// is the CRC of byte b followed by k zero bytes. Built before main() runs,
+// so that they're safe to use from any thread.
+class CrcTables {
+public:
+  CrcTables() {
+    for (ogg_uint32_t b=0; b<256; b++) {
+      ogg_uint32_t r = b << 24;
+      for (int j=0; j<8; j++) {
+        r = (r & 0x80000000) ? (r << 1) ^ CRC_POLY : (r << 1);
+      }
+      mTable[0][b] = r;
+    }
+    for (int k=1; k<8; k++) {
+      for (ogg_uint32_t b=0; b<256; b++) {
+        ogg_uint32_t r = mTable[k-1][b];
+        mTable[k][b] = (r << 8) ^ mTable[0][r >> 24];
+      }
+    }
+  }
+  ogg_uint32_t mTable[8][256];
+};
+
+static const CrcTables gCrc;
+
+static ogg_uint32_t
+crc_bytewise(ogg_uint32_t crc, const unsigned char* p, ogg_int64_t n) {
+  const ogg_uint32_t* t = gCrc.mTable[0];
+  for (ogg_int64_t i=0; i<n; i++) {
+    crc = (crc << 8) ^ t[(crc >> 24) ^ p[i]];
+  }
+  return crc;
+}
+
+static ogg_uint32_t
+crc_slice8(ogg_uint32_t crc, const unsigned char* p, ogg_int64_t n) {
+  const ogg_uint32_t (*t)[256] = gCrc.mTable;
+  while (n >= 8) {
+    ogg_uint32_t hi = crc ^ (((ogg_uint32_t)p[0] << 24) |
+                             ((ogg_uint32_t)p[1] << 16) |
+                             ((ogg_uint32_t)p[2] << 8) |
+                              (ogg_uint32_t)p[3]);
+    crc = t[7][hi >> 24] ^ t[6][(hi >> 16) & 0xff] ^
+          t[5][(hi >> 8) & 0xff] ^ t[4][hi & 0xff] ^
+          t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    p += 8;
+    n -= 8;
+  }
+  return crc_bytewise(crc, p, n);
+}
+
+#ifdef HAVE_CLMUL_CHECKSUM
+
+// Returns x^n mod P, the CRC polynomial, as a 32-bit polynomial.
+static ogg_uint32_t
+x_pow_mod(ogg_int64_t n) {
+  ogg_uint32_t r = 1;
+  for (ogg_int64_t i=0; i<n; i++) {
+    r = (r & 0x80000000) ? (r << 1) ^ CRC_POLY : (r << 1);
+  }
+  return r;
+}
+
+// Folding constants, x^n mod P for the distances we fold over. The CRC is
+// linear, so a 128 bit chunk A = H*x^64 + L which is d bits ahead of where
+// it needs to be can be moved there as H*(x^(d+64) mod P) + L*(x^d mod P),
+// which is at most 96 bits.
+class ClmulConstants {
+public:
+  ClmulConstants()
+    : mFold512Lo(x_pow_mod(512))
+    , mFold512Hi(x_pow_mod(576))
+    , mFold128Lo(x_pow_mod(128))
+    , mFold128Hi(x_pow_mod(192))
+  {}
+  ogg_int64_t mFold512Lo;
+  ogg_int64_t mFold512Hi;
+  ogg_int64_t mFold128Lo;
+  ogg_int64_t mFold128Hi;
+};
+
+static const ClmulConstants gClmul;
+
+// Returns a * x^d + b mod P, with a folded by the constants k for d.
+__attribute__((target("pclmul,sse2")))
+static inline __m128i
+clmul_fold(__m128i a, __m128i k, __m128i b) {
+  __m128i hi = _mm_clmulepi64_si128(a, k, 0x11);
+  __m128i lo = _mm_clmulepi64_si128(a, k, 0x00);
+  return _mm_xor_si128(_mm_xor_si128(hi, lo), b);
+}
+
+// Loads 16 message bytes as a 128 bit polynomial, first bit highest.
+__attribute__((target("ssse3")))
+static inline __m128i
+clmul_load(const unsigned char* p, __m128i swap) {
+  return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), swap);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static ogg_uint32_t
+crc_clmul(ogg_uint32_t crc, const unsigned char* p, ogg_int64_t n) {
+  if (n < CLMUL_MIN_BYTES) {
+    return crc_slice8(crc, p, n);
+  }
+  const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                    8, 9, 10, 11, 12, 13, 14, 15);
+  const __m128i k512 = _mm_set_epi64x(gClmul.mFold512Hi, gClmul.mFold512Lo);
+  const __m128i k128 = _mm_set_epi64x(gClmul.mFold128Hi, gClmul.mFold128Lo);
+
+  // The CRC so far is equivalent to xoring it into the first four bytes.
+  __m128i a0 = _mm_xor_si128(clmul_load(p, swap),
+                             _mm_set_epi32((int)crc, 0, 0, 0));
+  __m128i a1 = clmul_load(p + 16, swap);
+  __m128i a2 = clmul_load(p + 32, swap);
+  __m128i a3 = clmul_load(p + 48, swap);
+  p += 64;
+  n -= 64;
+
+  // Fold four chunks at a time, each 512 bits on.
+  while (n >= 64) {
+    a0 = clmul_fold(a0, k512, clmul_load(p, swap));
+    a1 = clmul_fold(a1, k512, clmul_load(p + 16, swap));
+    a2 = clmul_fold(a2, k512, clmul_load(p + 32, swap));
+    a3 = clmul_fold(a3, k512, clmul_load(p + 48, swap));
+    p += 64;
+    n -= 64;
+  }
+
+  // Fold the four chunks into one, then any remaining whole chunks.
+  __m128i a = clmul_fold(a0, k128, a1);
+  a = clmul_fold(a, k128, a2);
+  a = clmul_fold(a, k128, a3);
+  while (n >= 16) {
+    a = clmul_fold(a, k128, clmul_load(p, swap));
+    p += 16;
+    n -= 16;
+  }
+
+  // What's left is congruent to the message so far, so its CRC is the
+  // message's CRC.
+  unsigned char folded[16];
+  _mm_storeu_si128((__m128i*)folded, _mm_shuffle_epi8(a, swap));
+  crc = crc_slice8(0, folded, 16);
+  return crc_slice8(crc, p, n);
+}
+
+#endif
+
+bool checksum_method_supported(ChecksumMethod method) {
+  switch (method) {
+    case CHECKSUM_BYTEWISE:
+    case CHECKSUM_SLICE8:
+      return true;
+    case CHECKSUM_CLMUL:
+#ifdef HAVE_CLMUL_CHECKSUM
+      return __builtin_cpu_supports("pclmul") &&
+             __builtin_cpu_supports("ssse3");
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+ChecksumMethod best_checksum_method() {
+  static const ChecksumMethod best =
+    checksum_method_supported(CHECKSUM_CLMUL) ? CHECKSUM_CLMUL
+                                              : CHECKSUM_SLICE8;
+  return best;
+}
+
+const char* checksum_method_name(ChecksumMethod method) {
+  switch (method) {
+    case CHECKSUM_BYTEWISE: return "bytewise";
+    case CHECKSUM_SLICE8: return "slice8";
+    case CHECKSUM_CLMUL: return "clmul";
+  }
+  return "unknown";
+}
+
+ogg_uint32_t checksum_update(ChecksumMethod method,
+                             ogg_uint32_t crc,
+                             const unsigned char* p,
+                             ogg_int64_t n)
+{
+  assert(checksum_method_supported(method));
+  switch (method) {
+    case CHECKSUM_BYTEWISE:
+      return crc_bytewise(crc, p, n);
+    case CHECKSUM_SLICE8:
+      return crc_slice8(crc, p, n);
+    case CHECKSUM_CLMUL:
+#ifdef HAVE_CLMUL_CHECKSUM
+      return crc_clmul(crc, p, n);
+#else
+      break;
+#endif
+  }
+  return crc_slice8(crc, p, n);
+}
+
+ogg_uint32_t page_checksum(const unsigned char* header,
+                           ogg_int64_t header_len,
+                           const unsigned char* body,
+                           ogg_int64_t body_len)
+{
+  assert(header_len >= PAGE_CHECKSUM_OFFSET + 4);
+  static const unsigned char zero[4] = {0, 0, 0, 0};
+  ChecksumMethod method = best_checksum_method();
+  ogg_uint32_t crc = crc_slice8(0, header, PAGE_CHECKSUM_OFFSET);
+  crc = crc_slice8(crc, zero, 4);
+  crc = crc_slice8(crc, header + PAGE_CHECKSUM_OFFSET + 4,
+                   header_len - PAGE_CHECKSUM_OFFSET - 4);
+  return checksum_update(method, crc, body, body_len);
+}
@@ -0,0 +1,81 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * PageChecksum.hpp - Ogg page checksums.
+ */
+
+#ifndef __PAGE_CHECKSUM_HPP__
+#define __PAGE_CHECKSUM_HPP__
+
+#include <ogg/ogg.h>
+
+// Ways of computing the Ogg page CRC, which is the CRC-32 with polynomial
+// 0x04c11db7, most significant bit first, zero initial value and no final
+// xor. They all give the same result.
+enum ChecksumMethod {
+  // One table lookup per byte, as libogg does.
+  CHECKSUM_BYTEWISE = 0,
+
+  // Slicing-by-8: eight table lookups per eight bytes.
+  CHECKSUM_SLICE8,
+
+  // Folds 64 bytes at a time using carry-less multiplication. Only on x86
+  // CPUs with PCLMULQDQ.
+  CHECKSUM_CLMUL,
+
+  CHECKSUM_MAX = CHECKSUM_CLMUL
+};
+
+// Returns true if the CPU can compute checksums with method.
+bool checksum_method_supported(ChecksumMethod method);
+
+// Returns the fastest method the CPU supports. This is what page_checksum()
+// uses.
+ChecksumMethod best_checksum_method();
+
+const char* checksum_method_name(ChecksumMethod method);
+
+// Continues the CRC crc over n more bytes, using method, which must be
+// supported.
+ogg_uint32_t checksum_update(ChecksumMethod method,
+                             ogg_uint32_t crc,
+                             const unsigned char* p,
+                             ogg_int64_t n);
+
+// Computes an Ogg page checksum, as if the page's checksum field were zero.
+ogg_uint32_t page_checksum(const unsigned char* header,
+                           ogg_int64_t header_len,
+                           const unsigned char* body,
+                           ogg_int64_t body_len);
+
+#endif
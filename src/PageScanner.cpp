@@ -0,0 +1,292 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * PageScanner.cpp - Zero-copy scanning of Ogg pages in memory mapped files.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <ogg/ogg.h>
+
+#if !defined WIN32
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "PageScanner.hpp"
+#include "PageChecksum.hpp"
+#include "Utils.hpp"
+
+// Size of an Ogg page header without its segment table.
+#define PAGE_HEADER_FIXED_LEN 27
+
+// Offset of the page checksum in the page header.
+#define PAGE_CHECKSUM_OFFSET 22
+
+// Offset of the number of segments in the page header.
+#define PAGE_SEGMENTS_OFFSET 26
+
+MappedFile::MappedFile()
+  : mData(0)
+  , mLength(0)
+{
+}
+
+MappedFile::~MappedFile() {
+  Close();
+}
+
+bool MappedFile::Open(const char* filename) {
+  Close();
+#if defined WIN32
+  return false;
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  // Where size_t is 32 bits, files over 4GB can't be mapped whole; they're
+  // read instead.
+  if (fstat(fd, &st) != 0 ||
+      !S_ISREG(st.st_mode) ||
+      st.st_size == 0 ||
+      (ogg_uint64_t)st.st_size > (ogg_uint64_t)(size_t)-1)
+  {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping holds its own reference to the file.
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  // We read the file front to back, once.
+  madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+  mData = (unsigned char*)data;
+  mLength = (ogg_int64_t)st.st_size;
+  return true;
+#endif
+}
+
+void MappedFile::Close() {
+#if !defined WIN32
+  if (mData) {
+    munmap(mData, (size_t)mLength);
+  }
+#endif
+  mData = 0;
+  mLength = 0;
+}
+
+PageScanner::PageScanner(const unsigned char* data, ogg_int64_t length)
+  : mData(data)
+  , mLength(length)
+  , mOffset(0)
+  , mPageOffset(0)
+  , mBytesSkipped(0)
+  , mVerifyChecksums(true)
+  , mThreads(1)
+  , mNextFound(0)
+{
+}
+
+void PageScanner::SetThreads(int threads) {
+#if defined HAVE_SCAN_THREADS
+  mThreads = max(1, threads);
+#endif
+}
+
+ogg_int64_t PageScanner::PageLengthAt(ogg_int64_t offset) const {
+  ogg_int64_t remaining = mLength - offset;
+  const unsigned char* p = mData + offset;
+  if (remaining < PAGE_HEADER_FIXED_LEN ||
+      memcmp(p, "OggS", 4) != 0 ||
+      p[4] != 0) {
+    return 0;
+  }
+  ogg_int64_t header_len = PAGE_HEADER_FIXED_LEN + p[PAGE_SEGMENTS_OFFSET];
+  if (remaining < header_len) {
+    return 0;
+  }
+  ogg_int64_t body_len = 0;
+  for (ogg_int64_t i=PAGE_HEADER_FIXED_LEN; i<header_len; i++) {
+    body_len += p[i];
+  }
+  if (remaining < header_len + body_len) {
+    return 0;
+  }
+  if (mVerifyChecksums &&
+      page_checksum(p, header_len, p + header_len, body_len) !=
+        LEUint32(p + PAGE_CHECKSUM_OFFSET)) {
+    return 0;
+  }
+  return header_len + body_len;
+}
+
+ogg_int64_t PageScanner::SkipLength(ogg_int64_t offset) const {
+  const void* next = memchr(mData + offset + 1, 'O',
+                            (size_t)(mLength - offset - 1));
+  return next ? (const unsigned char*)next - (mData + offset)
+              : mLength - offset;
+}
+
+bool PageScanner::NextPage(ogg_page* page) {
+  ogg_int64_t offset = 0;
+  ogg_int64_t length = 0;
+  if (mThreads > 1) {
+    if (mNextFound == mFound.size() && !ScanChunks()) {
+      return false;
+    }
+    offset = mFound[mNextFound].offset;
+    length = mFound[mNextFound].length;
+    mNextFound++;
+  } else {
+    while (mOffset < mLength && (length = PageLengthAt(mOffset)) == 0) {
+      // Not a page, skip to the next capture pattern.
+      ogg_int64_t skip = SkipLength(mOffset);
+      mBytesSkipped += skip;
+      mOffset += skip;
+    }
+    if (mOffset == mLength) {
+      return false;
+    }
+    offset = mOffset;
+    mOffset += length;
+  }
+  // ogg_page isn't const correct, but libogg only reads pages.
+  unsigned char* p = (unsigned char*)(mData + offset);
+  page->header = p;
+  page->header_len = PAGE_HEADER_FIXED_LEN + p[PAGE_SEGMENTS_OFFSET];
+  page->body = p + page->header_len;
+  page->body_len = (long)(length - page->header_len);
+  mPageOffset = offset;
+  return true;
+}
+
+ogg_int64_t PageScanner::ScanRange(ogg_int64_t offset,
+                                   ogg_int64_t end,
+                                   vector<FoundPage>* pages) const
+{
+  end = min(end, mLength);
+  while (offset < end) {
+    ogg_int64_t length = PageLengthAt(offset);
+    if (length == 0) {
+      offset += SkipLength(offset);
+      continue;
+    }
+    pages->push_back(FoundPage(offset, length));
+    offset += length;
+  }
+  return offset;
+}
+
+#if defined HAVE_SCAN_THREADS
+void* PageScanner::ScanChunkThread(void* arg) {
+  ScanChunk* chunk = static_cast<ScanChunk*>(arg);
+  chunk->stop = chunk->scanner->ScanRange(chunk->start, chunk->end,
+                                          &chunk->pages);
+  return 0;
+}
+#endif
+
+bool PageScanner::ScanChunks() {
+  mFound.clear();
+  mNextFound = 0;
+  while (mFound.empty() && mOffset < mLength) {
+    vector<ScanChunk> chunks(mThreads);
+    for (int i=0; i<mThreads; i++) {
+      chunks[i].scanner = this;
+      chunks[i].start = min(mOffset + i * (ogg_int64_t)SCAN_CHUNK_SIZE,
+                            mLength);
+      chunks[i].end = min(chunks[i].start + SCAN_CHUNK_SIZE, mLength);
+      chunks[i].stop = chunks[i].start;
+    }
+#if defined HAVE_SCAN_THREADS
+    // Scan the first chunk on this thread.
+    vector<pthread_t> threads(mThreads);
+    vector<bool> started(mThreads, false);
+    for (int i=1; i<mThreads; i++) {
+      started[i] = chunks[i].start < chunks[i].end &&
+        pthread_create(&threads[i], 0, ScanChunkThread, &chunks[i]) == 0;
+    }
+    ScanChunkThread(&chunks[0]);
+    for (int i=1; i<mThreads; i++) {
+      if (started[i]) {
+        pthread_join(threads[i], 0);
+      } else {
+        ScanChunkThread(&chunks[i]);
+      }
+    }
+#endif
+
+    // The first chunk started where the last scan stopped, so its pages are
+    // right. Each later chunk's thread started at an arbitrary offset, so
+    // its pages are right only from the page at which the previous chunk's
+    // scan stopped. If it didn't find that page, because it synchronised
+    // on a capture pattern inside a page, scan that chunk again from there.
+    ogg_int64_t stop = mOffset;
+    for (int i=0; i<mThreads; i++) {
+      ScanChunk& chunk = chunks[i];
+      if (stop >= chunk.end) {
+        // The previous chunk's last page covers this one.
+        continue;
+      }
+      vector<FoundPage>::iterator first =
+        lower_bound(chunk.pages.begin(), chunk.pages.end(), stop,
+                    FoundBefore);
+      if (stop == chunk.start ||
+          (first != chunk.pages.end() && first->offset == stop)) {
+        mFound.insert(mFound.end(), first, chunk.pages.end());
+        stop = chunk.stop;
+      } else {
+        stop = ScanRange(stop, chunk.end, &mFound);
+      }
+    }
+
+    // Count the bytes between pages as skipped, as a single thread would.
+    ogg_int64_t end = mOffset;
+    for (size_t i=0; i<mFound.size(); i++) {
+      mBytesSkipped += mFound[i].offset - end;
+      end = mFound[i].offset + mFound[i].length;
+    }
+    mBytesSkipped += stop - end;
+    mOffset = stop;
+  }
+  return !mFound.empty();
+}
@@ -0,0 +1,162 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * PageScanner.hpp - Zero-copy scanning of Ogg pages in memory mapped files.
+ */
+
+#ifndef __PAGE_SCANNER_HPP__
+#define __PAGE_SCANNER_HPP__
+
+#include <ogg/ogg.h>
+#include <vector>
+
+using namespace std;
+
+#if !defined WIN32
+#define HAVE_SCAN_THREADS
+#endif
+
+// Bytes of the buffer each scanning thread searches at a time, when
+// scanning with more than one thread.
+#define SCAN_CHUNK_SIZE (16 * 1024 * 1024)
+
+// A read only memory mapping of a whole file.
+class MappedFile {
+public:
+  MappedFile();
+  ~MappedFile();
+
+  // Maps the file. Returns false if it can't be opened or mapped, e.g. if
+  // it's a pipe, or we're on a platform without mmap.
+  bool Open(const char* filename);
+
+  void Close();
+
+  const unsigned char* Data() const { return mData; }
+  ogg_int64_t Length() const { return mLength; }
+
+private:
+  unsigned char* mData;
+  ogg_int64_t mLength;
+};
+
+// Finds the Ogg pages in a buffer, such as a MappedFile. Pages are handed
+// out as ogg_page views which point into the buffer, rather than being
+// copied through an ogg_sync_state. The views must not be written to, and
+// are valid only as long as the buffer is.
+class PageScanner {
+public:
+  PageScanner(const unsigned char* data, ogg_int64_t length);
+
+  // Finds the next page with a valid checksum, skipping any bytes which
+  // don't begin one, and stores views of its header and body in page.
+  // Returns false when there are no more pages.
+  bool NextPage(ogg_page* page);
+
+  // Sets whether NextPage() checks page checksums. Skipping the check is
+  // only safe on trusted input; a page with a corrupt length field will
+  // then be returned with the wrong length, rather than skipped.
+  void SetVerifyChecksums(bool verify) { mVerifyChecksums = verify; }
+
+  // Sets the number of threads which find pages. With more than one, the
+  // buffer is split into chunks of SCAN_CHUNK_SIZE which are searched at
+  // once, each thread resynchronising to the first page in its chunk, and
+  // the chunks' pages are then stitched together in order. NextPage()
+  // returns exactly the pages it would with one thread. Where we don't have
+  // threads, this has no effect.
+  void SetThreads(int threads);
+
+  // Offset of the page last returned by NextPage().
+  ogg_int64_t PageOffset() const { return mPageOffset; }
+
+  // Number of bytes skipped so far because they weren't part of a page.
+  ogg_int64_t BytesSkipped() const { return mBytesSkipped; }
+
+private:
+  struct FoundPage {
+    FoundPage(ogg_int64_t o, ogg_int64_t l) : offset(o), length(l) {}
+    ogg_int64_t offset;
+    ogg_int64_t length;
+  };
+
+  // A chunk of the buffer, and the pages a thread found in it.
+  struct ScanChunk {
+    const PageScanner* scanner;
+    ogg_int64_t start;
+    ogg_int64_t end;
+    // Where the scan stopped, at or after end.
+    ogg_int64_t stop;
+    vector<FoundPage> pages;
+  };
+
+  // Returns the length of the page at offset, or 0 if there's no valid page
+  // there.
+  ogg_int64_t PageLengthAt(ogg_int64_t offset) const;
+
+  // Returns the number of bytes from offset, which isn't the start of a
+  // page, to the next capture pattern.
+  ogg_int64_t SkipLength(ogg_int64_t offset) const;
+
+  // Finds the pages which start between offset and end, as NextPage()
+  // would starting at offset, and adds them to pages. Returns the offset
+  // NextPage() would continue from, at or after end.
+  ogg_int64_t ScanRange(ogg_int64_t offset,
+                        ogg_int64_t end,
+                        vector<FoundPage>* pages) const;
+
+  // Scans the next mThreads chunks at once into mFound. Returns false if
+  // there are no more pages.
+  bool ScanChunks();
+
+  static bool FoundBefore(const FoundPage& page, ogg_int64_t offset) {
+    return page.offset < offset;
+  }
+
+#if defined HAVE_SCAN_THREADS
+  static void* ScanChunkThread(void* chunk);
+#endif
+
+  const unsigned char* mData;
+  ogg_int64_t mLength;
+  ogg_int64_t mOffset;
+  ogg_int64_t mPageOffset;
+  ogg_int64_t mBytesSkipped;
+  bool mVerifyChecksums;
+  int mThreads;
+
+  // Pages found by the scanning threads, and the next to return.
+  vector<FoundPage> mFound;
+  size_t mNextFound;
+};
+
+#endif
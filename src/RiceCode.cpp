@@ -1,17 +1,171 @@
 #include <ogg/ogg.h>
 #include <vector>
-#include <cmath>
-#include <algorithm> //just for max()
+#include <string.h>
+#include <limits.h>
+#include <algorithm> //just for max() and min()
 #include <assert.h>
+#include "RiceCode.hpp"
+
+#if !defined WIN32
+#include <pthread.h>
+#define HAVE_RICE_THREADS
+#endif
 
 using namespace std;
 
 /* This file contains methods related to reading and writing Golomb-Rice codes*/
 
+BitWriter::BitWriter(unsigned char* p, ogg_int64_t num_bytes)
+  : mPos(p),
+    mEnd(p + num_bytes),
+    mWord(0),
+    mFill(0),
+    mBitsWritten(0)
+{
+}
+
+void BitWriter::StoreWord() {
+  assert(mEnd - mPos >= 8);
+  for (int i=7; i>=0; i--) {
+    *mPos++ = (unsigned char)(mWord >> (8*i));
+  }
+  mWord = 0;
+  mFill = 0;
+}
+
+void BitWriter::WriteBits(ogg_uint64_t value, unsigned n) {
+  assert(n <= 64);
+  if (n == 0) {
+    return;
+  }
+  if (n < 64) {
+    value &= (((ogg_uint64_t)1) << n) - 1;
+  }
+  mBitsWritten += n;
+  unsigned space = 64 - mFill;
+  if (n < space) {
+    mWord |= value << (space - n);
+    mFill += n;
+    return;
+  }
+  // Fill the current word, store it, and start the next with the rest.
+  unsigned rest = n - space;
+  mWord |= value >> rest;
+  StoreWord();
+  if (rest > 0) {
+    mWord = value << (64 - rest);
+    mFill = rest;
+  }
+}
+
+void BitWriter::WriteOnes(ogg_int64_t n) {
+  while (n >= 64) {
+    WriteBits(~(ogg_uint64_t)0, 64);
+    n -= 64;
+  }
+  WriteBits(~(ogg_uint64_t)0, (unsigned)n);
+}
+
+void BitWriter::Flush() {
+  int i = 7;
+  while (mFill > 0) {
+    assert(mPos < mEnd);
+    *mPos++ = (unsigned char)(mWord >> (8*i));
+    mFill = mFill > 8 ? mFill - 8 : 0;
+    i--;
+  }
+  mWord = 0;
+}
+
+unsigned char BitWriter::FlushWholeBytes() {
+  int i = 7;
+  while (mFill >= 8) {
+    assert(mPos < mEnd);
+    *mPos++ = (unsigned char)(mWord >> (8*i));
+    mFill -= 8;
+    i--;
+  }
+  unsigned char partial = (unsigned char)(mWord >> (8*i));
+  mWord = 0;
+  mFill = 0;
+  return partial;
+}
+
+BitReader::BitReader(const unsigned char* p, ogg_int64_t num_bytes)
+  : mStart(p),
+    mPos(p),
+    mEnd(p + num_bytes),
+    mWord(0),
+    mAvail(0),
+    mOverrun(false)
+{
+}
+
+static inline ogg_uint64_t
+LoadBEUint64(const unsigned char* p) {
+  return ((ogg_uint64_t)p[0] << 56) | ((ogg_uint64_t)p[1] << 48) |
+         ((ogg_uint64_t)p[2] << 40) | ((ogg_uint64_t)p[3] << 32) |
+         ((ogg_uint64_t)p[4] << 24) | ((ogg_uint64_t)p[5] << 16) |
+         ((ogg_uint64_t)p[6] << 8)  |  (ogg_uint64_t)p[7];
+}
+
+// Tops up mWord until it holds at least 57 bits, or we run out of data.
+// Away from the end of the buffer we load a whole word at once. Bits of a
+// partially consumed byte may then sit beyond mAvail, but they are the
+// real stream bits, so OR-ing the same byte in again on the next refill
+// is harmless.
+void BitReader::Refill() {
+  if (mEnd - mPos >= 8) {
+    unsigned bytes = (63 - mAvail) >> 3;
+    mWord |= LoadBEUint64(mPos) >> mAvail;
+    mPos += bytes;
+    mAvail += bytes * 8;
+    return;
+  }
+  while (mAvail <= 56 && mPos < mEnd) {
+    mWord |= ((ogg_uint64_t)*mPos++) << (56 - mAvail);
+    mAvail += 8;
+  }
+}
+
+unsigned BitReader::ReadBit() {
+  if (mAvail == 0) {
+    Refill();
+    if (mAvail == 0) {
+      mOverrun = true;
+      return 0;
+    }
+  }
+  unsigned bit = (unsigned)(mWord >> 63);
+  mWord <<= 1;
+  mAvail--;
+  return bit;
+}
+
+ogg_uint64_t BitReader::ReadBits(unsigned n) {
+  assert(n <= 64);
+  ogg_uint64_t value = 0;
+  while (n > 0) {
+    if (mAvail < n) {
+      Refill();
+    }
+    if (mAvail == 0) {
+      // Out of data, pad with zeros.
+      mOverrun = true;
+      return n < 64 ? value << n : 0;
+    }
+    unsigned k = min(n, mAvail);
+    value = (k < 64 ? value << k : 0) | (mWord >> (64 - k));
+    mWord = k < 64 ? mWord << k : 0;
+    mAvail -= k;
+    n -= k;
+  }
+  return value;
+}
+
 ogg_int64_t rice_bits_required(ogg_int64_t value,
                                       unsigned char rice_param) {
-  ogg_int64_t cutoff=1<<rice_param, bits=1+rice_param;
-  return bits + value/cutoff;
+  return 1 + rice_param + (value >> rice_param);
 }
 
 // Returns the number of bytes needed to store n bits.
@@ -28,123 +182,189 @@ ogg_int64_t rice_total_bits(vector<ogg_int64_t>* values,
   return total;
 }
 
-// This algorithm comes from
-// "Selecting the Golomb Parameter in Rice Coding"
-// http://ipnpr.jpl.nasa.gov/progress_report/42-159/159E.pdf
-unsigned char optimal_rice_parameter(vector<ogg_int64_t>* values) {
-  ogg_int64_t total=0, cost, bestcost, i;
-  float mean;
-  unsigned char lower_bound, upper_bound, optimal, j;
-  for(i=0; i < values->size(); i++) {
-    total += values->at(i);
-  }
-  mean = ((float)total)/values->size();
-  lower_bound = max(0, (int)floor(log((2.0/3)*(mean+1))/log(2.0)));
-  upper_bound = max(0, (int)ceil(log(mean)/log(2.0)));
-  if (upper_bound > lower_bound) {
-    // There is a mathematical guarantee that upper_bound-lower_bound <= 2,
-    // but floating point error may break this so the code is fully general.
-    bestcost = rice_total_bits(values, upper_bound);
-    optimal = upper_bound;
-    for(j=lower_bound; j<upper_bound; j++){
-      cost = rice_total_bits(values,j);
-      if (cost < bestcost){
-        bestcost = cost;
-        optimal = j;
+// Returns the Rice parameter which codes values in the fewest bits, and
+// optionally stores that number of bits in total_bits. The cost of every
+// parameter is computed exactly from a single pass over the values: we count
+// how many values have each bit set, and since
+//   sum(v >> k) = sum over b >= k of count[b] * 2^(b-k),
+// the cost of parameter k is n*(k+1) plus that sum. Costs which overflow
+// saturate at LLONG_MAX; they can never be the optimum.
+unsigned char optimal_rice_parameter(vector<ogg_int64_t>* values,
+                                     ogg_int64_t* total_bits) {
+  ogg_int64_t bit_counts[MAX_RICE_PARAM+1];
+  memset(bit_counts, 0, sizeof(bit_counts));
+  ogg_int64_t n = values->size();
+  for (ogg_int64_t i=0; i<n; i++) {
+    ogg_uint64_t v = (ogg_uint64_t)(*values)[i];
+    assert((*values)[i] >= 0);
+    for (unsigned b=0; v != 0; b++, v >>= 1) {
+      bit_counts[b] += v & 1;
+    }
+  }
+
+  unsigned char optimal = 0;
+  ogg_int64_t bestcost = LLONG_MAX;
+  for (unsigned k=0; k<=MAX_RICE_PARAM; k++) {
+    ogg_int64_t cost = n * (k+1);
+    for (unsigned b=k; b<=MAX_RICE_PARAM && cost != LLONG_MAX; b++) {
+      unsigned shift = b - k;
+      ogg_int64_t c = bit_counts[b];
+      if (c == 0) {
+        continue;
+      }
+      if (c > (LLONG_MAX >> shift) ||
+          (c << shift) > LLONG_MAX - cost) {
+        cost = LLONG_MAX;
+      } else {
+        cost += c << shift;
       }
     }
-    return optimal;
-  } else {
-    //upper_bound == lower_bound, unless there's been some error due to
-    //floating point imprecision.
-    return upper_bound;
+    if (cost < bestcost) {
+      bestcost = cost;
+      optimal = (unsigned char)k;
+    }
+  }
+  if (total_bits) {
+    *total_bits = n == 0 ? 0 : bestcost;
   }
+  return optimal;
 }
 
 // This function encodes value according to rice_param and appends the
-// result to bitstore. 
-void rice_write_one(vector<char>* bitstore,
+// result to writer.
+void rice_write_one(BitWriter* writer,
                             ogg_int64_t value, unsigned char rice_param) {
-  ogg_int64_t cutoff=1<<rice_param;
-  while (value >= cutoff) {
-    bitstore->push_back(true);
-    value -= cutoff;
-  }
-  bitstore->push_back(false);
-  while (rice_param > 0) {
-    rice_param--;
-    bitstore->push_back((bool)(value&(1<<rice_param)));
-  }
+  writer->WriteOnes(value >> rice_param);
+  writer->WriteBits(0, 1);
+  writer->WriteBits((ogg_uint64_t)value, rice_param);
 }
 
-// Read one value from the rice-coded stream. Return the value, and
-// leave the iterator pointing to the first bit of the next value.
-ogg_int64_t rice_read_one(vector<char>::iterator& it,
-                                  unsigned char rice_param) {
-  ogg_int64_t output=0;
-  ogg_int64_t cutoff = 1<<rice_param;
-  while(*it){
-    output += cutoff;
-    ++it;
-  }
-  while (rice_param > 0){
-    rice_param--;
-    ++it;
-    output += (*it)<<rice_param;
-  }
-  ++it; //leave the iterator pointing to the first bit of the next value
-  return output;
-}
-
-// Read 8*n bits out of p and write them into the elements of bits
-void expand_bytes(vector<char>* bits, 
-                               unsigned char* p, ogg_int64_t n) {
-  for(int i=0;i<n;i++){
-    for(int j=7;j>=0;j--){
-      bits->push_back(((*(p+i))&(1<<j))!=0);
-    }
-  }
-}
-
-// Write 8 bits into each char of p.  p must have enough space
-// allocated to fit all of bits.  Unused bits in the final byte will
-// be set to zero.
-void squeeze_bits(unsigned char* p, vector<char> bits) {
-  ogg_int64_t i, j, n=bits.size()/8, L=bits.size();
-  for(i=0;i<=n;i++) {
-    *(p+i) = 0;
-    for(j=7;j>=0;j--) {
-      ogg_int64_t q = 8*i+(7-j);
-      if (q<L){
-        *(p+i) |= bits[q]<<j;
+// Codes with Rice parameters below this are looked up in a table when the
+// whole code fits in the next RICE_TABLE_BITS bits.
+#define RICE_TABLE_PARAMS 8
+#define RICE_TABLE_BITS 8
+
+struct RiceTableEntry {
+  // Length of the code in bits, or 0 if the code doesn't fit in the table.
+  unsigned char length;
+  unsigned char value;
+};
+
+class RiceTable {
+public:
+  RiceTableEntry mEntries[RICE_TABLE_PARAMS][1 << RICE_TABLE_BITS];
+
+  RiceTable() {
+    for (unsigned param=0; param<RICE_TABLE_PARAMS; param++) {
+      for (unsigned bits=0; bits<(1 << RICE_TABLE_BITS); bits++) {
+        unsigned quotient = 0, pos = RICE_TABLE_BITS;
+        while (pos > 0 && (bits & (1 << (pos-1)))) {
+          quotient++;
+          pos--;
+        }
+        RiceTableEntry& e = mEntries[param][bits];
+        if (pos < param + 1) {
+          // The terminating zero or the remainder falls off the end.
+          e.length = 0;
+          e.value = 0;
+          continue;
+        }
+        pos -= param + 1;
+        e.length = (unsigned char)(RICE_TABLE_BITS - pos);
+        e.value = (unsigned char)((quotient << param) |
+                                  ((bits >> pos) & ((1 << param) - 1)));
       }
     }
   }
+};
+
+// Built during static initialization, so it's read-only by the time
+// anyone decodes.
+static const RiceTable sRiceTable;
+
+// Read one value from the rice-coded stream, leaving the reader positioned
+// at the first bit of the next value.
+ogg_int64_t rice_read_one(BitReader& reader,
+                                  unsigned char rice_param) {
+  ogg_uint64_t word = reader.PeekWord();
+  unsigned avail = reader.Available();
+
+  if (rice_param < RICE_TABLE_PARAMS && avail >= RICE_TABLE_BITS) {
+    const RiceTableEntry& e =
+      sRiceTable.mEntries[rice_param][word >> (64 - RICE_TABLE_BITS)];
+    if (e.length) {
+      reader.Skip(e.length);
+      return e.value;
+    }
+  }
+
+  // Count the unary run of ones. Usually this is a single count on the
+  // buffered word, but long runs may span several refills.
+  ogg_int64_t quotient = 0;
+  while (true) {
+    unsigned ones = (~word) ? count_leading_zeros(~word) : 64;
+    if (ones < avail) {
+      quotient += ones;
+      reader.Skip(ones + 1);
+      break;
+    }
+    quotient += avail;
+    reader.Skip(avail);
+    word = reader.PeekWord();
+    avail = reader.Available();
+    if (avail == 0) {
+      reader.SetOverrun();
+      return quotient << rice_param;
+    }
+  }
+
+  ogg_uint64_t remainder;
+  if (rice_param == 0) {
+    remainder = 0;
+  } else if (rice_param <= reader.Available()) {
+    remainder = reader.PeekWord() >> (64 - rice_param);
+    reader.Skip(rice_param);
+  } else {
+    remainder = reader.ReadBits(rice_param);
+  }
+  return (quotient << rice_param) + (ogg_int64_t)remainder;
+}
+
+// Reference decoder, reads one bit at a time.
+ogg_int64_t rice_read_one_reference(BitReader& reader,
+                                    unsigned char rice_param) {
+  ogg_int64_t quotient = 0;
+  while (reader.ReadBit()) {
+    quotient++;
+  }
+  return (quotient << rice_param) + (ogg_int64_t)reader.ReadBits(rice_param);
 }
 
 // Given two interleaved rice-coded streams stored packed
 // in num_bytes starting at p, this function decodes both, storing values
-// into first and second.
-void rice_read_alternate(vector<ogg_int64_t>* first,
+// into first and second. Returns false if the streams run past the end of
+// the buffer.
+bool rice_read_alternate(vector<ogg_int64_t>* first,
                          vector<ogg_int64_t>* second,
                          unsigned char* p,
                          ogg_int64_t num_bytes,
                          ogg_int64_t num_pairs,
                          unsigned char rice_first,
                          unsigned char rice_second) {
-  vector<char> bits;
-  expand_bytes(&bits, p, num_bytes);
+  BitReader reader(p, num_bytes);
   ogg_int64_t i=0;
-  vector<char>::iterator it = bits.begin();
-  while (i < num_pairs) {
-    first->push_back(rice_read_one(it, rice_first));
-    second->push_back(rice_read_one(it, rice_second));
+  first->reserve(first->size() + num_pairs);
+  second->reserve(second->size() + num_pairs);
+  while (i < num_pairs && !reader.Overrun()) {
+    first->push_back(rice_read_one(reader, rice_first));
+    second->push_back(rice_read_one(reader, rice_second));
     ++i;
   }
+  return !reader.Overrun();
 }
 
 // Packs two streams of values into an interleaved Rice-coded block of bits
-void rice_encode_alternate(vector<char>* bits,
+void rice_encode_alternate(BitWriter* writer,
                            vector<ogg_int64_t>* first,
                            vector<ogg_int64_t>* second,
                            unsigned char rice_first,
@@ -152,7 +372,261 @@ void rice_encode_alternate(vector<char>* bits,
   ogg_int64_t i;
   assert(first->size() == second->size());
   for(i = 0; i < first->size(); i++) {
-    rice_write_one(bits, first->at(i), rice_first);
-    rice_write_one(bits, second->at(i), rice_second);
+    rice_write_one(writer, first->at(i), rice_first);
+    rice_write_one(writer, second->at(i), rice_second);
+  }
+}
+
+// A run of whole chunks of pairs which one thread codes or decodes.
+struct RiceRange {
+  vector<ogg_int64_t>* first;
+  vector<ogg_int64_t>* second;
+  unsigned char rice_first;
+  unsigned char rice_second;
+
+  // The range's pairs are [start,end), and are stored from index base in
+  // first and second.
+  ogg_int64_t start;
+  ogg_int64_t end;
+  ogg_int64_t base;
+
+  unsigned char* p;
+  ogg_int64_t num_bytes;
+
+  // Offset in p of the range's first bit.
+  ogg_int64_t bit_offset;
+
+  // When coding, the number of bits the range takes. When decoding, the
+  // offset the range must end at, or -1 for the last range.
+  ogg_int64_t bits;
+
+  ogg_int64_t chunk_pairs;
+
+  // When coding, where to store the offset of each chunk. When decoding,
+  // where each chunk should start.
+  vector<ogg_int64_t>* chunk_bits;
+  const vector<ogg_int64_t>* hints;
+
+  // Bits of the range's final partial byte, which the next range's thread
+  // may be writing.
+  unsigned char tail;
+
+  bool ok;
+};
+
+// Splits num_pairs pairs into at most threads ranges of whole chunks.
+static void
+rice_split_ranges(vector<RiceRange>* ranges,
+                  ogg_int64_t num_pairs,
+                  ogg_int64_t chunk_pairs,
+                  int threads)
+{
+  ogg_int64_t chunks = (num_pairs + chunk_pairs - 1) / chunk_pairs;
+  ogg_int64_t count = num_pairs < 2 * RICE_CHUNK_PAIRS ? 1 :
+                      max((ogg_int64_t)1, min((ogg_int64_t)threads, chunks));
+  RiceRange range;
+  memset(&range, 0, sizeof(RiceRange));
+  range.chunk_pairs = chunk_pairs;
+  for (ogg_int64_t t=0; t<count; t++) {
+    range.start = min(num_pairs, (t * chunks / count) * chunk_pairs);
+    range.end = min(num_pairs, ((t + 1) * chunks / count) * chunk_pairs);
+    ranges->push_back(range);
+  }
+}
+
+// Calls fn on every range, each on its own thread apart from the first,
+// which this thread handles, as it does any range a thread can't be
+// started for.
+static void
+rice_run_ranges(vector<RiceRange>& ranges, void* (*fn)(void*))
+{
+#if defined HAVE_RICE_THREADS
+  vector<pthread_t> threads(ranges.size());
+  vector<bool> started(ranges.size(), false);
+  for (size_t i=1; i<ranges.size(); i++) {
+    started[i] = pthread_create(&threads[i], 0, fn, &ranges[i]) == 0;
+  }
+  for (size_t i=0; i<ranges.size(); i++) {
+    if (!started[i]) {
+      fn(&ranges[i]);
+    }
+  }
+  for (size_t i=1; i<ranges.size(); i++) {
+    if (started[i]) {
+      pthread_join(threads[i], 0);
+    }
+  }
+#else
+  for (size_t i=0; i<ranges.size(); i++) {
+    fn(&ranges[i]);
+  }
+#endif
+}
+
+static void*
+rice_count_range(void* arg) {
+  RiceRange* r = (RiceRange*)arg;
+  ogg_int64_t bits = 0;
+  for (ogg_int64_t i=r->start; i<r->end; i++) {
+    bits += rice_bits_required((*r->first)[i], r->rice_first) +
+            rice_bits_required((*r->second)[i], r->rice_second);
+  }
+  r->bits = bits;
+  return 0;
+}
+
+// Codes a range from its first bit. The first byte's bits before that are
+// written as zeros, as they're ORed in from the previous range's tail once
+// every range is coded.
+static void*
+rice_code_range(void* arg) {
+  RiceRange* r = (RiceRange*)arg;
+  unsigned lead = (unsigned)(r->bit_offset % 8);
+  BitWriter writer(r->p + r->bit_offset / 8,
+                   r->num_bytes - r->bit_offset / 8);
+  writer.WriteBits(0, lead);
+  for (ogg_int64_t i=r->start; i<r->end; i++) {
+    if (r->chunk_bits && i % r->chunk_pairs == 0) {
+      (*r->chunk_bits)[i / r->chunk_pairs] =
+        r->bit_offset + writer.BitsWritten() - lead;
+    }
+    rice_write_one(&writer, (*r->first)[i], r->rice_first);
+    rice_write_one(&writer, (*r->second)[i], r->rice_second);
+  }
+  assert(writer.BitsWritten() == lead + r->bits);
+  r->tail = writer.FlushWholeBytes();
+  return 0;
+}
+
+ogg_int64_t rice_encode_alternate_parallel(unsigned char* p,
+                                           ogg_int64_t num_bytes,
+                                           vector<ogg_int64_t>* first,
+                                           vector<ogg_int64_t>* second,
+                                           unsigned char rice_first,
+                                           unsigned char rice_second,
+                                           int threads,
+                                           ogg_int64_t chunk_pairs,
+                                           vector<ogg_int64_t>* chunk_bits) {
+  assert(first->size() == second->size());
+  assert(chunk_pairs > 0);
+  ogg_int64_t num_pairs = first->size();
+  if (chunk_bits) {
+    chunk_bits->assign((num_pairs + chunk_pairs - 1) / chunk_pairs, 0);
+  }
+  vector<RiceRange> ranges;
+  rice_split_ranges(&ranges, num_pairs, chunk_pairs, threads);
+  for (size_t i=0; i<ranges.size(); i++) {
+    ranges[i].first = first;
+    ranges[i].second = second;
+    ranges[i].rice_first = rice_first;
+    ranges[i].rice_second = rice_second;
+    ranges[i].p = p;
+    ranges[i].num_bytes = num_bytes;
+    ranges[i].chunk_bits = chunk_bits;
+  }
+  if (ranges.size() > 1) {
+    rice_run_ranges(ranges, rice_count_range);
+  } else {
+    rice_count_range(&ranges[0]);
+  }
+
+  // Each range starts where the ranges before it end. A byte which a range
+  // ends part way through is only written by the range which starts in it,
+  // if any, so zero them all before we start.
+  ogg_int64_t total = 0;
+  for (size_t i=0; i<ranges.size(); i++) {
+    ranges[i].bit_offset = total;
+    total += ranges[i].bits;
+    if (total % 8) {
+      assert(total / 8 < num_bytes);
+      p[total / 8] = 0;
+    }
+  }
+  assert(tobytes(total) <= num_bytes);
+
+  rice_run_ranges(ranges, rice_code_range);
+  for (size_t i=0; i<ranges.size(); i++) {
+    ogg_int64_t end = ranges[i].bit_offset + ranges[i].bits;
+    if (end % 8) {
+      p[end / 8] |= ranges[i].tail;
+    }
+  }
+  return total;
+}
+
+static void*
+rice_decode_range(void* arg) {
+  RiceRange* r = (RiceRange*)arg;
+  ogg_int64_t start_byte = r->bit_offset / 8;
+  BitReader reader(r->p + start_byte, r->num_bytes - start_byte);
+  reader.ReadBits((unsigned)(r->bit_offset % 8));
+  vector<ogg_int64_t>& first = *r->first;
+  vector<ogg_int64_t>& second = *r->second;
+  r->ok = true;
+  for (ogg_int64_t i=r->start; i<r->end && !reader.Overrun(); i++) {
+    if (i % r->chunk_pairs == 0 &&
+        start_byte * 8 + reader.BitsRead() != (*r->hints)[i / r->chunk_pairs])
+    {
+      r->ok = false;
+      return 0;
+    }
+    first[r->base + i] = rice_read_one(reader, r->rice_first);
+    second[r->base + i] = rice_read_one(reader, r->rice_second);
+  }
+  r->ok = !reader.Overrun() &&
+          (r->bits < 0 || start_byte * 8 + reader.BitsRead() == r->bits);
+  return 0;
+}
+
+bool rice_read_alternate_parallel(vector<ogg_int64_t>* first,
+                                  vector<ogg_int64_t>* second,
+                                  unsigned char* p,
+                                  ogg_int64_t num_bytes,
+                                  ogg_int64_t num_pairs,
+                                  unsigned char rice_first,
+                                  unsigned char rice_second,
+                                  const vector<ogg_int64_t>& hints,
+                                  ogg_int64_t chunk_pairs,
+                                  int threads) {
+  vector<RiceRange> ranges;
+  if (chunk_pairs > 0 &&
+      (ogg_int64_t)hints.size() == (num_pairs + chunk_pairs - 1) / chunk_pairs)
+  {
+    rice_split_ranges(&ranges, num_pairs, chunk_pairs, threads);
+  }
+  if (ranges.size() < 2) {
+    return rice_read_alternate(first, second, p, num_bytes, num_pairs,
+                               rice_first, rice_second);
+  }
+  for (size_t i=0; i<hints.size(); i++) {
+    if ((i ? hints[i] < hints[i-1] : hints[i] != 0) ||
+        hints[i] > num_bytes * 8) {
+      return false;
+    }
+  }
+
+  ogg_int64_t base = first->size();
+  first->resize(base + num_pairs);
+  second->resize(base + num_pairs);
+  for (size_t i=0; i<ranges.size(); i++) {
+    RiceRange& r = ranges[i];
+    r.first = first;
+    r.second = second;
+    r.rice_first = rice_first;
+    r.rice_second = rice_second;
+    r.base = base;
+    r.p = p;
+    r.num_bytes = num_bytes;
+    r.hints = &hints;
+    r.bit_offset = hints[r.start / chunk_pairs];
+    r.bits = i + 1 < ranges.size() ? hints[ranges[i+1].start / chunk_pairs]
+                                   : -1;
+  }
+  rice_run_ranges(ranges, rice_decode_range);
+  for (size_t i=0; i<ranges.size(); i++) {
+    if (!ranges[i].ok) {
+      return false;
+    }
   }
+  return true;
 }
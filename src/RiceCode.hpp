@@ -1,10 +1,118 @@
+#ifndef __RICE_CODE_HPP__
+#define __RICE_CODE_HPP__
+
 #include <ogg/ogg.h>
 #include <vector>
+#include <assert.h>
+#include "Utils.hpp"
 
 using namespace std;
 
 /* This file contains methods related to reading and writing Golomb-Rice codes*/
 
+// Largest Rice parameter which can code a non-negative ogg_int64_t.
+#define MAX_RICE_PARAM 63
+
+// Writes a stream of bits, most significant bit first, directly into a
+// caller-supplied byte buffer. Bits are accumulated in a 64-bit word and
+// stored a whole word at a time.
+class BitWriter {
+public:
+  BitWriter(unsigned char* p, ogg_int64_t num_bytes);
+
+  // Appends the n low-order bits of value, n <= 64.
+  void WriteBits(ogg_uint64_t value, unsigned n);
+
+  // Appends n one bits.
+  void WriteOnes(ogg_int64_t n);
+
+  // Stores any partially filled word. Unused bits in the final byte are
+  // set to zero.
+  void Flush();
+
+  // Stores the whole bytes of any partially filled word, but returns the
+  // bits of a final partial byte, left aligned, rather than storing them.
+  // There are BitsWritten() % 8 of them.
+  unsigned char FlushWholeBytes();
+
+  ogg_int64_t BitsWritten() const { return mBitsWritten; }
+
+private:
+  void StoreWord();
+
+  unsigned char* mPos;
+  unsigned char* mEnd;
+  ogg_uint64_t mWord;
+  unsigned mFill;
+  ogg_int64_t mBitsWritten;
+};
+
+// Reads a stream of bits, most significant bit first, directly out of a
+// byte buffer. Reading beyond the end of the buffer yields zero bits and
+// sets the overrun flag.
+class BitReader {
+public:
+  BitReader(const unsigned char* p, ogg_int64_t num_bytes);
+
+  unsigned ReadBit();
+
+  // Reads n bits, n <= 64, and returns them in the low-order bits.
+  ogg_uint64_t ReadBits(unsigned n);
+
+  // Returns true if we've read past the end of the buffer.
+  bool Overrun() const { return mOverrun; }
+
+  // Number of bits consumed since the start of the buffer.
+  ogg_int64_t BitsRead() const { return (mPos - mStart) * 8 - mAvail; }
+
+  // Returns the buffered unread bits, left aligned, after topping up the
+  // buffer. Only the first Available() bits are meaningful.
+  ogg_uint64_t PeekWord() {
+    if (mAvail <= 56) {
+      Refill();
+    }
+    return mWord;
+  }
+
+  unsigned Available() const { return mAvail; }
+
+  // Consumes n buffered bits, n <= Available().
+  void Skip(unsigned n) {
+    mWord = n < 64 ? mWord << n : 0;
+    mAvail -= n;
+  }
+
+  // Marks the reader as having run off the end of the buffer.
+  void SetOverrun() { mOverrun = true; }
+
+private:
+  void Refill();
+
+  const unsigned char* mStart;
+  const unsigned char* mPos;
+  const unsigned char* mEnd;
+  // Unread bits, left aligned.
+  ogg_uint64_t mWord;
+  unsigned mAvail;
+  bool mOverrun;
+};
+
+// Returns the number of leading zero bits in x, which must be non-zero.
+static inline unsigned
+count_leading_zeros(ogg_uint64_t x) {
+  assert(x != 0);
+#if defined(__GNUC__)
+  return (unsigned)__builtin_clzll(x);
+#else
+  unsigned n = 0;
+  while (!(x & ((ogg_uint64_t)1 << 63))) {
+    x <<= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
 ogg_int64_t rice_bits_required(ogg_int64_t value,
                                       unsigned char rice_param);
 
@@ -12,30 +120,75 @@ ogg_int64_t tobytes(ogg_int64_t n);
 
 ogg_int64_t rice_total_bits(vector<ogg_int64_t>* values,
                                     unsigned char rice_param);
-                                    
-unsigned char optimal_rice_parameter(vector<ogg_int64_t>* values);
 
-void rice_write_one(vector<char>* bitstore,
+// Returns the Rice parameter that codes values in the fewest bits. If
+// total_bits is non-null, the number of bits that takes is stored there.
+unsigned char optimal_rice_parameter(vector<ogg_int64_t>* values,
+                                     ogg_int64_t* total_bits = 0);
+
+void rice_write_one(BitWriter* writer,
                             ogg_int64_t value, unsigned char rice_param);
 
-ogg_int64_t rice_read_one(vector<char>::iterator it,
+// Decodes one value, finding the unary quotient with a count-leading-zeros
+// on the bit buffer, or a table lookup for short codes.
+ogg_int64_t rice_read_one(BitReader& reader,
                                   unsigned char rice_param);
 
-void expand_bytes(vector<char>* bits, 
-                               unsigned char* p, ogg_int64_t n);
-
-void squeeze_bits(unsigned char* p, vector<char> bits);
+// Decodes one value a bit at a time. Slow; kept as a reference for
+// rice_read_one().
+ogg_int64_t rice_read_one_reference(BitReader& reader,
+                                    unsigned char rice_param);
 
-void rice_read_alternate(vector<ogg_int64_t>* first,
+bool rice_read_alternate(vector<ogg_int64_t>* first,
                          vector<ogg_int64_t>* second,
                          unsigned char* p,
                          ogg_int64_t num_bytes,
                          ogg_int64_t num_pairs,
                          unsigned char rice_first,
                          unsigned char rice_second);
-                         
-void rice_encode_alternate(vector<char>* bits,
+
+void rice_encode_alternate(BitWriter* writer,
                            vector<ogg_int64_t>* first,
                            vector<ogg_int64_t>* second,
                            unsigned char rice_first,
                            unsigned char rice_second);
+
+// Pairs per chunk the parallel Rice coder splits its input into, unless
+// it's told otherwise. Fewer pairs than two chunks are coded on one thread.
+#define RICE_CHUNK_PAIRS (1 << 16)
+
+// Codes first and second exactly as rice_encode_alternate() does, into the
+// num_bytes at p, on up to threads threads. Every code's length is known
+// from rice_bits_required(), so each thread's first bit is found with a
+// prefix sum over the bits of the threads before it, and the threads then
+// code straight into the buffer. Unused bits of the final byte are zero.
+// Returns the number of bits written. If chunk_bits is non-null, stores the
+// bit offset of each chunk of chunk_pairs pairs, for
+// rice_read_alternate_parallel().
+ogg_int64_t rice_encode_alternate_parallel(unsigned char* p,
+                                           ogg_int64_t num_bytes,
+                                           vector<ogg_int64_t>* first,
+                                           vector<ogg_int64_t>* second,
+                                           unsigned char rice_first,
+                                           unsigned char rice_second,
+                                           int threads,
+                                           ogg_int64_t chunk_pairs = RICE_CHUNK_PAIRS,
+                                           vector<ogg_int64_t>* chunk_bits = 0);
+
+// Decodes num_pairs pairs as rice_read_alternate() does. If hints holds the
+// bit offset in p of every chunk of chunk_pairs pairs, the chunks are
+// decoded on up to threads threads; otherwise they're decoded on this
+// thread. Returns false if the codes run past the end of the buffer, or a
+// chunk doesn't end where the next one's hint says it starts.
+bool rice_read_alternate_parallel(vector<ogg_int64_t>* first,
+                                  vector<ogg_int64_t>* second,
+                                  unsigned char* p,
+                                  ogg_int64_t num_bytes,
+                                  ogg_int64_t num_pairs,
+                                  unsigned char rice_first,
+                                  unsigned char rice_second,
+                                  const vector<ogg_int64_t>& hints,
+                                  ogg_int64_t chunk_pairs,
+                                  int threads);
+
+#endif
@@ -0,0 +1,411 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * SeekQuery.cpp - Answers seek queries from Skeleton keyframe indexes.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <ogg/ogg.h>
+
+#include "SeekQuery.hpp"
+#include "SkeletonEncoder.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+SeekIndex::SeekIndex()
+  : mVersion(0)
+  , mFileLength(0)
+  , mContentOffset(0)
+{
+}
+
+SeekIndex::~SeekIndex() {
+  ClearSeekBlockIndex(mIndex);
+}
+
+bool SeekIndex::Track::IsActive(ogg_int64_t granule) const {
+  if (mLastGranulepos < 0) {
+    // Unknown end, assume the stream runs to the end of the segment.
+    return true;
+  }
+  ogg_int64_t mask = ((ogg_int64_t)1 << mGranuleShift) - 1;
+  ogg_int64_t last = (mLastGranulepos >> mGranuleShift) +
+                     (mLastGranulepos & mask);
+  return granule <= last;
+}
+
+bool SeekIndex::AddPacket(ogg_packet* packet) {
+  if (IsFisheadPacket(packet)) {
+    return AddFishead(packet);
+  }
+  if (IsFisbonePacket(packet)) {
+    return AddFisbone(packet);
+  }
+  if (IsIndexPacket(packet)) {
+    return AddIndex(packet);
+  }
+  return true;
+}
+
+bool SeekIndex::AddFishead(ogg_packet* packet) {
+  if (packet->bytes < SKELETON_VERSION_MINOR_OFFSET + 2) {
+    return false;
+  }
+  ogg_uint16_t major = LEUint16(packet->packet + SKELETON_VERSION_MAJOR_OFFSET);
+  ogg_uint16_t minor = LEUint16(packet->packet + SKELETON_VERSION_MINOR_OFFSET);
+  mVersion = SKELETON_VERSION(major, minor);
+  if (mVersion >= SKELETON_VERSION(SKELETON_VERSION_MAJOR, 0) &&
+      packet->bytes >= SKELETON_CONTENT_OFFSET + 8) {
+    mFileLength = LEInt64(packet->packet + SKELETON_FILE_LENGTH_OFFSET);
+    mContentOffset = LEInt64(packet->packet + SKELETON_CONTENT_OFFSET);
+  }
+  return true;
+}
+
+bool SeekIndex::AddFisbone(ogg_packet* packet) {
+  if (packet->bytes < FISBONE_GRAN_SHIFT_OFFSET + 1) {
+    return false;
+  }
+  ogg_uint32_t serialno = LEUint32(packet->packet + FISBONE_SERIALNO_OFFSET);
+  Track& track = mTracks[serialno];
+  track.mGranNumer = LEInt64(packet->packet + FISBONE_GRAN_NUMER_OFFSET);
+  track.mGranDenom = LEInt64(packet->packet + FISBONE_GRAN_DENOM_OFFSET);
+  track.mGranuleShift = Uint8(packet->packet + FISBONE_GRAN_SHIFT_OFFSET);
+  if (track.mGranuleShift > 62) {
+    return false;
+  }
+  return true;
+}
+
+bool SeekIndex::AddIndex(ogg_packet* packet) {
+  if (mVersion < SKELETON_VERSION(SKELETON_VERSION_MAJOR,
+                                  SKELETON_VERSION_MINOR) ||
+      mVersion > SKELETON_VERSION(SKELETON_VERSION_MAJOR,
+                                  SKELETON_VERSION_MINOR_CODEC)) {
+    return false;
+  }
+  // Replaces any earlier index for the stream.
+  if (!ReadIndex(mIndex, packet, mVersion)) {
+    return false;
+  }
+  ogg_uint32_t serialno = LEUint32(packet->packet + INDEX_SERIALNO_OFFSET);
+  mTracks[serialno].mLastGranulepos =
+    mIndex[serialno]->GetHeader().last_granpos;
+  return true;
+}
+
+bool SeekIndex::ReadHeaders(const unsigned char* data, ogg_int64_t length) {
+  ogg_sync_state sync;
+  ogg_sync_init(&sync);
+  char* buffer = ogg_sync_buffer(&sync, (long)length);
+  memcpy(buffer, data, (size_t)length);
+  ogg_sync_wrote(&sync, (long)length);
+
+  ogg_stream_state stream;
+  memset(&stream, 0, sizeof(ogg_stream_state));
+  bool found_skeleton = false, got_eos = false;
+  ogg_uint32_t skeleton_serial = 0;
+  ogg_page page;
+  while (!got_eos && ogg_sync_pageout(&sync, &page) == 1) {
+    ogg_uint32_t serial = ogg_page_serialno(&page);
+    if (!found_skeleton) {
+      if (!ogg_page_bos(&page)) {
+        // Past the BOS pages without finding a Skeleton track.
+        break;
+      }
+      if (page.body_len < 8 ||
+          memcmp(page.body, "fishead", 8) != 0) {
+        continue;
+      }
+      found_skeleton = true;
+      skeleton_serial = serial;
+      ogg_stream_init(&stream, serial);
+    }
+    if (serial != skeleton_serial) {
+      continue;
+    }
+    ogg_stream_pagein(&stream, &page);
+    ogg_packet packet;
+    int ret;
+    while ((ret = ogg_stream_packetout(&stream, &packet)) != 0) {
+      if (ret == 1) {
+        AddPacket(&packet);
+        got_eos = got_eos || packet.e_o_s;
+      }
+    }
+  }
+  if (found_skeleton) {
+    ogg_stream_clear(&stream);
+  }
+  ogg_sync_clear(&sync);
+  return got_eos;
+}
+
+ogg_int64_t SeekIndex::Track::TimeToGranule(ogg_int64_t time_ms) const {
+  if (mGranNumer <= 0 || mGranDenom <= 0) {
+    return -1;
+  }
+  // Split off whole seconds, so that the multiplication by the granule rate
+  // doesn't overflow for long durations.
+  ogg_int64_t seconds = time_ms / 1000;
+  ogg_int64_t ms = time_ms % 1000;
+  return (seconds * mGranNumer) / mGranDenom +
+         (ms * mGranNumer) / (mGranDenom * 1000);
+}
+
+const SeekIndex::Track* SeekIndex::GetTrack(ogg_uint32_t serialno) const {
+  map<ogg_uint32_t, Track>::const_iterator itr = mTracks.find(serialno);
+  return itr == mTracks.end() ? 0 : &itr->second;
+}
+
+ogg_int64_t SeekIndex::Track::EndTime() const {
+  if (mLastGranulepos < 0 || mGranNumer <= 0 || mGranDenom <= 0) {
+    return -1;
+  }
+  ogg_int64_t mask = ((ogg_int64_t)1 << mGranuleShift) - 1;
+  ogg_int64_t last = (mLastGranulepos >> mGranuleShift) +
+                     (mLastGranulepos & mask);
+  // Split off whole multiples of the granule rate's numerator, as in
+  // TimeToGranule(), so that long durations don't overflow.
+  return (last / mGranNumer) * mGranDenom * 1000 +
+         ((last % mGranNumer) * mGranDenom * 1000) / mGranNumer;
+}
+
+ogg_int64_t SeekIndex::GetDuration() const {
+  ogg_int64_t duration = -1;
+  SeekBlockIndex::const_iterator itr;
+  for (itr = mIndex.begin(); itr != mIndex.end(); itr++) {
+    const Track* track = GetTrack(itr->first);
+    if (track) {
+      duration = max(duration, track->EndTime());
+    }
+  }
+  return duration;
+}
+
+ogg_int64_t SeekIndex::TimeToGranule(ogg_uint32_t serialno,
+                                     ogg_int64_t time_ms) const
+{
+  const Track* track = GetTrack(serialno);
+  return track ? track->TimeToGranule(time_ms) : -1;
+}
+
+OffsetRange SeekIndex::KeypointRange(const SeekTable* table,
+                                     ogg_int64_t i) const
+{
+  if (i >= 0) {
+    return table->Range(i);
+  }
+  // Target precedes the stream's first keypoint, its data starts with the
+  // content.
+  OffsetRange r = { mContentOffset, table->Range(0).end };
+  return r;
+}
+
+bool SeekIndex::FindRange(const PackedIndex* index,
+                          ogg_int64_t granule,
+                          OffsetRange* range) const
+{
+  const IndexHeader& header = index->GetHeader();
+  if (header.num_blocks > 0) {
+    // Decode only the block holding the keypoint. A target before the
+    // first keypoint is read from the start of the content, up to where
+    // the first keypoint's range ends.
+    ogg_int64_t keypoint_granule;
+    if (!LookupIndexBlock(header, max(granule, header.init_granule),
+                          &keypoint_granule, range)) {
+      return false;
+    }
+    if (granule < header.init_granule) {
+      range->start = mContentOffset;
+    }
+    return true;
+  }
+  const SeekTable* table = index->GetTable();
+  if (!table || table->Empty()) {
+    return false;
+  }
+  *range = KeypointRange(table, table->Find(granule));
+  return true;
+}
+
+// Widens range to include r, or sets it to r if found is false.
+static void
+MergeRange(OffsetRange* range, const OffsetRange& r, bool found) {
+  if (!found) {
+    *range = r;
+    return;
+  }
+  range->start = min(range->start, r.start);
+  range->end = max(range->end, r.end);
+}
+
+bool SeekIndex::Seek(ogg_int64_t time_ms, OffsetRange* range) const {
+  // A stream which has ended before the target doesn't constrain the seek,
+  // unless every stream has ended, in which case we seek to their ends.
+  bool any_active = false;
+  SeekBlockIndex::const_iterator itr;
+  for (itr = mIndex.begin(); itr != mIndex.end(); itr++) {
+    const Track* track = GetTrack(itr->first);
+    if (track) {
+      ogg_int64_t granule = track->TimeToGranule(time_ms);
+      if (granule >= 0 && track->IsActive(granule)) {
+        any_active = true;
+        break;
+      }
+    }
+  }
+
+  bool found = false;
+  for (itr = mIndex.begin(); itr != mIndex.end(); itr++) {
+    const Track* track = GetTrack(itr->first);
+    if (!track) {
+      continue;
+    }
+    ogg_int64_t granule = track->TimeToGranule(time_ms);
+    if (granule < 0 || (any_active && !track->IsActive(granule))) {
+      continue;
+    }
+    OffsetRange r;
+    if (!FindRange(itr->second, granule, &r)) {
+      continue;
+    }
+    MergeRange(range, r, found);
+    found = true;
+  }
+  return found;
+}
+
+bool SeekIndex::SeekStream(ogg_uint32_t serialno,
+                           ogg_int64_t time_ms,
+                           OffsetRange* range) const
+{
+  SeekBlockIndex::const_iterator itr = mIndex.find(serialno);
+  const Track* track = GetTrack(serialno);
+  if (itr == mIndex.end() || !track) {
+    return false;
+  }
+  ogg_int64_t granule = track->TimeToGranule(time_ms);
+  if (granule < 0) {
+    return false;
+  }
+  return FindRange(itr->second, granule, range);
+}
+
+static bool
+CompareRangeStart(const OffsetRange& a, const OffsetRange& b) {
+  return a.start < b.start;
+}
+
+bool SeekIndex::SeekBatch(const vector<ogg_int64_t>& times_ms,
+                          vector<OffsetRange>* ranges,
+                          vector<OffsetRange>* fetches) const
+{
+  size_t n = times_ms.size();
+  for (size_t t=1; t<n; t++) {
+    if (times_ms[t] < times_ms[t-1]) {
+      return false;
+    }
+  }
+
+  // Find which targets have an active stream, as Seek() does.
+  vector<bool> any_active(n, false);
+  SeekBlockIndex::const_iterator itr;
+  for (itr = mIndex.begin(); itr != mIndex.end(); itr++) {
+    const Track* track = GetTrack(itr->first);
+    if (!track) {
+      continue;
+    }
+    for (size_t t=0; t<n; t++) {
+      ogg_int64_t granule = track->TimeToGranule(times_ms[t]);
+      if (granule >= 0 && track->IsActive(granule)) {
+        any_active[t] = true;
+      }
+    }
+  }
+
+  // The targets are sorted, so their granules are too, and each stream's
+  // keypoint for the next target is at or after the keypoint for this one.
+  // Streams are skipped for some targets and not others, so whether a
+  // target's range has been started is tracked per target.
+  vector<bool> found(n, false);
+  bool found_any = false;
+  OffsetRange none = { -1, -1 };
+  ranges->assign(n, none);
+  for (itr = mIndex.begin(); itr != mIndex.end(); itr++) {
+    const Track* track = GetTrack(itr->first);
+    if (!track || track->TimeToGranule(0) < 0) {
+      continue;
+    }
+    const SeekTable* table = itr->second->GetTable();
+    if (!table || table->Empty()) {
+      continue;
+    }
+    ogg_int64_t i = -1;
+    for (size_t t=0; t<n; t++) {
+      ogg_int64_t granule = track->TimeToGranule(times_ms[t]);
+      if (any_active[t] && !track->IsActive(granule)) {
+        continue;
+      }
+      while (i+1 < table->Size() && table->Granule(i+1) <= granule) {
+        i++;
+      }
+      MergeRange(&(*ranges)[t], KeypointRange(table, i), found[t]);
+      found[t] = true;
+    }
+    found_any = true;
+  }
+  if (!found_any) {
+    ranges->clear();
+    fetches->clear();
+    return false;
+  }
+
+  // Coalesce the ranges into the fewest requests.
+  vector<OffsetRange> sorted(*ranges);
+  sort(sorted.begin(), sorted.end(), CompareRangeStart);
+  fetches->clear();
+  for (size_t t=0; t<sorted.size(); t++) {
+    if (sorted[t].start < 0) {
+      continue;
+    }
+    if (!fetches->empty() && sorted[t].start <= fetches->back().end) {
+      fetches->back().end = max(fetches->back().end, sorted[t].end);
+    } else {
+      fetches->push_back(sorted[t]);
+    }
+  }
+  return true;
+}
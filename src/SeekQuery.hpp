@@ -0,0 +1,174 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * SeekQuery.hpp - Answers seek queries from Skeleton keyframe indexes.
+ */
+
+#ifndef __SEEK_QUERY_HPP__
+#define __SEEK_QUERY_HPP__
+
+#include <map>
+#include <vector>
+#include <ogg/ogg.h>
+#include "Decoder.hpp"
+
+using namespace std;
+
+// Answers "which bytes do I fetch to seek to time T" from the keyframe
+// indexes in an Ogg segment's Skeleton track, without reading the rest of
+// the segment. Doesn't use gOptions or write to stdout, so it can be linked
+// into other programs; build-seeklib.sh builds it as a static library.
+// Programs which link it also need pthreads, as very large indexes are
+// decoded on several threads.
+//
+// Once the Skeleton track has been read, the const methods may be called
+// from several threads at once on a shared SeekIndex; each index is decoded
+// by whichever seek needs it first. AddPacket() and ReadHeaders() must not
+// run at the same time as anything else. When built without pthreads, as
+// on Windows, a SeekIndex must only be used from one thread.
+class SeekIndex {
+public:
+  SeekIndex();
+  ~SeekIndex();
+
+  // Reads a packet from the Skeleton track: the fishead, a fisbone or an
+  // index packet. Other packets are ignored. Returns false if the packet is
+  // malformed, or its Skeleton version has no index we can read.
+  bool AddPacket(ogg_packet* packet);
+
+  // Reads the Skeleton track from the start of an Ogg segment held in
+  // memory. Pass at least the segment's header pages. Returns true once the
+  // Skeleton track's EOS packet has been read.
+  bool ReadHeaders(const unsigned char* data, ogg_int64_t length);
+
+  // Finds the range of bytes to read to seek to time_ms, following the
+  // index seek algorithm: for each active stream take the last keypoint at
+  // or before the target, and start from the one with the smallest offset.
+  // The range ends b_max bytes past the next keypoint in every stream, by
+  // when all streams must have reached the target. Block partitioned
+  // (Skeleton 4.1 and 4.2) indexes only have the block holding the keypoint
+  // decoded; other indexes are decoded whole on their first seek. Returns
+  // false if there are no indexes to seek with.
+  bool Seek(ogg_int64_t time_ms, OffsetRange* range) const;
+
+  // Finds the range of bytes to read to seek to time_ms in one stream,
+  // ignoring the others. Only that stream's index is decoded, or the block
+  // of it which holds the keypoint. Returns false if the stream has no index
+  // to seek with.
+  bool SeekStream(ogg_uint32_t serialno,
+                  ogg_int64_t time_ms,
+                  OffsetRange* range) const;
+
+  // Resolves a batch of seeks, e.g. for scrubbing or a thumbnail strip.
+  // times_ms must be in increasing order. Stores in ranges the range Seek()
+  // would give for each time, in the same order, and in fetches the fewest
+  // ranges which cover them all, in order, with overlapping and adjacent
+  // ranges coalesced. Each stream's keypoints are walked once for the whole
+  // batch, rather than searched once per time, so every stream's index is
+  // decoded whole, even if it's block partitioned. A time which Seek()
+  // would fail on gets the range { -1, -1 }, which adds nothing to fetches.
+  // Returns false if times_ms isn't sorted, or there are no indexes to seek
+  // with.
+  bool SeekBatch(const vector<ogg_int64_t>& times_ms,
+                 vector<OffsetRange>* ranges,
+                 vector<OffsetRange>* fetches) const;
+
+  // Returns the time in ms at which the last indexed stream ends, or -1 if
+  // no stream's end time is known.
+  ogg_int64_t GetDuration() const;
+
+  // Converts a time to a granule in the given stream, using the granule
+  // rate in its fisbone. Returns -1 if the stream has no fisbone.
+  ogg_int64_t TimeToGranule(ogg_uint32_t serialno, ogg_int64_t time_ms) const;
+
+  // Length of the segment and offset of its first content page, as given
+  // in the fishead, or 0 if unknown.
+  ogg_int64_t GetFileLength() const { return mFileLength; }
+  ogg_int64_t GetContentOffset() const { return mContentOffset; }
+
+  // The index of each indexed stream. Each stream's keypoints are decoded
+  // on the first seek which needs them, unless a seek can decode just one
+  // of its blocks.
+  const SeekBlockIndex& GetIndex() const { return mIndex; }
+
+private:
+  // What we know of each stream, from its fisbone and index packets.
+  struct Track {
+    Track()
+      : mGranNumer(0)
+      , mGranDenom(0)
+      , mGranuleShift(0)
+      , mLastGranulepos(-1)
+    {}
+    ogg_int64_t mGranNumer;
+    ogg_int64_t mGranDenom;
+    ogg_int32_t mGranuleShift;
+    ogg_int64_t mLastGranulepos;
+
+    // Returns true if the stream has data at or after granule.
+    bool IsActive(ogg_int64_t granule) const;
+
+    // Returns the time in ms at which the stream ends, or -1 if its end or
+    // its granule rate is unknown.
+    ogg_int64_t EndTime() const;
+
+    // Returns the granule at time_ms, or -1 if the granule rate is unknown.
+    ogg_int64_t TimeToGranule(ogg_int64_t time_ms) const;
+  };
+
+  // Returns the stream's track, or 0 if we've not seen its fisbone.
+  const Track* GetTrack(ogg_uint32_t serialno) const;
+
+  // Returns the range to read from a stream to reach its keypoint at index
+  // i, or from the start of the content if i is -1.
+  OffsetRange KeypointRange(const SeekTable* table, ogg_int64_t i) const;
+
+  // Finds the range to read from a stream to reach its last keypoint at or
+  // before granule. Returns false if the stream has no keypoints, or its
+  // index fails to decode.
+  bool FindRange(const PackedIndex* index,
+                 ogg_int64_t granule,
+                 OffsetRange* range) const;
+
+  bool AddFishead(ogg_packet* packet);
+  bool AddFisbone(ogg_packet* packet);
+  bool AddIndex(ogg_packet* packet);
+
+  ogg_uint32_t mVersion;
+  ogg_int64_t mFileLength;
+  ogg_int64_t mContentOffset;
+
+  map<ogg_uint32_t, Track> mTracks;
+  SeekBlockIndex mIndex;
+};
+
+#endif
@@ -0,0 +1,86 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * SeekTable.cpp - Flat sorted table of keypoints for seeking.
+ */
+
+#include <algorithm>
+#include "SeekTable.hpp"
+
+void SeekTable::Clear() {
+  mGranules.clear();
+  mStarts.clear();
+  mEnds.clear();
+}
+
+void SeekTable::Reserve(ogg_int64_t n) {
+  mGranules.reserve(n);
+  mStarts.reserve(n);
+  mEnds.reserve(n);
+}
+
+void SeekTable::Insert(ogg_int64_t granule, const OffsetRange& range) {
+  if (mGranules.empty() || granule > mGranules.back()) {
+    mGranules.push_back(granule);
+    mStarts.push_back(range.start);
+    mEnds.push_back(range.end);
+    return;
+  }
+  // Out of order, find where it belongs.
+  vector<ogg_int64_t>::iterator it =
+    lower_bound(mGranules.begin(), mGranules.end(), granule);
+  if (*it == granule) {
+    return;
+  }
+  ogg_int64_t i = it - mGranules.begin();
+  mGranules.insert(it, granule);
+  mStarts.insert(mStarts.begin() + i, range.start);
+  mEnds.insert(mEnds.begin() + i, range.end);
+}
+
+// Binary search whose loop has no data dependent branches; each step picks
+// the half to keep with a conditional move, so the search costs the same
+// whatever the granule, and doesn't stall on mispredicted branches.
+ogg_int64_t SeekTable::UpperBound(ogg_int64_t granule) const {
+  ogg_int64_t n = mGranules.size();
+  if (n == 0) {
+    return 0;
+  }
+  const ogg_int64_t* first = &mGranules[0];
+  const ogg_int64_t* base = first;
+  while (n > 1) {
+    ogg_int64_t half = n / 2;
+    base = (base[half] <= granule) ? base + half : base;
+    n -= half;
+  }
+  return (base - first) + (*base <= granule);
+}
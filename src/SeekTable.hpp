@@ -0,0 +1,98 @@
+/*
+   Copyright (C) 2009, Mozilla Foundation
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Mozilla Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * SeekTable.hpp - Flat sorted table of keypoints for seeking.
+ */
+
+#ifndef __SEEK_TABLE_HPP__
+#define __SEEK_TABLE_HPP__
+
+#include <vector>
+#include <ogg/ogg.h>
+
+using namespace std;
+
+struct OffsetRange {
+  // Offset of beginning of range in bytes.
+  ogg_int64_t start;
+
+  // Offset of end of range in bytes.
+  // Special value end==-1 indicates that the endpoint is not yet
+  // known.
+  ogg_int64_t end;
+};
+
+// A map from granules to byte ranges, sorted by granule. If a range is not
+// specified for a granule g, the range associated with g is the one mapped
+// to the next lower granule.
+//
+// The granules, range starts and range ends are stored in separate arrays,
+// so a search only touches the granules, and each keypoint costs 24 bytes
+// rather than a heap allocated tree node.
+class SeekTable {
+public:
+  ogg_int64_t Size() const { return mGranules.size(); }
+  bool Empty() const { return mGranules.empty(); }
+
+  void Clear();
+  void Reserve(ogg_int64_t n);
+
+  // Adds a keypoint. Keypoints are usually added in increasing granule
+  // order, which appends them. If the granule is already in the table, the
+  // table is left unchanged.
+  void Insert(ogg_int64_t granule, const OffsetRange& range);
+
+  ogg_int64_t Granule(ogg_int64_t i) const { return mGranules[i]; }
+
+  OffsetRange Range(ogg_int64_t i) const {
+    OffsetRange r = { mStarts[i], mEnds[i] };
+    return r;
+  }
+
+  // Returns the index of the first keypoint whose granule is greater than
+  // granule, or Size() if there's none.
+  ogg_int64_t UpperBound(ogg_int64_t granule) const;
+
+  // Returns the index of the last keypoint whose granule is no greater than
+  // granule, i.e. the keypoint whose range covers granule, or -1 if granule
+  // precedes every keypoint.
+  ogg_int64_t Find(ogg_int64_t granule) const {
+    return UpperBound(granule) - 1;
+  }
+
+private:
+  vector<ogg_int64_t> mGranules;
+  vector<ogg_int64_t> mStarts;
+  vector<ogg_int64_t> mEnds;
+};
+
+#endif
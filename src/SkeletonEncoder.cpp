@@ -45,6 +45,8 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
+#include <set>
+#include <sstream>
 #include "SkeletonEncoder.hpp"
 #include "Options.hpp"
 #include "Utils.hpp"
@@ -60,15 +62,6 @@ using namespace std;
 #define FISBONE_MAGIC_LEN (sizeof(FISBONE_MAGIC) / sizeof(FISBONE_MAGIC[0]))
 #define FISBONE_BASE_SIZE 56
 
-// FIXME: User should be able to control the granularity.  Granularity
-// should adapt to available size in one-pass mode.  Optimal granularity
-// settings are coupled, with similar error in both time and space.
-
-// Temporal quantization of 16 samples  FIXME: Should be in terms of time.
-#define GRANULE_ROUNDOFF (4)
-// Spatial granularity of 64 Kibibytes
-#define OFFSET_ROUNDOFF (16)
-
 static bool
 IsIndexable(Decoder* decoder) {
   return decoder->Type() == TYPE_VORBIS ||
@@ -108,7 +101,17 @@ SkeletonEncoder::SkeletonEncoder(DecoderMap& decoders,
     mPacketCount(0),
     mContentOffset(contentOffset),
     mGranuleRoundoff(GRANULE_ROUNDOFF),
-    mOffsetRoundoff(OFFSET_ROUNDOFF)
+    mOffsetRoundoff(OFFSET_ROUNDOFF),
+    mBlockSize(gOptions.GetIndexBlockSize()),
+    mBlockRiceParams(gOptions.GetBlockRiceParams()),
+    mIndexCodec(gOptions.GetIndexCodec()),
+    mContentAlignment(0),
+    mReservedPadding(gOptions.GetReservedPadding()),
+    mTrackLength(0),
+    mPaddingOwnPages(false),
+    mUnpaddedLength(0),
+    mInputContentOffset(contentOffset),
+    mNextTrack(0)
 {
   DecoderMap::iterator itr = decoders.begin();
   while (itr != decoders.end()) {
@@ -126,13 +129,39 @@ SkeletonEncoder::SkeletonEncoder(DecoderMap& decoders,
 }
 
 SkeletonEncoder::~SkeletonEncoder() {
+  ClearIndexPackets();
+}
+
+void
+SkeletonEncoder::ClearIndexPackets() {
   for (ogg_uint32_t i=0; i<mIndexPackets.size(); i++) {
     delete[] mIndexPackets[i]->packet;
     delete mIndexPackets[i];
   }
+  mIndexPackets.clear();
+  mPacketCount = 0;
   ClearIndexPages();
 }
 
+void
+SkeletonEncoder::SetTrackLength(ogg_int64_t length) {
+  mTrackLength = length;
+  if (length == 0) {
+    mGranuleRoundoff = GRANULE_ROUNDOFF;
+    mOffsetRoundoff = OFFSET_ROUNDOFF;
+  }
+}
+
+bool
+SkeletonEncoder::CoarsenIndex() {
+  if (mOffsetRoundoff >= MAX_ROUNDOFF && mGranuleRoundoff >= MAX_ROUNDOFF) {
+    return false;
+  }
+  mOffsetRoundoff = min(mOffsetRoundoff + 1, MAX_ROUNDOFF);
+  mGranuleRoundoff = min(mGranuleRoundoff + 1, MAX_ROUNDOFF);
+  return true;
+}
+
 void
 SkeletonEncoder::AddBosPacket()
 {
@@ -162,7 +191,7 @@ SkeletonEncoder::AddBosPacket()
   
   // Set the version fields.
   WriteLEUint16(bos->packet + SKELETON_VERSION_MAJOR_OFFSET, SKELETON_VERSION_MAJOR);
-  WriteLEUint16(bos->packet + SKELETON_VERSION_MINOR_OFFSET, SKELETON_VERSION_MINOR);
+  WriteLEUint16(bos->packet + SKELETON_VERSION_MINOR_OFFSET, GetVersionMinor());
   
   WriteLEUint64(bos->packet + SKELETON_CONTENT_OFFSET, mContentOffset);
 
@@ -174,12 +203,21 @@ SkeletonEncoder::AddBosPacket()
 
 bool
 SkeletonEncoder::Encode() {
+  // Start afresh, in case we're encoding again to fit a coarser index.
+  ClearIndexPackets();
+  mContentOffset = mInputContentOffset;
+  mPaddingOwnPages = false;
+
   AddBosPacket();
 
   AddFisbonePackets();
 
   // Construct and store the index packets.
   ConstructIndexPackets();
+
+  if (mContentAlignment > 0 || mReservedPadding > 0 || mTrackLength > 0) {
+    AddPaddingPacket(mReservedPadding);
+  }
   
   AddEosPacket();
   
@@ -188,6 +226,30 @@ SkeletonEncoder::Encode() {
   // file. Stores the result in mExtraLength.
   ConstructPages();
 
+  if (mTrackLength > 0) {
+    // The content's offset is already decided, so the track must take up
+    // exactly the space before it. Where the padding shares pages with
+    // other packets, the lacing values and page headers it adds as it grows
+    // leave gaps in the lengths it can reach. Moving it onto pages of its
+    // own moves those gaps, so try that before giving up.
+    if (!PadTrack(mTrackLength, 0, 0)) {
+      mPaddingOwnPages = true;
+      ConstructPages();
+      if (!PadTrack(mTrackLength, 0, 0)) {
+        mPaddingOwnPages = false;
+        SetPaddingLength(0);
+        ConstructPages();
+        mUnpaddedLength = GetTrackLength();
+        return false;
+      }
+    }
+  } else if (mContentAlignment > 0 &&
+             !PadTrack(mOldSkeletonLength, mContentAlignment, mReservedPadding))
+  {
+    cerr << "WARNING: Failed to pad the skeleton track to align the content "
+         << "to " << mContentAlignment << " byte blocks." << endl;
+  }
+
   // Adjust index packets' page offsets to account for extra file length.
   CorrectOffsets();
   
@@ -209,6 +271,83 @@ SkeletonEncoder::AddEosPacket() {
   mIndexPackets.push_back(eos);
 }
 
+void
+SkeletonEncoder::AddPaddingPacket(ogg_int64_t length) {
+  assert(length >= 0);
+  ogg_packet* padding = new ogg_packet();
+  memset(padding, 0, sizeof(ogg_packet));
+  padding->bytes = (long)(PADDING_MAGIC_LEN + length);
+  padding->packet = new unsigned char[padding->bytes];
+  memset(padding->packet, 0, padding->bytes);
+  memcpy(padding->packet, PADDING_MAGIC, PADDING_MAGIC_LEN);
+  padding->packetno = mPacketCount;
+  mPacketCount++;
+  mIndexPackets.push_back(padding);
+}
+
+ogg_packet*
+SkeletonEncoder::GetPaddingPacket() {
+  // The padding packet comes just before the EOS packet.
+  if (mIndexPackets.size() < 2) {
+    return 0;
+  }
+  ogg_packet* packet = mIndexPackets[mIndexPackets.size() - 2];
+  return IsPaddingPacket(packet) ? packet : 0;
+}
+
+void
+SkeletonEncoder::SetPaddingLength(ogg_int64_t length) {
+  ogg_packet* padding = GetPaddingPacket();
+  assert(padding);
+  assert(length >= 0);
+  delete[] padding->packet;
+  padding->bytes = (long)(PADDING_MAGIC_LEN + length);
+  padding->packet = new unsigned char[padding->bytes];
+  memset(padding->packet, 0, padding->bytes);
+  memcpy(padding->packet, PADDING_MAGIC, PADDING_MAGIC_LEN);
+}
+
+// Maximum number of padding lengths to try when padding the track.
+#define MAX_PADDING_ATTEMPTS 64
+
+bool
+SkeletonEncoder::PadTrack(ogg_int64_t length,
+                          ogg_int64_t modulus,
+                          ogg_int64_t min_padding)
+{
+  // Changing the padding by n bytes changes the track's length by n, plus
+  // a lacing byte every 255 bytes and a page header every page, so not
+  // every length can be reached. Aim for the nearest matching length, or
+  // the one after if we've already tried the padding that would take.
+  set<ogg_int64_t> tried;
+  for (int i=0; i<MAX_PADDING_ATTEMPTS; i++) {
+    ogg_int64_t padding = GetPaddingPacket()->bytes - PADDING_MAGIC_LEN;
+    tried.insert(padding);
+    ogg_int64_t excess = GetTrackLength() - length;
+    if (modulus > 0) {
+      excess %= modulus;
+      if (excess < 0) {
+        excess += modulus;
+      }
+    }
+    if (excess == 0) {
+      return true;
+    }
+    ogg_int64_t next = modulus > 0 && excess > modulus / 2
+                     ? padding + modulus - excess
+                     : padding - excess;
+    while (next < min_padding || tried.count(next)) {
+      if (modulus == 0) {
+        return false;
+      }
+      next += modulus;
+    }
+    SetPaddingLength(next);
+    ConstructPages();
+  }
+  return false;
+}
+
 const char* sStreamType[] = {
   "Unknown",
   "Vorbis",
@@ -219,84 +358,100 @@ const char* sStreamType[] = {
 };
 
 void
-SkeletonEncoder::ConstructIndexPackets() {
-  assert(mIndexPackets.size() > 0);
-  for (ogg_uint32_t i=0; i<mDecoders.size(); i++) {
-    ogg_packet* packet = new ogg_packet();
-    memset(packet, 0, sizeof(ogg_packet));
-    
-    Decoder* decoder = mDecoders[i];
-    const RangeMap& seekblocks = decoder->GetSeekBlocks();
-    
-    FisboneInfo info = decoder->GetFisboneInfo();
-    vector<ogg_int64_t> granules, offsets;
-    split_rangemap(&offsets, &granules, &seekblocks,
-                    decoder->GranuleposToGranule(decoder->GetLastGranulepos()));
-    vector<ogg_int64_t> granules_rounded, offsets_rounded;
-    round_together(&offsets_rounded, &granules_rounded, &offsets, &granules,
-                   mOffsetRoundoff, mGranuleRoundoff);
-    ogg_int64_t b_max;
-    b_max = measure_bmax(&offsets_rounded, &granules_rounded, &seekblocks);
-    ogg_int64_t init_offset, init_granule;
-    vector<ogg_int64_t> granule_diffs, offset_diffs;
-    differentiate(&offset_diffs, &init_offset, &offsets_rounded,
-                                                               mOffsetRoundoff);
-    differentiate(&granule_diffs, &init_granule, &granules_rounded,
-                                                              mGranuleRoundoff);
-    unsigned char offset_rice_param, granule_rice_param;
-    offset_rice_param = optimal_rice_parameter(&offset_diffs);
-    granule_rice_param = optimal_rice_parameter(&granule_diffs);
-    vector<char> bits;
-    rice_encode_alternate(&bits, &offset_diffs, &granule_diffs,
-                          offset_rice_param, granule_rice_param);
-    
-    const ogg_int32_t uncompressed_size = INDEX_SEEKPOINT_OFFSET +
-                                  (int)seekblocks.size() * 16;
-
-    ogg_int64_t compressed_size =
-      INDEX_SEEKPOINT_OFFSET + tobytes(bits.size());
-
-    double savings = ((double)compressed_size / (double)uncompressed_size) * 100.0;
-    cout << sStreamType[mDecoders[i]->Type()] << "/" << mDecoders[i]->GetSerial()
-         << " index uses " << uncompressed_size 
-         << " bytes, compresses to " << compressed_size << " (" << savings << "%),"
-         << " duration [" << decoder->GetStartTime() << "," << decoder->GetEndTime() << "] ms"
-         << endl;
-
-    packet->bytes = compressed_size;
-    unsigned char* p = new unsigned char[compressed_size];
-    memset(p, 0, compressed_size);
-    packet->packet = p;
-
-    // Identifier bytes.
-    memcpy(packet->packet, HEADER_MAGIC, HEADER_MAGIC_LEN);
-
-    // Stream serialno.
-    WriteLEUint32(packet->packet + INDEX_SERIALNO_OFFSET,
-                  mDecoders[i]->GetSerial());
-    
-    // Number of key points.
-    assert(offset_diffs.size() < UINT_MAX);
-    WriteLEUint64(packet->packet + INDEX_NUM_SEEKPOINTS_OFFSET,
-                  (ogg_uint64_t)offset_diffs.size());
-    
-    WriteLEInt64(packet->packet + INDEX_LAST_GRANPOS,
-                                                  decoder->GetLastGranulepos());
+ComputeIndexKeypoints(Decoder* decoder,
+                      unsigned char offset_roundoff,
+                      unsigned char granule_roundoff,
+                      IndexKeypoints* keypoints)
+{
+  const SeekTable& seekblocks = decoder->GetSeekBlocks();
+  vector<ogg_int64_t> granules, offsets;
+  split_rangemap(&offsets, &granules, &seekblocks,
+                  decoder->GranuleposToGranule(decoder->GetLastGranulepos()));
+  round_together(&keypoints->offsets, &keypoints->granules, &offsets, &granules,
+                 offset_roundoff, granule_roundoff);
+  keypoints->b_max = measure_bmax(&keypoints->offsets, &keypoints->granules,
+                                  &seekblocks);
+  differentiate(&keypoints->offset_diffs, &keypoints->init_offset,
+                &keypoints->offsets, offset_roundoff);
+  differentiate(&keypoints->granule_diffs, &keypoints->init_granule,
+                &keypoints->granules, granule_roundoff);
+}
 
-    WriteUint8(packet->packet + INDEX_GRANULE_ROUNDOFF, mGranuleRoundoff);
-    WriteUint8(packet->packet + INDEX_GRANULE_RICE_PARAM, granule_rice_param);
-    WriteUint8(packet->packet + INDEX_OFFSET_ROUNDOFF, mOffsetRoundoff);
-    WriteUint8(packet->packet + INDEX_OFFSET_RICE_PARAM, offset_rice_param);
+// Bytes allowed for each index keypoint when predicting a track's length.
+// Rice coded keypoints usually take under a byte each.
+#define PREDICTED_KEYPOINT_BYTES 2
 
-    WriteLEInt64(packet->packet + INDEX_MAX_EXCESS_BYTES, b_max);
+// Bytes allowed for each indexed stream's fisbone packet and index packet
+// header when predicting a track's length.
+#define PREDICTED_STREAM_BYTES 512
 
-    WriteLEInt64(packet->packet + INDEX_INIT_OFFSET, init_offset);
-    WriteLEInt64(packet->packet + INDEX_INIT_GRANULE, init_granule);
+// Length of an Ogg page header, without its lacing values.
+#define PAGE_HEADER_BYTES 27
 
-    p = packet->packet + INDEX_SEEKPOINT_OFFSET;
+ogg_int64_t
+PredictTrackLength(DecoderMap& decoders, ogg_int64_t fileLength)
+{
+  // Keypoints are rounded to OFFSET_ROUNDOFF bits of offset, and only one
+  // survives per rounded offset, plus one at each end of the stream.
+  ogg_int64_t keypoints = (fileLength >> OFFSET_ROUNDOFF) + 2;
+  ogg_int64_t indexBytes = keypoints * PREDICTED_KEYPOINT_BYTES;
+  ogg_int64_t blockSize = gOptions.GetIndexBlockSize();
+  if (blockSize) {
+    indexBytes += ((keypoints + blockSize - 1) / blockSize) *
+                  INDEX_BLOCK_PARAMS_ENTRY_SIZE;
+  }
 
-    squeeze_bits(p, bits);
-    
+  ogg_int64_t length = SKELETON_4_0_HEADER_LENGTH;
+  int streams = 0;
+  DecoderMap::iterator itr = decoders.begin();
+  while (itr != decoders.end()) {
+    if (IsIndexable(itr->second)) {
+      length += PREDICTED_STREAM_BYTES + indexBytes;
+      streams++;
+    }
+    itr++;
+  }
+
+  // Allow for a lacing value every 255 bytes, and a page header on the BOS
+  // page and on every 4KB page after it.
+  length += length / 255 + streams + 2;
+  length += (length / 4096 + 2) * PAGE_HEADER_BYTES;
+  return length;
+}
+
+void
+SkeletonEncoder::ConstructIndexPackets() {
+  assert(mIndexPackets.size() > 0);
+
+  // Each track's index is built independently of the others, so they're
+  // built on as many threads as we have processors, and appended in track
+  // order once they're all done. What each track reports is kept until
+  // then too, so that it's printed in the same order.
+  mTrackPackets.assign(mDecoders.size(), (ogg_packet*)0);
+  mTrackReports.assign(mDecoders.size(), string());
+  mNextTrack = 0;
+#if defined HAVE_INDEX_THREADS
+  int threads = min((int)mDecoders.size(), ProcessorCount());
+  vector<pthread_t> ids(threads);
+  vector<bool> started(threads, false);
+  for (int t=1; t<threads; t++) {
+    started[t] = pthread_create(&ids[t], 0, IndexThread, this) == 0;
+  }
+#endif
+  // This thread builds indexes too, so every track is built even if no
+  // other thread could be started.
+  ConstructTrackIndexes();
+#if defined HAVE_INDEX_THREADS
+  for (int t=1; t<threads; t++) {
+    if (started[t]) {
+      pthread_join(ids[t], 0);
+    }
+  }
+#endif
+
+  for (ogg_uint32_t i=0; i<mDecoders.size(); i++) {
+    cout << mTrackReports[i];
+    ogg_packet* packet = mTrackPackets[i];
     packet->packetno = mPacketCount;
     mPacketCount++;
 
@@ -304,13 +459,218 @@ SkeletonEncoder::ConstructIndexPackets() {
     assert(packet->b_o_s == 0);
     mIndexPackets.push_back(packet);
   }
+  mTrackPackets.clear();
+  mTrackReports.clear();
+}
+
+#if defined HAVE_INDEX_THREADS
+void*
+SkeletonEncoder::IndexThread(void* encoder)
+{
+  ((SkeletonEncoder*)encoder)->ConstructTrackIndexes();
+  return 0;
+}
+#endif
+
+void
+SkeletonEncoder::ConstructTrackIndexes() {
+  while (true) {
+#if defined HAVE_INDEX_THREADS
+    ogg_uint32_t i = __atomic_fetch_add(&mNextTrack, 1, __ATOMIC_RELAXED);
+#else
+    ogg_uint32_t i = mNextTrack++;
+#endif
+    if (i >= mDecoders.size()) {
+      break;
+    }
+    ostringstream report;
+    mTrackPackets[i] = ConstructIndexPacket(mDecoders[i], report);
+    mTrackReports[i] = report.str();
+  }
+}
+
+ogg_packet*
+SkeletonEncoder::ConstructIndexPacket(Decoder* decoder, ostream& report) {
+  ogg_packet* packet = new ogg_packet();
+  memset(packet, 0, sizeof(ogg_packet));
+
+  const SeekTable& seekblocks = decoder->GetSeekBlocks();
+  
+  IndexKeypoints keypoints;
+  ComputeIndexKeypoints(decoder, mOffsetRoundoff, mGranuleRoundoff,
+                        &keypoints);
+  vector<ogg_int64_t>& offsets_rounded = keypoints.offsets;
+  vector<ogg_int64_t>& granules_rounded = keypoints.granules;
+  vector<ogg_int64_t>& offset_diffs = keypoints.offset_diffs;
+  vector<ogg_int64_t>& granule_diffs = keypoints.granule_diffs;
+  unsigned char offset_rice_param, granule_rice_param;
+  ogg_int64_t offset_bits, granule_bits;
+  offset_rice_param = optimal_rice_parameter(&offset_diffs, &offset_bits);
+  granule_rice_param = optimal_rice_parameter(&granule_diffs, &granule_bits);
+  ogg_int64_t num_bits = offset_bits + granule_bits;
+  ogg_int64_t num_seekpoints = offset_diffs.size();
+
+  // Partitioned indexes have a table of blocks in front of the keypoints.
+  ogg_int64_t num_blocks = 0, header_size = INDEX_SEEKPOINT_OFFSET;
+  ogg_int64_t entry_size = mBlockRiceParams ? INDEX_BLOCK_PARAMS_ENTRY_SIZE
+                                            : INDEX_BLOCK_ENTRY_SIZE;
+  if (mBlockSize) {
+    num_blocks = (num_seekpoints + mBlockSize - 1) / mBlockSize;
+    header_size = INDEX_BLOCK_TABLE_OFFSET + num_blocks * entry_size;
+  }
+
+  // Choose each block's Rice parameters, if they're stored per block.
+  vector<unsigned char> block_offset_params, block_granule_params;
+  if (mBlockRiceParams) {
+    ogg_int64_t block_bits = 0;
+    for (ogg_int64_t b=0; b<num_blocks; b++) {
+      ogg_int64_t start = b * mBlockSize;
+      ogg_int64_t end = min(start + mBlockSize, num_seekpoints);
+      vector<ogg_int64_t> block_offsets(offset_diffs.begin() + start,
+                                        offset_diffs.begin() + end);
+      vector<ogg_int64_t> block_granules(granule_diffs.begin() + start,
+                                         granule_diffs.begin() + end);
+      ogg_int64_t bits;
+      block_offset_params.push_back(optimal_rice_parameter(&block_offsets, &bits));
+      block_bits += bits;
+      block_granule_params.push_back(optimal_rice_parameter(&block_granules, &bits));
+      block_bits += bits;
+    }
+    // Compare with a single parameter, both in a Skeleton 4.1 index with
+    // the same blocks, and in a plain Skeleton 4.0 index.
+    ogg_int64_t plain_size = INDEX_SEEKPOINT_OFFSET + tobytes(num_bits);
+    ogg_int64_t single_size = INDEX_BLOCK_TABLE_OFFSET +
+                              num_blocks * INDEX_BLOCK_ENTRY_SIZE +
+                              tobytes(num_bits);
+    ogg_int64_t block_size = header_size + tobytes(block_bits);
+    report << sStreamType[decoder->Type()] << "/" << decoder->GetSerial()
+         << " per-block Rice parameters save " << (plain_size - block_size)
+         << " bytes over a single parameter in a 4.0 index (" << block_size
+         << " vs " << plain_size << " bytes), and "
+         << (single_size - block_size) << " bytes over one in a 4.1 index"
+         << " with the same blocks (" << single_size << " bytes)" << endl;
+    num_bits = block_bits;
+  }
+
+  // Other coders' payloads follow a byte naming the coder.
+  vector<unsigned char> payload;
+  if (mIndexCodec != CODEC_RICE) {
+    IndexCodec* codec = IndexCodec::Create(mIndexCodec);
+    codec->Encode(&payload, &offset_diffs, &granule_diffs);
+    delete codec;
+    header_size = INDEX_CODEC_PAYLOAD_OFFSET;
+    num_bits = (ogg_int64_t)payload.size() * 8;
+  }
+  
+  const ogg_int64_t uncompressed_size = INDEX_SEEKPOINT_OFFSET +
+                                (ogg_int64_t)seekblocks.Size() * 16;
+
+  ogg_int64_t compressed_size = header_size + tobytes(num_bits);
+
+  double savings = ((double)compressed_size / (double)uncompressed_size) * 100.0;
+  report << sStreamType[decoder->Type()] << "/" << decoder->GetSerial()
+       << " index uses " << uncompressed_size 
+       << " bytes, compresses to " << compressed_size << " (" << savings << "%),"
+       << " duration [" << decoder->GetStartTime() << "," << decoder->GetEndTime() << "] ms"
+       << endl;
+
+  packet->bytes = compressed_size;
+  unsigned char* p = new unsigned char[compressed_size];
+  memset(p, 0, compressed_size);
+  packet->packet = p;
+
+  // Identifier bytes.
+  memcpy(packet->packet, HEADER_MAGIC, HEADER_MAGIC_LEN);
+
+  // Stream serialno.
+  WriteLEUint32(packet->packet + INDEX_SERIALNO_OFFSET,
+                decoder->GetSerial());
+  
+  // Number of key points.
+  WriteLEUint64(packet->packet + INDEX_NUM_SEEKPOINTS_OFFSET,
+                (ogg_uint64_t)offset_diffs.size());
+  
+  WriteLEInt64(packet->packet + INDEX_LAST_GRANPOS,
+                                                decoder->GetLastGranulepos());
+
+  WriteUint8(packet->packet + INDEX_GRANULE_ROUNDOFF, mGranuleRoundoff);
+  WriteUint8(packet->packet + INDEX_GRANULE_RICE_PARAM, granule_rice_param);
+  WriteUint8(packet->packet + INDEX_OFFSET_ROUNDOFF, mOffsetRoundoff);
+  WriteUint8(packet->packet + INDEX_OFFSET_RICE_PARAM, offset_rice_param);
+
+  WriteLEInt64(packet->packet + INDEX_MAX_EXCESS_BYTES, keypoints.b_max);
+
+  WriteLEInt64(packet->packet + INDEX_INIT_OFFSET, keypoints.init_offset);
+  WriteLEInt64(packet->packet + INDEX_INIT_GRANULE, keypoints.init_granule);
+
+  if (mIndexCodec != CODEC_RICE) {
+    WriteUint8(packet->packet + INDEX_CODEC, mIndexCodec);
+    if (!payload.empty()) {
+      memcpy(packet->packet + header_size, &payload[0], payload.size());
+    }
+  } else {
+    if (mBlockSize) {
+      WriteLEUint32(packet->packet + INDEX_BLOCK_SIZE,
+                    (ogg_uint32_t)mBlockSize);
+    }
+    unsigned char* entry = packet->packet + INDEX_BLOCK_TABLE_OFFSET;
+    if (mBlockRiceParams) {
+      // Rice code each block with its own parameters, recording where each
+      // starts in the Rice coded data, the offset and granule its deltas
+      // are relative to, and its parameters.
+      BitWriter writer(packet->packet + header_size,
+                       compressed_size - header_size);
+      for (ogg_int64_t k=0; k<num_seekpoints; k++) {
+        ogg_int64_t b = k / mBlockSize;
+        if (k % mBlockSize == 0) {
+          WriteLEInt64(entry + INDEX_BLOCK_BIT_OFFSET, writer.BitsWritten());
+          WriteLEInt64(entry + INDEX_BLOCK_BASE_OFFSET, offsets_rounded[k]);
+          WriteLEInt64(entry + INDEX_BLOCK_BASE_GRANULE, granules_rounded[k]);
+          WriteUint8(entry + INDEX_BLOCK_OFFSET_RICE_PARAM, block_offset_params[b]);
+          WriteUint8(entry + INDEX_BLOCK_GRANULE_RICE_PARAM, block_granule_params[b]);
+          entry += entry_size;
+        }
+        rice_write_one(&writer, offset_diffs[k], block_offset_params[b]);
+        rice_write_one(&writer, granule_diffs[k], block_granule_params[b]);
+      }
+      writer.Flush();
+      assert(writer.BitsWritten() == num_bits);
+    } else {
+      // Rice code the keypoints straight into the packet, in chunks coded
+      // on several threads. The tracks are already built in parallel, so
+      // share the processors between them. A partitioned index's chunks
+      // are its blocks, so the coder tells us where each block starts.
+      int threads = max(1, ProcessorCount() / (int)mDecoders.size());
+      vector<ogg_int64_t> block_bits;
+      ogg_int64_t bits =
+        rice_encode_alternate_parallel(packet->packet + header_size,
+                                       compressed_size - header_size,
+                                       &offset_diffs, &granule_diffs,
+                                       offset_rice_param, granule_rice_param,
+                                       threads,
+                                       mBlockSize ? mBlockSize : RICE_CHUNK_PAIRS,
+                                       mBlockSize ? &block_bits : 0);
+      assert(bits == num_bits);
+      for (ogg_int64_t b=0; b<num_blocks; b++) {
+        ogg_int64_t k = b * mBlockSize;
+        WriteLEInt64(entry + INDEX_BLOCK_BIT_OFFSET, block_bits[b]);
+        WriteLEInt64(entry + INDEX_BLOCK_BASE_OFFSET, offsets_rounded[k]);
+        WriteLEInt64(entry + INDEX_BLOCK_BASE_GRANULE, granules_rounded[k]);
+        entry += entry_size;
+      }
+    }
+    assert(!mBlockSize || entry == packet->packet + header_size);
+  }
+
+  return packet;
 }
 
 
 void
 SkeletonEncoder::ConstructPages() {
   
-  assert(mIndexPackets.size() == 2 * mDecoders.size() + 2);
+  assert(mIndexPackets.size() ==
+         2 * mDecoders.size() + 2 + (GetPaddingPacket() ? 1 : 0));
   
   ClearIndexPages();
 
@@ -331,7 +691,16 @@ SkeletonEncoder::ConstructPages() {
   AppendPage(page);
 
   // Normal skeleton header packets...
+  ogg_packet* padding = GetPaddingPacket();
   for (ogg_uint32_t i=1; i<mIndexPackets.size(); i++) {
+    if (mPaddingOwnPages && padding &&
+        (mIndexPackets[i] == padding || mIndexPackets[i-1] == padding)) {
+      // Start a new page for the padding, and another after it.
+      while (ogg_stream_pageout(&state, &page) != 0 ||
+             ogg_stream_flush(&state, &page) != 0) {
+        AppendPage(page);
+      }
+    }
     ret = ogg_stream_packetin(&state, mIndexPackets[i]);
     assert(ret == 0);
   }
@@ -401,6 +770,20 @@ SkeletonEncoder::CorrectOffsets() {
     unsigned char* p = packet->packet + INDEX_INIT_OFFSET;
     ogg_int64_t existing_offset = LEUint64(p);
     WriteLEUint64(p, existing_offset + lengthDiff);
+
+    // Block base offsets are absolute too.
+    if (mBlockSize) {
+      ogg_int64_t num_seekpoints =
+        LEUint64(packet->packet + INDEX_NUM_SEEKPOINTS_OFFSET);
+      ogg_int64_t num_blocks = (num_seekpoints + mBlockSize - 1) / mBlockSize;
+      ogg_int64_t entry_size = mBlockRiceParams ? INDEX_BLOCK_PARAMS_ENTRY_SIZE
+                                                : INDEX_BLOCK_ENTRY_SIZE;
+      for (ogg_int64_t i=0; i<num_blocks; i++) {
+        p = packet->packet + INDEX_BLOCK_TABLE_OFFSET +
+            i * entry_size + INDEX_BLOCK_BASE_OFFSET;
+        WriteLEInt64(p, LEInt64(p) + lengthDiff);
+      }
+    }
   }
 
   // First correct the BOS packet's segment length field.
@@ -414,7 +797,7 @@ SkeletonEncoder::CorrectOffsets() {
 
 // Write out the new skeleton BOS page.
 void
-SkeletonEncoder::WriteBosPage(ofstream& output) {
+SkeletonEncoder::WriteBosPage(ostream& output) {
   assert(mIndexPages.size() > 0);
 
   // Write out the new skeleton page.
@@ -422,7 +805,7 @@ SkeletonEncoder::WriteBosPage(ofstream& output) {
 }
 
 void
-SkeletonEncoder::WritePages(ofstream& output) {
+SkeletonEncoder::WritePages(ostream& output) {
   assert(mIndexPages.size() > 0);
   for (ogg_uint32_t i=1; i<mIndexPages.size(); i++) {
     WritePage(output, *mIndexPages[i]);
@@ -444,18 +827,6 @@ static void ToLower(string& str) {
 #define FISBONE_3_0_HEADER_OFFSET 52
 #define FISBONE_4_0_HEADER_OFFSET 56
 
-// Offset of fisbone fields. All field offsets are the same between Skeleton
-// version 3 and version 4, except Radix, which doesn't exist in version 3.
-#define FISBONE_HEADERS_OFFSET_FIELD_OFFSET 8
-#define FISBONE_SERIALNO_OFFSET 12
-#define FISBONE_NUM_HEADERS_OFFSET 16
-#define FISBONE_GRAN_NUMER_OFFSET 20
-#define FISBONE_GRAN_DENOM_OFFSET 28
-#define FISBONE_START_GRAN_OFFSET 36
-#define FISBONE_PREROLL_OFFSET 44
-#define FISBONE_GRAN_SHIFT_OFFSET 48
-#define FISBONE_RADIX_OFFSET 52
-
 Decoder*
 SkeletonEncoder::FindTrack(ogg_uint32_t serialno) {
   for (unsigned i=0; i<mDecoders.size(); i++) {
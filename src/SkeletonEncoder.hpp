@@ -41,10 +41,63 @@
 
 #include "Decoder.hpp"
 #include "Utils.hpp"
+#include "IndexCodec.hpp"
+
+#if !defined WIN32
+#include <pthread.h>
+#define HAVE_INDEX_THREADS
+#endif
 
 #define SKELETON_VERSION_MAJOR 4
 #define SKELETON_VERSION_MINOR 0
 
+// Minor version of Skeleton tracks whose index packets partition their
+// keypoints into blocks.
+#define SKELETON_VERSION_MINOR_BLOCKED 1
+
+// Minor version of Skeleton tracks whose index blocks each have their own
+// Rice parameters.
+#define SKELETON_VERSION_MINOR_BLOCK_PARAMS 2
+
+// Minor version of Skeleton tracks whose index packets name the coder used
+// for their keypoints.
+#define SKELETON_VERSION_MINOR_CODEC 3
+
+// FIXME: User should be able to control the granularity.  Optimal
+// granularity settings are coupled, with similar error in both time and
+// space.  In one-pass mode, the granularity is coarsened as far as
+// MAX_ROUNDOFF until the index fits the space predicted for it.
+
+// Temporal quantization of 16 samples  FIXME: Should be in terms of time.
+#define GRANULE_ROUNDOFF (4)
+// Spatial granularity of 64 Kibibytes
+#define OFFSET_ROUNDOFF (16)
+// Coarsest granularity CoarsenIndex() goes to, in both time and space.
+#define MAX_ROUNDOFF (30)
+
+// A track's index keypoints, rounded and delta coded ready for the
+// keypoint coder.
+struct IndexKeypoints {
+  vector<ogg_int64_t> offsets;
+  vector<ogg_int64_t> granules;
+  vector<ogg_int64_t> offset_diffs;
+  vector<ogg_int64_t> granule_diffs;
+  ogg_int64_t init_offset;
+  ogg_int64_t init_granule;
+  ogg_int64_t b_max;
+};
+
+// Computes the keypoints to store in a track's index from its seek blocks,
+// rounding offsets and granules to the given number of bits.
+void ComputeIndexKeypoints(Decoder* decoder,
+                           unsigned char offset_roundoff,
+                           unsigned char granule_roundoff,
+                           IndexKeypoints* keypoints);
+
+// Predicts how long a skeleton track indexing decoders' streams in a file
+// of fileLength bytes will be, allowing a margin for the index keypoints.
+ogg_int64_t PredictTrackLength(DecoderMap& decoders, ogg_int64_t fileLength);
+
 class SkeletonEncoder {
 public:
   SkeletonEncoder(DecoderMap& decoders,
@@ -55,10 +108,10 @@ public:
   ~SkeletonEncoder();
   
   // Write out the new skeleton BOS page.
-  void WriteBosPage(ofstream& output);
+  void WriteBosPage(ostream& output);
   
   // Writes out non-bos pages.
-  void WritePages(ofstream& output);
+  void WritePages(ostream& output);
   
   ogg_uint32_t GetIndexSerial() {
     return mSerial;
@@ -69,6 +122,50 @@ public:
   bool Encode();
 
   ogg_int64_t ContentOffset() { return mContentOffset; }
+
+  // Pads the skeleton track so that the content pages keep their offset
+  // within a block of alignment bytes, so a filesystem which supports
+  // reflinks can share them with the input rather than copying them. Must
+  // be called before Encode().
+  void SetContentAlignment(ogg_int64_t alignment) {
+    mContentAlignment = alignment;
+  }
+
+  // Pads the track to exactly length bytes, so that the content goes at a
+  // known offset. Used to re-index in place in the space of the input's
+  // skeleton track, and to fit the space reserved in one-pass mode.
+  // Encode() fails if the track doesn't fit. Passing 0 lets the track be
+  // any length again, and undoes CoarsenIndex(). Must be called before
+  // Encode().
+  void SetTrackLength(ogg_int64_t length);
+
+  // Sets the length of the input the content is copied from, which the
+  // fishead packet's file length is computed from. Must be called before
+  // Encode().
+  void SetFileLength(ogg_int64_t length) {
+    mFileLength = length;
+  }
+
+  // After Encode() has failed to pad the track to SetTrackLength(), returns
+  // how long the track is with no padding. If that's no longer than the
+  // length asked for, the track fits, but no padding makes it exactly that
+  // long.
+  ogg_int64_t GetUnpaddedLength() { return mUnpaddedLength; }
+
+  // Rounds index keypoints off to one more bit in both time and space, so
+  // the index codes in fewer bytes, for the next Encode(). Returns false if
+  // the index is already at its coarsest.
+  bool CoarsenIndex();
+
+  ogg_uint16_t GetVersionMinor() {
+    if (mIndexCodec != CODEC_RICE) {
+      return SKELETON_VERSION_MINOR_CODEC;
+    }
+    if (mBlockRiceParams) {
+      return SKELETON_VERSION_MINOR_BLOCK_PARAMS;
+    }
+    return mBlockSize ? SKELETON_VERSION_MINOR_BLOCKED : SKELETON_VERSION_MINOR;
+  }
 private:
 
   vector<Decoder*> mDecoders;
@@ -83,9 +180,61 @@ private:
 
   unsigned char mGranuleRoundoff;
   unsigned char mOffsetRoundoff;
+
+  // Keypoints per index block, or 0 if the index isn't partitioned.
+  ogg_int64_t mBlockSize;
+
+  // True if each index block has its own Rice parameters.
+  bool mBlockRiceParams;
+
+  // IndexCodecId of the coder used for the index keypoints.
+  unsigned char mIndexCodec;
+
+  // Block size to keep the content's offset within, or 0 to not pad the
+  // track.
+  ogg_int64_t mContentAlignment;
+
+  // Minimum number of bytes of padding to leave in the track, so that a
+  // later run can re-index the file in place.
+  ogg_int64_t mReservedPadding;
+
+  // Length the track must be padded to, or 0 if it can be any length.
+  ogg_int64_t mTrackLength;
+
+  // True if the padding packet goes on pages of its own, rather than
+  // sharing them with the packets either side of it.
+  bool mPaddingOwnPages;
+
+  // Length of the track with no padding, when it couldn't be padded to
+  // mTrackLength.
+  ogg_int64_t mUnpaddedLength;
+
+  // Content offset in the input.
+  ogg_uint64_t mInputContentOffset;
   
   void ConstructIndexPackets();
 
+  // Builds the index packets of tracks from mNextTrack onwards, until
+  // there are none left, storing them and what they report in
+  // mTrackPackets and mTrackReports. Runs on several threads at once.
+  void ConstructTrackIndexes();
+
+  // Builds decoder's index packet, writing what it reports to report.
+  // Changes nothing but the decoder, so tracks can be built concurrently.
+  ogg_packet* ConstructIndexPacket(Decoder* decoder, ostream& report);
+
+#if defined HAVE_INDEX_THREADS
+  static void* IndexThread(void* encoder);
+#endif
+
+  // Index packets of each track, and what building them reported, while
+  // the tracks are being built.
+  vector<ogg_packet*> mTrackPackets;
+  vector<string> mTrackReports;
+
+  // Next track to build the index packets of.
+  ogg_uint32_t mNextTrack;
+
   void ConstructPages();
 
   void AppendPage(ogg_page& page);
@@ -93,8 +242,28 @@ private:
   void ClearIndexPages();
   void CorrectOffsets();
 
+  // Frees the packets and pages of any earlier Encode().
+  void ClearIndexPackets();
+
   void AddBosPacket();
   void AddEosPacket();
+
+  // Adds a padding packet holding length bytes after its magic. Must come
+  // just before the EOS packet.
+  void AddPaddingPacket(ogg_int64_t length);
+
+  // Returns the padding packet, or 0 if the track has none.
+  ogg_packet* GetPaddingPacket();
+
+  // Resizes the padding packet to hold length bytes after its magic.
+  void SetPaddingLength(ogg_int64_t length);
+
+  // Resizes the padding, keeping at least min_padding bytes, so that the
+  // track's length is congruent to length modulo modulus, or equal to it
+  // if modulus is 0. Returns false if no padding does.
+  bool PadTrack(ogg_int64_t length,
+                ogg_int64_t modulus,
+                ogg_int64_t min_padding);
   void AddFisbonePackets();
   
   bool HasFisbonePackets();
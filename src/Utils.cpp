@@ -43,7 +43,36 @@
 #include <assert.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <algorithm>
+#if !defined WIN32
+#include <unistd.h>
+#endif
+#if defined __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <linux/fs.h>
+#endif
+
+#if defined __linux__ && !defined FICLONERANGE
+// Headers older than Linux 4.5 lack the generic clone ioctl, which has the
+// same number as btrfs's older BTRFS_IOC_CLONE_RANGE.
+struct file_clone_range {
+  __s64 src_fd;
+  __u64 src_offset;
+  __u64 src_length;
+  __u64 dest_offset;
+};
+#define FICLONERANGE _IOW(0x94, 13, struct file_clone_range)
+#endif
 #include "Utils.hpp"
+#include "IoRing.hpp"
 
 ogg_page*
 Clone(ogg_page* p)
@@ -70,23 +99,37 @@ FreeClone(ogg_page* p)
 
 
 void
-WritePage(ofstream& output, const ogg_page& page) {
+WritePage(ostream& output, const ogg_page& page) {
   output.write((const char*)page.header, page.header_len);
   output.write((const char*)page.body, page.body_len); 
 }
 
 
-// Get the length in bytes of a file. 32bit only, won't work for files larger
-// than 2GB.
 ogg_int64_t
 FileLength(const char* aFileName)
 {
-  ifstream is;
-  is.open (aFileName, ios::binary);
-  is.seekg (0, ios::end);
-  streampos length = is.tellg();
-  is.close();
-  return (ogg_int64_t)length;
+#if defined WIN32
+  struct _stati64 st;
+  if (_stati64(aFileName, &st) != 0) {
+    return -1;
+  }
+#else
+  struct stat st;
+  if (stat(aFileName, &st) != 0) {
+    return -1;
+  }
+#endif
+  return (ogg_int64_t)st.st_size;
+}
+
+int
+ProcessorCount()
+{
+#if defined WIN32
+  return 1;
+#else
+  return max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+#endif
 }
 
 ogg_packet*
@@ -109,6 +152,13 @@ IsIndexPacket(ogg_packet* packet)
          memcmp(packet->packet, HEADER_MAGIC, HEADER_MAGIC_LEN) == 0;
 }
 
+bool
+IsPaddingPacket(ogg_packet* packet)
+{
+  return packet &&
+         packet->bytes >= (long)PADDING_MAGIC_LEN &&
+         memcmp(packet->packet, PADDING_MAGIC, PADDING_MAGIC_LEN) == 0;
+}
 
 #define FILE_BUFFER_SIZE (1024 * 1024)
 
@@ -143,12 +193,12 @@ bool ReadPage(ogg_sync_state* state,
 }
 
 // Returns nuber of bytes skipped to next page, or -1 on failure.
-int PageSeek(ogg_sync_state* state,
-             ogg_page* page,
-             istream& stream,
-             ogg_uint64_t& bytesRead)
+ogg_int64_t PageSeek(ogg_sync_state* state,
+                     ogg_page* page,
+                     istream& stream,
+                     ogg_uint64_t& bytesRead)
 {
-  int retval = 0;
+  ogg_int64_t retval = 0;
   ogg_int32_t bytes = 0;
   ogg_int32_t r = 0;
   ogg_uint64_t intialBytesRead = bytesRead;
@@ -191,7 +241,7 @@ IsPageAtOffset(const string& filename, ogg_int64_t offset, ogg_page* page)
 {
   ifstream file(filename.c_str(), ios::in | ios::binary);
   assert(file);
-  file.seekg((ogg_int32_t)offset, ios_base::beg);
+  file.seekg((std::streamoff)offset, ios_base::beg);
   char* buf = new char[max(page->body_len, page->header_len)];
   file.read(buf, page->header_len);
   assert(file.gcount() == page->header_len);
@@ -237,6 +287,242 @@ CopyFileData(istream& input, ostream& output, ogg_int64_t bytesToCopy)
   delete[] buf;
 }
 
+#if defined __linux__
+
+// Largest amount to ask the kernel to copy in one call. sendfile() copies at
+// most 0x7ffff000 bytes per call anyway.
+#define KERNEL_COPY_CHUNK (1 << 30)
+
+// Copies as much as possible with copy_file_range(), which lets the kernel
+// copy without the data entering user space, and lets filesystems which
+// support it share or server-side copy the data instead. Returns the number
+// of bytes copied, which is short if the filesystems don't support it.
+static ogg_int64_t
+CopyWithCopyFileRange(int in, loff_t inOffset, int out, loff_t outOffset,
+                      ogg_int64_t bytesToCopy)
+{
+  ogg_int64_t copied = 0;
+  while (copied < bytesToCopy) {
+    size_t len = (size_t)min(bytesToCopy - copied,
+                             (ogg_int64_t)KERNEL_COPY_CHUNK);
+    ssize_t n = copy_file_range(in, &inOffset, out, &outOffset, len, 0);
+    if (n <= 0) {
+      break;
+    }
+    copied += n;
+  }
+  return copied;
+}
+
+// Copies as much as possible with sendfile(), which still copies within the
+// kernel. Returns the number of bytes copied.
+static ogg_int64_t
+CopyWithSendfile(int in, off_t inOffset, int out, off_t outOffset,
+                 ogg_int64_t bytesToCopy)
+{
+  // sendfile() writes at the output's file position.
+  if (lseek(out, outOffset, SEEK_SET) != outOffset) {
+    return 0;
+  }
+  ogg_int64_t copied = 0;
+  while (copied < bytesToCopy) {
+    size_t len = (size_t)min(bytesToCopy - copied,
+                             (ogg_int64_t)KERNEL_COPY_CHUNK);
+    ssize_t n = sendfile(out, in, &inOffset, len);
+    if (n <= 0) {
+      break;
+    }
+    copied += n;
+  }
+  return copied;
+}
+
+// Returns the number of bytes to copy before the rest of the range can be
+// shared with the input by CloneToEnd(), or -1 if it can't be shared. Only
+// whole blocks can be shared, so the shared part must start on a block
+// boundary in both files, and must run to the end of the input.
+static ogg_int64_t
+CloneableOffset(int in, ogg_int64_t inOffset, ogg_int64_t outOffset,
+                ogg_int64_t bytesToCopy)
+{
+  struct stat st;
+  if (fstat(in, &st) != 0 ||
+      st.st_blksize <= 0 ||
+      inOffset + bytesToCopy != (ogg_int64_t)st.st_size)
+  {
+    return -1;
+  }
+  ogg_int64_t blockSize = st.st_blksize;
+  ogg_int64_t head = (blockSize - inOffset % blockSize) % blockSize;
+  if (head >= bytesToCopy || (outOffset + head) % blockSize != 0) {
+    return -1;
+  }
+  return head;
+}
+
+// Makes the output share the input's blocks from inOffset to the end of the
+// input, at outOffset, on filesystems which support reflinks. Returns false
+// if the filesystem can't.
+static bool
+CloneToEnd(int in, ogg_int64_t inOffset, int out, ogg_int64_t outOffset)
+{
+  struct file_clone_range range;
+  range.src_fd = in;
+  range.src_offset = inOffset;
+  // Zero length clones to the end of the input.
+  range.src_length = 0;
+  range.dest_offset = outOffset;
+  return ioctl(out, FICLONERANGE, &range) == 0;
+}
+
+// Copies with copy_file_range(), then sendfile(). Sets method to the first
+// which copied anything. Returns the number of bytes copied.
+static ogg_int64_t
+KernelCopy(int in, ogg_int64_t inOffset, int out, ogg_int64_t outOffset,
+           ogg_int64_t bytesToCopy, const char** method)
+{
+  ogg_int64_t copied = CopyWithCopyFileRange(in, inOffset, out, outOffset,
+                                             bytesToCopy);
+  if (copied > 0) {
+    *method = "copy_file_range";
+  }
+  if (copied < bytesToCopy) {
+    ogg_int64_t n = CopyWithSendfile(in, inOffset + copied,
+                                     out, outOffset + copied,
+                                     bytesToCopy - copied);
+    if (n > 0 && copied == 0) {
+      *method = "sendfile";
+    }
+    copied += n;
+  }
+  return copied;
+}
+
+#endif
+
+ogg_int64_t
+FileBlockSize(const string& filename)
+{
+#if defined __linux__
+  struct stat st;
+  if (stat(filename.c_str(), &st) == 0 && st.st_blksize > 0) {
+    return st.st_blksize;
+  }
+#endif
+  return DEFAULT_FILE_BLOCK_SIZE;
+}
+
+bool
+CopyFileRange(const string& inputFilename,
+              ogg_int64_t inputOffset,
+              const string& outputFilename,
+              ogg_int64_t outputOffset,
+              ogg_int64_t bytesToCopy,
+              const char** method)
+{
+  assert(bytesToCopy >= 0);
+  ogg_int64_t copied = 0;
+  *method = "read/write";
+#if defined __linux__
+  int in = open(inputFilename.c_str(), O_RDONLY);
+  int out = open(outputFilename.c_str(), O_WRONLY);
+  if (in != -1 && out != -1) {
+    ogg_int64_t head = CloneableOffset(in, inputOffset, outputOffset,
+                                       bytesToCopy);
+    if (head >= 0) {
+      // Copy the partial block before the shared blocks first, so that the
+      // output ends where they're to be shared.
+      copied = KernelCopy(in, inputOffset, out, outputOffset, head, method);
+      if (copied == head &&
+          CloneToEnd(in, inputOffset + head, out, outputOffset + head))
+      {
+        copied = bytesToCopy;
+        *method = "FICLONERANGE";
+      }
+    }
+    if (copied < bytesToCopy) {
+      copied += KernelCopy(in, inputOffset + copied,
+                           out, outputOffset + copied,
+                           bytesToCopy - copied, method);
+    }
+    if (copied < bytesToCopy) {
+      ogg_int64_t n = RingCopy(in, inputOffset + copied,
+                               out, outputOffset + copied,
+                               bytesToCopy - copied);
+      if (n > 0 && copied == 0) {
+        *method = "io_uring";
+      }
+      copied += n;
+    }
+  }
+  if (in != -1) {
+    close(in);
+  }
+  if (out != -1 && close(out) != 0) {
+    return false;
+  }
+#endif
+  if (copied == bytesToCopy) {
+    return true;
+  }
+
+  // Copy whatever's left through a buffer.
+  ifstream input(inputFilename.c_str(), ios::in | ios::binary);
+  fstream output(outputFilename.c_str(), ios::in | ios::out | ios::binary);
+  if (!input.good() || !output.good()) {
+    return false;
+  }
+  input.seekg((std::streamoff)(inputOffset + copied));
+  output.seekp((std::streamoff)(outputOffset + copied));
+  CopyFileData(input, output, bytesToCopy - copied);
+  output.close();
+  return !output.fail();
+}
+
+bool
+CopyFileToStream(const string& inputFilename,
+                 ogg_int64_t inputOffset,
+                 ostream& output,
+                 int outputFd,
+                 ogg_int64_t bytesToCopy)
+{
+  assert(bytesToCopy >= 0);
+  ogg_int64_t copied = 0;
+#if defined __linux__
+  if (outputFd != -1) {
+    // Write to the descriptor directly, after what the stream has buffered.
+    output.flush();
+    int in = open(inputFilename.c_str(), O_RDONLY);
+    if (in != -1) {
+      copied = RingCopy(in, inputOffset, outputFd, -1, bytesToCopy);
+      close(in);
+    }
+  }
+#endif
+  if (copied < bytesToCopy) {
+    ifstream input(inputFilename.c_str(), ios::in | ios::binary);
+    if (!input.good()) {
+      return false;
+    }
+    input.seekg((std::streamoff)(inputOffset + copied));
+    CopyFileData(input, output, bytesToCopy - copied);
+  }
+  return output.good();
+}
+
+double
+WallClockSeconds()
+{
+#if defined __linux__
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+#else
+  // On Windows clock() measures wall clock time.
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
 ogg_uint32_t
 GetChecksum(ogg_page* page)
 {
@@ -64,14 +64,18 @@ void
 FreeClone(ogg_page* p);
 
 void
-WritePage(ofstream& output, const ogg_page& page);
+WritePage(ostream& output, const ogg_page& page);
 
-// Get the length in bytes of a file. 32bit only, won't work for files larger
-// than 2GB.
+// Get the length in bytes of a file, or -1 if it can't be read. Lengths are
+// 64 bit, provided 32 bit systems build with _FILE_OFFSET_BITS=64.
 ogg_int64_t
 FileLength(const char* aFileName);
 
 
+// Returns the number of processors we can run threads on, at least one.
+int
+ProcessorCount();
+
 static inline ogg_int64_t
 InputFileLength() {
   return FileLength(gOptions.GetInputFilename().c_str());
@@ -83,12 +87,56 @@ Clone(ogg_packet* p);
 bool
 IsIndexPacket(ogg_packet* packet);
 
+bool
+IsPaddingPacket(ogg_packet* packet);
+
 bool
 IsPageAtOffset(const string& filename, ogg_int64_t offset, ogg_page* page);
 
 void
 CopyFileData(istream& input, ostream& output, ogg_int64_t bytesToCopy);
 
+// Block size assumed for files whose filesystem doesn't report one.
+#define DEFAULT_FILE_BLOCK_SIZE 4096
+
+// Returns the preferred I/O block size of the filesystem holding a file.
+ogg_int64_t
+FileBlockSize(const string& filename);
+
+// Copies bytesToCopy bytes from inputOffset in one file to outputOffset in
+// another, which must already exist. On Linux, if the bytes run to the end
+// of the input and have the same offset within a block in both files, the
+// whole blocks are shared with FICLONERANGE on filesystems which support
+// reflinks. Otherwise this uses copy_file_range(), then sendfile(), so that
+// the bytes needn't pass through user space, and filesystems which support
+// server side copies can avoid copying them at all. Anything those can't
+// copy is copied with io_uring where it's available, with several reads and
+// writes in flight, and failing that through a buffer. Stores a description
+// of how the bytes were copied in method. Returns false on failure.
+bool
+CopyFileRange(const string& inputFilename,
+              ogg_int64_t inputOffset,
+              const string& outputFilename,
+              ogg_int64_t outputOffset,
+              ogg_int64_t bytesToCopy,
+              const char** method);
+
+// Copies bytesToCopy bytes from inputOffset in a file to output. If the
+// descriptor output writes to is given as outputFd, rather than -1, the
+// bytes are written to it directly with io_uring where that's available.
+// Returns false on failure.
+bool
+CopyFileToStream(const string& inputFilename,
+                 ogg_int64_t inputOffset,
+                 ostream& output,
+                 int outputFd,
+                 ogg_int64_t bytesToCopy);
+
+// Returns the current wall clock time in seconds, for measuring elapsed
+// times.
+double
+WallClockSeconds();
+
 ogg_uint32_t
 GetChecksum(ogg_page* page);
 
@@ -100,10 +148,10 @@ bool ReadPage(ogg_sync_state* state,
 // Returns number of bytes to next page, or -1 on failure.
 // Fills |page| with next page.
 // Same as ReadPage(), but uses page seek instead.
-int PageSeek(ogg_sync_state* state,
-             ogg_page* page,
-             istream& stream,
-             ogg_uint64_t& bytesRead);
+ogg_int64_t PageSeek(ogg_sync_state* state,
+                     ogg_page* page,
+                     istream& stream,
+                     ogg_uint64_t& bytesRead);
 
 bool IsFisheadPacket(ogg_packet* packet);
 
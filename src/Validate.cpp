@@ -51,6 +51,9 @@
 #include <string.h>
 #include <algorithm>
 #include "Utils.hpp"
+#include "Options.hpp"
+#include "PageScanner.hpp"
+#include "AsyncReader.hpp"
 #include "Decoder.hpp"
 #include "SkeletonEncoder.hpp"
 
@@ -75,29 +78,68 @@ static bool IsCover(OffsetRange original, OffsetRange cover) {
   return cover.start <= original.start && cover.end >= original.end;
 }
 
-static bool IsCovermap(const RangeMap& original, const RangeMap& cover) {
-  RangeMap::const_iterator it = original.begin();
-  while (it != original.end()) {
-    if (!IsCover(it->second, (--cover.upper_bound(it->first))->second)) {
+static bool IsCovermap(const SeekTable& original, const SeekTable& cover) {
+  for (ogg_int64_t i = 0; i < original.Size(); i++) {
+    ogg_int64_t j = cover.Find(original.Granule(i));
+    if (j < 0 || !IsCover(original.Range(i), cover.Range(j))) {
       return false;
     }
-    ++it;
   }
   return true;
 }
 
-static ogg_int64_t MaxWindow(const RangeMap& m) {
+static ogg_int64_t MaxWindow(const SeekTable& m) {
   ogg_int64_t max_window = 0;
-  RangeMap::const_iterator it = m.begin();
-  while (it != m.end()) {
-    max_window = max(max_window, it->second.end - it->second.start);
-    ++it;
+  for (ogg_int64_t i = 0; i < m.Size(); i++) {
+    OffsetRange r = m.Range(i);
+    max_window = max(max_window, r.end - r.start);
   }
   return max_window;
 }
 
+// Returns true if looking up granule a block at a time finds the same
+// keypoint as table, the fully decoded index.
+static bool LookupMatches(const IndexHeader& header,
+                          const SeekTable& table,
+                          ogg_int64_t granule)
+{
+  ogg_int64_t i = table.Find(granule);
+  ogg_int64_t keypoint_granule = -1;
+  OffsetRange range;
+  if (!LookupIndexBlock(header, granule, &keypoint_granule, &range)) {
+    return i < 0;
+  }
+  OffsetRange expected = table.Range(i < 0 ? 0 : i);
+  return i >= 0 &&
+         keypoint_granule == table.Granule(i) &&
+         range.start == expected.start &&
+         range.end == expected.end;
+}
+
+// Checks lookups in a block partitioned index against the fully decoded
+// index. Each lookup decodes a block, so rather than look up every keypoint
+// we try the first and last keypoint of each block, the granule before each
+// block, and granules before and after the whole index.
+static bool BlockLookupsMatch(const IndexHeader& header,
+                              const SeekTable& table)
+{
+  ogg_int64_t last = table.Size() - 1;
+  if (!LookupMatches(header, table, table.Granule(0) - 1) ||
+      !LookupMatches(header, table, table.Granule(last) + 1)) {
+    return false;
+  }
+  for (ogg_int64_t i = 0; i <= last; i += header.block_size) {
+    ogg_int64_t end = min(i + header.block_size - 1, last);
+    if (!LookupMatches(header, table, table.Granule(i)) ||
+        !LookupMatches(header, table, table.Granule(end)) ||
+        (i > 0 && !LookupMatches(header, table, table.Granule(i) - 1))) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool ValidateIndexedOgg(const string& filename) {
-  ifstream input(filename.c_str(), ios::in | ios::binary);
   ogg_sync_state state;
   ogg_int32_t ret = ogg_sync_init(&state);
   assert(ret==0);
@@ -110,7 +152,20 @@ bool ValidateIndexedOgg(const string& filename) {
   bool index_valid = true;
   ogg_int64_t offset = 0, contentOffset = 0;
   
-  while (ReadPage(&state, &page, input, bytesRead))
+  // Scan through a memory mapping where we can, see OggIndex.cpp. We're
+  // validating, so always check page checksums.
+  MappedFile mapped;
+  bool useMapping = mapped.Open(filename.c_str());
+  PageScanner scanner(mapped.Data(), mapped.Length());
+  scanner.SetThreads(gOptions.GetScanThreads());
+  AsyncReader reader;
+  if (!useMapping && !reader.Open(filename.c_str())) {
+    cerr << "FAIL: Can't open " << filename << endl;
+    return false;
+  }
+
+  while (useMapping ? scanner.NextPage(&page)
+                    : ReadPage(&state, &page, reader, bytesRead))
   {
     int serialno = ogg_page_serialno(&page);
     Decoder* decoder = 0;
@@ -140,6 +195,16 @@ bool ValidateIndexedOgg(const string& filename) {
     offset += length;
   }
 
+  if (!useMapping && reader.Failed()) {
+    cerr << "FAIL: Error reading " << filename << endl;
+    index_valid = false;
+  }
+
+  if (useMapping && scanner.BytesSkipped() > 0) {
+    cerr << "WARNING: Skipped " << scanner.BytesSkipped()
+         << " bytes which weren't part of a valid Ogg page!" << endl;
+  }
+
   if (!skeleton) {
     cerr << "FAIL: No skeleton track so therefore no keyframe indexes!" << endl;
     return false;
@@ -164,7 +229,7 @@ bool ValidateIndexedOgg(const string& filename) {
   }
 
   while (itr != skeleton->mIndex.end()) {
-    RangeMap* v = itr->second;
+    PackedIndex* packed = itr->second;
     ogg_uint32_t serialno = itr->first;
     itr++;
     Decoder* decoder = decoders[serialno];
@@ -175,17 +240,32 @@ bool ValidateIndexedOgg(const string& filename) {
       continue;
     }
 
-    if (v->size() == 0) {
+    const SeekTable* v = packed->GetTable();
+    if (!v) {
+      cout << "FAIL: " << decoder->Type() << "/" << serialno
+           << " index keypoints failed to decode." << endl;
+      index_valid = false;
+      continue;
+    }
+
+    if (v->Size() == 0) {
       cerr << "WARNING: " << decoder->Type() << "/" <<  serialno
            << " index has no keyframes" << endl;
       continue;
     }
 
     cout << decoder->Type() << "/" << serialno
-         << " index has " << v->size() << " keypoints." << endl;
+         << " index has " << v->Size() << " keypoints." << endl;
 
     bool valid = IsCovermap(decoder->GetSeekBlocks(), *v);
 
+    if (packed->GetHeader().num_blocks > 0 &&
+        !BlockLookupsMatch(packed->GetHeader(), *v)) {
+      cout << "FAIL: " << decoder->Type() << "/" << serialno
+           << " index block lookups disagree with the decoded index." << endl;
+      index_valid = false;
+    }
+
     if (valid) {
       cout << decoder->Type() << "/" << serialno
            << " index is accurate, with max seek window of "
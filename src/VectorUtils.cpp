@@ -61,6 +61,11 @@ void round_together (vector<ogg_int64_t>* first_out,
   //to ensure that every valid seek has an upper bound.
   tmp1 = (first_in->at(i) + offset1) & mask1;
   tmp2 = (second_in->at(i) + offset2) & mask2;
+  //with coarse rounding, the previous point may round up to the same
+  //values.  The last point is only an upper bound, so it's safe to push
+  //it up further, keeping the points strictly increasing.
+  tmp1 = max(tmp1, first_out->back() + offset1 + 1);
+  tmp2 = max(tmp2, second_out->back() + offset2 + 1);
   first_out->push_back(tmp1);
   second_out->push_back(tmp2);
 }
@@ -100,23 +105,24 @@ void shift_integrate (vector<ogg_int64_t>* integrated,
   }
 }
 
-// Given a RangeMap m, split out its granuleposes and offset start points
+// Given a SeekTable m, split out its granuleposes and offset start points
 // into two new vectors.
 void split_rangemap(vector<ogg_int64_t>* offsets,
                            vector<ogg_int64_t>* gps,
-                           RangeMap const* m,
+                           SeekTable const* m,
                            ogg_int64_t max_granpos) {
-  if (m->size() == 0) {
+  if (m->Size() == 0) {
     return;
   }
-  RangeMap::const_iterator it = m->begin();
+  ogg_int64_t i;
   ogg_int64_t last_end = 0;
-  for(;it != m->end(); ++it) {
-    if (offsets->size() == 0 || it->second.start > offsets->back()) {
-      gps->push_back(it->first);
-      offsets->push_back(it->second.start);
+  for(i = 0; i < m->Size(); i++) {
+    OffsetRange r = m->Range(i);
+    if (offsets->size() == 0 || r.start > offsets->back()) {
+      gps->push_back(m->Granule(i));
+      offsets->push_back(r.start);
     }
-    last_end = it->second.end;
+    last_end = r.end;
   }
   // Add one more point at the end, to ensure finite b_max.
   gps->push_back(max_granpos+1);
@@ -124,18 +130,18 @@ void split_rangemap(vector<ogg_int64_t>* offsets,
 }
 
 // Given vectors of granulepos and start offsets, as well as the global
-// b_max, construct the tightest possible safe RangeMap
-void merge_vectors(RangeMap * m,
+// b_max, construct the tightest possible safe SeekTable
+void merge_vectors(SeekTable * m,
                           vector<ogg_int64_t>*offsets,
                           vector<ogg_int64_t>*gps,
                           ogg_int64_t b_max) {
   ogg_int64_t i;
-  assert(m->size() == 0);
+  assert(m->Size() == 0);
   assert(offsets->size() == gps->size());
-  RangeMap::iterator it = m->end();
+  m->Reserve(gps->size());
   for(i=0; i+1 < gps->size(); i++) {
     OffsetRange r={offsets->at(i), offsets->at(i+1)+b_max};
-    it = m->insert(it,RangePair(gps->at(i),r));
+    m->Insert(gps->at(i), r);
   }
 }
 
@@ -144,17 +150,15 @@ void merge_vectors(RangeMap * m,
 // captured sufficient data.
 ogg_int64_t measure_bmax(vector<ogg_int64_t>* offsets,
                                 vector<ogg_int64_t>* gps,
-                                RangeMap const* m) {
+                                SeekTable const* m) {
   assert(offsets->size() == gps->size());
-  RangeMap::const_iterator it;
   ogg_int64_t i = 0, b_max = 0;
-  while (i < gps->size() && gps->at(i) <= m->begin()->first) {
+  while (i < (ogg_int64_t)gps->size() && gps->at(i) <= m->Granule(0)) {
     ++i;
   }
   for(; i < gps->size(); i++) {
-    it = m->upper_bound(gps->at(i)-1);
-    --it;
-    b_max = max(b_max, it->second.end - offsets->at(i));
+    ogg_int64_t j = m->Find(gps->at(i)-1);
+    b_max = max(b_max, m->Range(j).end - offsets->at(i));
   }
   return b_max;
 }
@@ -24,14 +24,14 @@ void shift_integrate (vector<ogg_int64_t>* integrated,
 
 void split_rangemap(vector<ogg_int64_t>* offsets,
                            vector<ogg_int64_t>* gps,
-                           RangeMap const * m,
+                           SeekTable const * m,
                            ogg_int64_t max_granpos);
 
-void merge_vectors(RangeMap * m,
+void merge_vectors(SeekTable * m,
                           vector<ogg_int64_t>*offsets,
                           vector<ogg_int64_t>*gps,
                           ogg_int64_t b_max);
 
 ogg_int64_t measure_bmax(vector<ogg_int64_t>* offsets,
                                 vector<ogg_int64_t>* gps,
-                                RangeMap const* m);
+                                SeekTable const* m);
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Indexes a sparse theora file larger than 8GB, through a file, a pipe and
+# stdout, and checks each output's content pages match the input's. Run
+# after build-indexer.sh and build-benchmark.sh. Usage:
+#   test-large-file.sh <theora file> [<dir> [<gigabytes>]]
+# <theora file> provides the theora headers. The input is sparse where the
+# filesystem supports it, but <dir> needs room for each output in turn.
+
+THEORA=$1
+DIR=${2:-.}
+GB=${3:-8.5}
+if [ -z "$THEORA" ]; then
+  echo "Usage: $0 <theora file> [<dir> [<gigabytes>]]"
+  exit 1
+fi
+
+IN=$DIR/large.ogg
+HDR=$(./OggIndexBench sparse "$THEORA" "$IN" $GB | sed -n 's/^Content offset: //p')
+if [ -z "$HDR" ]; then
+  exit 1
+fi
+LEN=$(wc -c < "$IN")
+SUM=$(tail -c $((LEN - HDR)) "$IN" | cksum)
+
+FAIL=0
+check() {
+  if [ "$(tail -c $((LEN - HDR)) "$1" | cksum)" != "$SUM" ]; then
+    echo "FAIL: $2 output's content differs from the input's."
+    FAIL=1
+  fi
+  rm -f "$1"
+}
+
+./OggIndex -b 64 -v -o "$DIR/large-indexed.ogg" "$IN" || FAIL=1
+check "$DIR/large-indexed.ogg" "File"
+
+./OggIndex -o - - < "$IN" > "$DIR/large-piped.ogg" || FAIL=1
+check "$DIR/large-piped.ogg" "Piped"
+
+./OggIndex -o - "$IN" > "$DIR/large-stdout.ogg" || FAIL=1
+check "$DIR/large-stdout.ogg" "Stdout"
+
+rm -f "$IN"
+if [ $FAIL -eq 0 ]; then
+  echo "SUCCESS: indexed a $LEN byte file."
+fi
+exit $FAIL